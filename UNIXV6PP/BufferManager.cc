@@ -16,6 +16,10 @@ Devtab::Devtab()
 	// Devtab 的 I/O 请求队列, 我们不用
 	this->d_actf = NULL;
 	this->d_actl = NULL;
+	this->d_bdev = NULL;
+	this->d_bufmgr = NULL;
+	this->d_metaend = 0;
+	this->d_nblocks = 0;
 }
 
 Devtab::~Devtab()
@@ -26,96 +30,271 @@ Devtab::~Devtab()
 /*======================class BufferManager======================*/
 BufferManager::BufferManager()
 {
-	secondfs_c_helper_spin_lock_init(&this->b_queue_lock);
-	secondfs_c_helper_sema_init(&this->b_bFreeList_lock, 1);
-	//nothing to do here
+	int i;
+
+	for (i = 0; i < SECONDFS_NSHARD; i++)
+	{
+		secondfs_c_helper_spin_lock_init(&this->m_shard[i].b_queue_lock);
+		secondfs_c_helper_sema_init(&this->m_shard[i].b_bFreeList_lock, 1);
+	}
+	secondfs_c_helper_spin_lock_init(&this->b_devq_lock);
+	secondfs_c_helper_init_waitqueue_head(&this->b_io_wait);
+	secondfs_c_helper_atomic_set(&this->b_nwrite, 0);
+	secondfs_c_helper_atomic_set(&this->b_nio, 0);
+	secondfs_c_helper_atomic_set(&this->b_npin, 0);
+	secondfs_c_helper_atomic_set(&this->b_ra_hits, 0);
+	secondfs_c_helper_atomic_set(&this->b_ra_misses, 0);
+	secondfs_c_helper_atomic_set(&this->b_ext_hits, 0);
+	secondfs_c_helper_atomic_set(&this->b_ndirty, 0);
+	secondfs_c_helper_mutex_init(&this->b_wb_lock);
+	secondfs_c_helper_atomic_set(&this->b_nalloc, 0);
+	this->m_nbuf = 0;
+	this->m_nmin = 0;
+	this->m_nshard = 1;
+	this->m_gshift = 0;
+	this->m_bh = 0;
+	this->m_Buf = NULL;
+	this->b_wb_list = NULL;
+	this->b_pool = NULL;
 }
 
 BufferManager::~BufferManager()
 {
-	//nothing to do here
+	int i;
+
+	// Free the buffers and Bufs allocated in Initialize()
+	// 释放 Initialize() 中分配的缓冲区和缓存控制块
+	if (this->m_Buf != NULL)
+	{
+		for(i = 0; i < this->m_nbuf; i += (1 << this->m_gshift))
+		{
+			if (this->m_Buf[i].b_addr != NULL)
+				this->EmptyGroup(&this->m_Buf[i]);
+		}
+		secondfs_c_helper_vfree(this->m_Buf);
+	}
+	if (this->b_wb_list != NULL)
+		secondfs_c_helper_vfree(this->b_wb_list);
 }
 
-extern "C" void BufferManager_Initialize(BufferManager *bm) { bm->Initialize(); }
-void BufferManager::Initialize()
+extern "C" int BufferManager_Initialize(BufferManager *bm, int nbuf, int nmin, int gshift, int bh) { return bm->Initialize(nbuf, nmin, gshift, bh); }
+int BufferManager::Initialize(int nbuf, int nmin, int gshift, int bh)
 {
 	int i;
+	int gsize;
 	Buf* bp;
+	BufShard* sh;
+
+	/* buffer_head 后端下每块各有自己的 buffer_head, 不成组
+	 * With buffer_heads every block has its own; no groups */
+	if (bh)
+		gshift = 0;
+	gsize = 1 << gshift;
+	this->m_bh = bh;
+
+	/* 成组时占用一块就占住了整组, 下面的各个下限都按组计算, 缓存控制块也按整组分配
+	 * In group mode holding one Buf pins its whole group, so the minimums
+	 * below count groups, and Bufs come in whole groups */
+	if (nbuf < (SECONDFS_NBUF_MIN << gshift))
+		nbuf = SECONDFS_NBUF_MIN << gshift;
+	nbuf = (nbuf + gsize - 1) & ~(gsize - 1);
+	this->m_gshift = gshift;
+
+	// Allocate Bufs (descriptors) from vmalloc, and each buffer
+	// from kmem_cache. A buffer never crosses a page boundary,
+	// so it can be handed to bio directly.
+	// Descriptors are allocated for the whole nbuf up front; only nmin
+	// buffers are, the rest come on demand in GetBlk().
+	// 缓存控制块数组用 vmalloc 分配; 缓冲区逐个从 kmem_cache 分配.
+	// 缓冲区按自身大小对齐, 不会跨页, 可以直接交给 bio.
+	// 缓存控制块一次分配 nbuf 个, 缓冲区只先分配 nmin 个, 其余在 GetBlk() 中按需分配.
+	this->m_Buf = (Buf *)secondfs_c_helper_vzalloc(sizeof(Buf) * nbuf);
+	if (this->m_Buf == NULL)
+		return -ENOMEM;
+	this->m_nbuf = nbuf;
+
+	// Bflush() and Bwriteback() may take every Buf at once
+	// Bflush() 和 Bwriteback() 最多一次摘下所有缓存块
+	this->b_wb_list = (Buf **)secondfs_c_helper_vzalloc(sizeof(Buf *) * nbuf);
+	if (this->b_wb_list == NULL)
+		return -ENOMEM;
+
+	/* 分片数: 不超过 SECONDFS_NSHARD 的 2 的幂, 且每片至少 SECONDFS_SHARD_MIN_BUFS 块.
+	 * 一个进程可能同时占用同一分片中的好几块 (例如 Bmap), 分片不能太小.
+	 * A power of 2, so that a shard is never too small: one process may
+	 * hold several Bufs of the same shard at once (e.g. in Bmap). */
+	this->m_nshard = 1;
+	/* 一组的盘块落在连续 2^m_gshift 个散列桶中, 同属一个分片, 所以分片数也受散列桶数限制
+	 * A group hashes to 2^m_gshift consecutive buckets of one shard, which bounds the shard count */
+	while (this->m_nshard < SECONDFS_NSHARD && nbuf / (this->m_nshard * 2) >= (SECONDFS_SHARD_MIN_BUFS << gshift)
+		&& this->m_nshard * 2 <= (SECONDFS_NHASH >> gshift))
+		this->m_nshard *= 2;
+
+	/* 下限: 每个分片至少 SECONDFS_NBUF_MIN 个缓冲区 (组) At least SECONDFS_NBUF_MIN buffers (groups) per shard */
+	if (nmin < (SECONDFS_NBUF_MIN << gshift) * this->m_nshard)
+		nmin = (SECONDFS_NBUF_MIN << gshift) * this->m_nshard;
+	nmin = (nmin + gsize - 1) & ~(gsize - 1);
+	if (nmin > nbuf)
+		nmin = nbuf;
+	this->m_nmin = nmin;
+
+	for(i = 0; i < nmin; i += gsize)
+	{
+		if (!this->FillGroup(&this->m_Buf[i], false))
+		{
+			// The destructor frees what has been allocated
+			// 已分配的部分由析构函数释放
+			return -ENOMEM;
+		}
+	}
+	secondfs_c_helper_atomic_set(&this->b_nalloc, nmin);
 
-	this->bFreeList.b_index = -1;
-	this->bFreeList.b_dev = NULL;
-	this->bFreeList.b_blkno = -1;
-	this->bFreeList.b_forw = this->bFreeList.b_back = &(this->bFreeList);
-	this->bFreeList.av_forw = this->bFreeList.av_back = &(this->bFreeList);
-	secondfs_c_helper_mutex_init(&bFreeList.b_modify_lock);
-	secondfs_c_helper_mutex_init(&bFreeList.b_wait_free_lock);
+	for (i = 0; i < this->m_nshard; i++)
+	{
+		sh = &(this->m_shard[i]);
+		sh->bFreeList.b_index = -1;
+		sh->bFreeList.b_dev = NULL;
+		sh->bFreeList.b_blkno = -1;
+		sh->bFreeList.b_forw = sh->bFreeList.b_back = &(sh->bFreeList);
+		sh->bFreeList.av_forw = sh->bFreeList.av_back = &(sh->bFreeList);
+		secondfs_c_helper_mutex_init(&sh->bFreeList.b_modify_lock);
+		secondfs_c_helper_sema_init(&sh->bFreeList.b_wait_free_lock, 1);
+		secondfs_c_helper_init_waitqueue_head(&sh->bFreeList.b_wait);
+
+		/* 热队列只用到 av_forw 和 av_back The hot list only uses av_forw/av_back */
+		sh->bHotList.b_index = -1;
+		sh->bHotList.b_dev = NULL;
+		sh->bHotList.b_blkno = -1;
+		sh->bHotList.b_forw = sh->bHotList.b_back = &(sh->bHotList);
+		sh->bHotList.av_forw = sh->bHotList.av_back = &(sh->bHotList);
+		sh->s_nbuf = sh->b_ncold = sh->b_nhot = 0;
+		sh->s_nempty = 0;
+		sh->s_empty = NULL;
+	}
+
+	/* 清空散列表 */
+	for(i = 0; i < SECONDFS_NHASH; i++)
+	{
+		this->b_hash[i] = NULL;
+	}
 
-	for(i = 0; i < SECONDFS_NBUF; i++)
+	for(i = 0; i < nbuf; i++)
 	{
 		bp = &(this->m_Buf[i]);
+		/* b_index 同时决定 Buf 属于哪个分片 b_index also decides the shard */
 		bp->b_index = i;
-		// Initially all Buf belongs to NODEV(NULL)
-		// 最开始, 所有 Buf 的设备都是 NODEV (NULL)
+		sh = this->ShardOfBuf(bp);
+		// Initially all Buf belongs to NODEV(NULL), and is not hashed
+		// 最开始, 所有 Buf 的设备都是 NODEV (NULL), 不在散列表中
 		bp->b_dev = NULL;
-		bp->b_addr = this->Buffer[i];
-		/* Link them all into NODEV(bFreeList) */
-		/* 初始化NODEV队列 */
-		bp->b_back = &(this->bFreeList);
-		bp->b_forw = this->bFreeList.b_forw;
-		this->bFreeList.b_forw->b_back = bp;
-		this->bFreeList.b_forw = bp;
+		bp->b_blkno = -1;
+		bp->b_hforw = bp->b_hback = NULL;
+		bp->b_bh = NULL;
+		/* Link them all into NODEV(bFreeList of the shard) */
+		/* 初始化NODEV队列 (各分片的 bFreeList) */
+		bp->b_back = &(sh->bFreeList);
+		bp->b_forw = sh->bFreeList.b_forw;
+		sh->bFreeList.b_forw->b_back = bp;
+		sh->bFreeList.b_forw = bp;
 		/* TODO: remove B_BUSY init? */
 		/* 初始化自由队列 */
 		bp->b_flags = Buf::B_BUSY;
-		/* Initialize the MUTEXs */
-		/* 初始化每 Buf 的两个 MUTEX */
+		/* Initialize the locks; b_wait_free_lock starts held, Brelse() below releases it */
+		/* 初始化每 Buf 的锁; b_wait_free_lock 初始为占用状态, 由下面的 Brelse() 释放 */
 		secondfs_c_helper_mutex_init(&bp->b_modify_lock);
-		secondfs_c_helper_mutex_init(&bp->b_wait_free_lock);
+		secondfs_c_helper_sema_init(&bp->b_wait_free_lock, 0);
+		secondfs_c_helper_init_waitqueue_head(&bp->b_wait);
+		secondfs_c_helper_atomic_set(&bp->b_count, 0);
+		secondfs_c_helper_atomic_set(&bp->b_nwant, 0);
+
+		if (i >= nmin)
+		{
+			/* 还没有缓冲区, 不进自由队列; b_wait_free_lock 保持占用. 空队列上只放组首
+			 * No buffer yet; kept off the free lists with b_wait_free_lock
+			 * held. Only the first Buf of a group goes on the empty list */
+			bp->b_flags = 0;
+			if ((i & (gsize - 1)) == 0)
+			{
+				bp->av_forw = sh->s_empty;
+				sh->s_empty = bp;
+			}
+			sh->s_nempty++;
+			continue;
+		}
 
 		/* clear B_BUSY and other flags and put into bFreeList */
+		sh->s_nbuf++;
 		Brelse(bp);
 	}
 	//this->m_DeviceManager = &Kernel::Instance().GetDeviceManager();
-	return;
+	secondfs_dbg(BUFFER, "BufferManager initialized with %d Bufs (%d to %d buffers) in %d shards, %d per group", nbuf, nmin, nbuf, this->m_nshard, gsize);
+	return 0;
 }
 
 extern "C" Buf* BufferManager_GetBlk(BufferManager *bm, Devtab *dev, int blkno) { return bm->GetBlk(dev, blkno); }
 Buf* BufferManager::GetBlk(Devtab *dev, int blkno)
 {
-	Buf* bp;
-	int ret;
+	bool fresh;
+	Buf* bp = this->GetBlkGroup(dev, blkno, &fresh);
 
+	/* 只要这一块; 新取得的组中其余的块留在缓存中, 用到时再读
+	 * Only this block is wanted; the rest of a new group stays cached unread */
+	if (fresh)
+		this->ReleaseSiblings(bp);
+	return bp;
+}
+
+Buf* BufferManager::GetBlkGroup(Devtab *dev, int blkno, bool *fresh)
+{
+	Buf* bp;
+	Buf* leader;
+	int gsize = 1 << this->m_gshift;
+	int base = blkno & ~(gsize - 1);
+	int k;
+	bool filled;
+	/* (dev, blkno) 只会缓存在它所属的分片中, 下面只用这个分片的锁 */
+	BufShard* sh = this->ShardOf(dev, blkno);
+
+	*fresh = false;
 loop:
 	secondfs_dbg(BUFFER, "searching Buf that matches dev %p and blkno %d", dev, blkno);
-	/* Search block cache that match blkno in dev queue */
-	/* 首先在该设备队列中搜索是否有相应的缓存 */
-
-	// CLI/SLI in original UnixV6++ is changed to per Buf mutex here
-	// Because in linux, kernel code is pre-emptive, we must lock the
-	// whole queue first
-	// 将这里的 CLI/SLI 改造成每 Buf 的 MUTEX
-	
-	for(bp = dev->b_forw; bp != (Buf *)dev; bp = bp->b_forw)
+	/* Search block cache that match (dev, blkno) in hash queue */
+	/* 首先在散列队列中搜索是否有相应的缓存 */
+
+	// CLI/SLI in original UnixV6++ is changed to the shard's queue spinlock here.
+	// b_wait_free_lock of a Buf is held as long as the Buf is off the
+	// free list (owned by someone); it is only try-locked under the
+	// spinlock, so that a Buf can never be grabbed twice.
+	// 将这里的 CLI/SLI 改造成分片的队列自旋锁. Buf 不在自由队列中 (被占用) 期间,
+	// 其 b_wait_free_lock 一直被持有; 在自旋锁内只 trylock 它, 保证同一个
+	// Buf 不会被两个进程同时取得.
+	secondfs_c_helper_spin_lock_irq(&sh->b_queue_lock);
+	bp = this->HashLookup(dev, blkno);
+
+	if (bp != NULL)
 	{
-		/* Not that one */
-		/* 不是要找的缓存，则继续 */
-		if(bp->b_blkno != blkno || bp->b_dev != dev)
-			continue;
-
-		secondfs_c_helper_mutex_lock(&bp->b_modify_lock);	// 这个是快锁
-		// If the Buf is used for now, we must wait for it be freed
-		// 我们在这里锁 wait_free_lock, 是为了等待其他正在
-		// 使用该 Buf 的进程使用完毕.
-		
-		if(!secondfs_c_helper_mutex_trylock(&bp->b_wait_free_lock))
+		// Note: down_trylock returns 0 if succeed
+		if(secondfs_c_helper_down_trylock(&bp->b_wait_free_lock) == 0)
+		{
+			secondfs_dbg(BUFFER, "searching Buf(%p/%d): found buf free(not locked); acquired", dev, blkno);
+			// The Buf has been locked successfully.
+			/* Pull out from freeList; NotAvail will unlock queue lock */
+			/* 从自由队列中抽取出来, 在 NotAvail 中会把自旋锁解锁 */
+			this->NotAvail(bp, 0);
+		}
+		else
 		{
-			// If locked now
+			// If locked now, we must wait for it be freed
+			// 我们在这里锁 wait_free_lock, 是为了等待其他正在
+			// 使用该 Buf 的进程使用完毕.
 			secondfs_dbg(BUFFER, "searching Buf(%p/%d): found buf free-locked; wait", dev, blkno);
-			// bp->b_flags |= Buf::B_WANTED;
-			secondfs_c_helper_mutex_unlock(&bp->b_modify_lock);
+			secondfs_c_helper_spin_unlock_irq(&sh->b_queue_lock);
 
-			secondfs_c_helper_mutex_lock(&bp->b_wait_free_lock);	// 这个是慢锁
-			// goto loop;
+			// 告诉 BreadShared() 有人在等, 别再让新的共享者加入
+			// Tell BreadShared() not to let new shared holders in
+			secondfs_c_helper_atomic_inc(&bp->b_nwant);
+			secondfs_c_helper_down(&bp->b_wait_free_lock);	// 这个是慢锁
+			secondfs_c_helper_atomic_dec(&bp->b_nwant);
 
 			// When we finally get the lock, blkno or dev of
 			// this Buf may change. (Other free Buf may be used
@@ -126,34 +305,64 @@ loop:
 
 			secondfs_dbg(BUFFER, "searching Buf(%p/%d): get lock after wait", dev, blkno);
 
-			if (bp->b_blkno != blkno || bp->b_dev != dev || (bp->b_flags & Buf::B_BUSY)) {
+			if (bp->b_blkno != blkno || bp->b_dev != dev) {
 				secondfs_dbg(BUFFER, "searching Buf(%p/%d): blkno/dev not matching anymore; loop", dev, blkno);
-				secondfs_c_helper_mutex_unlock(&bp->b_wait_free_lock);
+				secondfs_c_helper_up(&bp->b_wait_free_lock);
+				secondfs_c_helper_wake_up_sleepers(&bp->b_wait);
 				goto loop;
 			}
-		} else {
-			secondfs_dbg(BUFFER, "searching Buf(%p/%d): found buf free(not locked); acquired", dev, blkno);
-			// The Buf has been locked successfully
+
+			/* 从自由队列中抽取出来 */
+			this->NotAvail(bp, 1);
 		}
-		/* Pull out from freeList */
-		/* 从自由队列中抽取出来 */
-		this->NotAvail(bp, 1);
+
+		this->Reference(bp);
 
 		if (SFDBG_ENA(BUFFERQ)) {
 			Print(dev);
 		}
 
-		secondfs_c_helper_mutex_unlock(&bp->b_modify_lock);
-		
 		return bp;
 	}
 
 	secondfs_dbg(BUFFER, "searching Buf(%p/%d): not found", dev, blkno);
-	secondfs_c_helper_mutex_unlock(&this->bFreeList.b_modify_lock);
+
+	/* @Feng Shun: 缓存池还没长到上限时, 先给一个空的缓存控制块 (组) 分配缓冲区.
+	 * 分配失败 (内存紧张) 就照旧回收自由缓存.
+	 * While the pool is below its limit, give an empty Buf (group) a
+	 * buffer first; fall back to reusing a free one if memory is short. */
+	if (sh->s_empty != NULL)
+	{
+		leader = sh->s_empty;
+		sh->s_empty = leader->av_forw;
+		sh->s_nempty -= gsize;
+		secondfs_c_helper_spin_unlock_irq(&sh->b_queue_lock);
+
+		filled = this->FillGroup(leader, true);
+
+		secondfs_c_helper_spin_lock_irq(&sh->b_queue_lock);
+		if (filled)
+		{
+			sh->s_nbuf += gsize;
+			secondfs_c_helper_atomic_add(&this->b_nalloc, gsize);
+			secondfs_c_helper_spin_unlock_irq(&sh->b_queue_lock);
+			secondfs_dbg(BUFFER, "allocating Buf(%p/%d): new buffer for Buf[%d]", dev, blkno, leader->b_index);
+			goto fill;
+		}
+		leader->av_forw = sh->s_empty;
+		sh->s_empty = leader;
+		sh->s_nempty += gsize;
+	}
+
+	/* Fetch a free Buf (group) that can be locked, cold list first */
+	/* 取自由队列中能够上锁的空闲块 (整组), 按 2Q 规则决定先取冷队列还是热队列 */
+	leader = this->TakeFree(sh, false);
 
 	/* 如果自由队列为空 */
-	if(this->bFreeList.av_forw == &this->bFreeList)
+	if(leader == NULL)
 	{
+		secondfs_c_helper_spin_unlock_irq(&sh->b_queue_lock);
+
 		secondfs_dbg(BUFFER, "allocating Buf(%p/%d): down() the semaphore", dev, blkno);
 		//this->bFreeList.b_flags |= Buf::B_WANTED;
 
@@ -170,67 +379,76 @@ loop:
 		// This will wake up processes waiting. If any, the down()
 		// of that process will instantly decrease it to 0; If none,
 		// the semaphore remains to be 1.
-		secondfs_c_helper_down_trylock(&this->b_bFreeList_lock);
-		secondfs_c_helper_down(&this->b_bFreeList_lock);
+		secondfs_c_helper_down_trylock(&sh->b_bFreeList_lock);
+		secondfs_c_helper_down(&sh->b_bFreeList_lock);
 
 		// When successfully down the semaphore, a Buf must
 		// be freed somewhere. Up it and Re-search.
 		// Unlock (up) is not needed; b_bFreeList_lock
 		// need to keep 0.
-		// 拿到锁之后, bFreeList 的 av_forw, 以及各设备的 Buf 队列仍可能发生变化.
-		// 要回到 loop 重新搜索设备缓存
+		// 拿到锁之后, bFreeList 的 av_forw, 以及散列队列仍可能发生变化.
+		// 要回到 loop 重新搜索
 		secondfs_dbg(BUFFER, "allocating Buf(%p/%d): after down(), go loop", dev, blkno);
 		goto loop;
 	}
-	
 
-	/* Fetch the first free Buf */
-	/* 取自由队列第一个空闲块 */
-	bp = this->bFreeList.av_forw;
-	this->NotAvail(bp, 1);
-	secondfs_dbg(BUFFER, "allocating Buf(%p/%d): NotAvail() Buf[%d]", dev, blkno, bp->b_index);
+	this->UnfreeGroup(leader);
+	secondfs_c_helper_spin_unlock_irq(&sh->b_queue_lock);
+	secondfs_dbg(BUFFER, "allocating Buf(%p/%d): NotAvail() Buf[%d]", dev, blkno, leader->b_index);
 
 	if (SFDBG_ENA(BUFFERQ)) {
 		Print(dev);
 	}
 
 	/* Write it to disk if it was dirty */
-	/* 如果该字符块是延迟写，将其异步写到磁盘上 */
-	// 改: 同步写到磁盘上
-	if(bp->b_flags & Buf::B_DELWRI)
-	{
-		secondfs_dbg(BUFFER, "allocating Buf(%p/%d): Buf[%d] Busy", dev, blkno, bp->b_index);
-		// bp->b_flags |= Buf::B_ASYNC;
-		ret = this->Bwrite(bp);
-		if (ret < 0) {
-			secondfs_err("writing dirty Buf[%d/%p/%d] failed! errno: %d", bp->b_index, bp->b_dev, bp->b_blkno, ret);
-		}
-		// 由于是同步写, 这里还要加一个释放缓存块的操作
-		this->Brelse(bp);
-		secondfs_dbg(BUFFER, "allocating Buf(%p/%d): Buf[%d] Busy -> loop", dev, blkno, bp->b_index);
+	/* 如果该字符块 (组中有块) 是延迟写，将其异步写到磁盘上 */
+	// 写完成时 IODone() 会释放它; 我们去找下一个自由缓存
+	// IODone() releases it when the write completes; look for another one
+	if (this->FlushGroup(leader))
+	{
+		secondfs_dbg(BUFFER, "allocating Buf(%p/%d): Buf[%d] Busy -> Bawrite, loop", dev, blkno, leader->b_index);
 		goto loop;
 	}
 
+fill:
 	// @Feng Shun : Linux 中这里也是临界区, 需要保护
-	secondfs_c_helper_spin_lock(&this->b_queue_lock);
+	secondfs_c_helper_spin_lock_irq(&sh->b_queue_lock);
+
+	// Someone else may have brought (dev, blkno) in while we were
+	// not holding the lock. Give this Buf back and use theirs.
+	// 在未持有自旋锁期间, 其他进程可能已为 (dev, blkno) 分配了缓存.
+	// 此时归还本 Buf, 重新搜索.
+	// 成组时一组总是整组换入, 所以 blkno 不在缓存中就说明整组都不在.
+	// In group mode groups are brought in whole, so if blkno is not
+	// cached, nothing of its group is.
+	if (this->HashLookup(dev, blkno) != NULL)
+	{
+		secondfs_c_helper_spin_unlock_irq(&sh->b_queue_lock);
+		secondfs_dbg(BUFFER, "allocating Buf(%p/%d): raced with another allocation; loop", dev, blkno);
+		for (k = 0; k < gsize; k++)
+			this->Brelse(leader + k);
+		goto loop;
+	}
 
 	/* 注意: 这里清除了所有其他位，只设了B_BUSY */
 	//bp->b_flags = Buf::B_BUSY;
-	bp->b_flags = 0;
-
-	/* 从原设备队列中抽出 */
-	bp->b_back->b_forw = bp->b_forw;
-	bp->b_forw->b_back = bp->b_back;
-	/* 加入新的设备队列 */
-	bp->b_forw = dev->b_forw;
-	bp->b_back = (Buf *)dev;
-	dev->b_forw->b_back = bp;
-	dev->b_forw = bp;
+	/* 新块先进冷队列, 元数据直接进热队列; 同组的其他块还没被使用过, 不置 B_REF
+	 * New blocks start cold, metadata starts hot; the rest of the group is
+	 * not referenced yet */
+	for (k = 0; k < gsize; k++)
+	{
+		leader[k].b_flags = (base + k < dev->d_metaend) ? Buf::B_HOT : 0;
+		this->Rehash(leader + k, dev, base + k);
+	}
+	bp = leader + (blkno - base);
+	bp->b_flags |= Buf::B_REF;
+	*fresh = (gsize > 1);
 
-	bp->b_dev = dev;
-	bp->b_blkno = blkno;
+	secondfs_c_helper_spin_unlock_irq(&sh->b_queue_lock);
 
-	secondfs_c_helper_spin_unlock(&this->b_queue_lock);
+	/* 页缓存中已有有效内容时 Bread() 不必读盘 Bread() needs no I/O if the page cache has it */
+	if (this->m_bh)
+		this->AttachBh(bp);
 
 	if (SFDBG_ENA(BUFFERQ)) {
 		secondfs_dbg(BUFFERQ, "allocating Buf(%p/%d/[%d]): queue changed", dev, blkno, bp->b_index);
@@ -243,25 +461,45 @@ loop:
 extern "C" void BufferManager_Brelse(BufferManager *bm, Buf* bp) { bm->Brelse(bp); }
 void BufferManager::Brelse(Buf* bp)
 {
+	unsigned long irqflags;
+	Buf* list;
+	BufShard* sh = this->ShardOfBuf(bp);
+
 	/* 临界资源，比如：在同步读末期会调用这个函数，
 	 * 此时很有可能会产生磁盘中断，同样会调用这个函数。
 	 */
 
 	// Spinlock for substitution of CLI/SLI
 	// 替代 CLI/SLI 的方式 : BufferManager 内的自旋锁, 当然这不是等价的.
-	secondfs_c_helper_spin_lock(&secondfs_buffermanagerp->b_queue_lock);
+	// 异步 I/O 完成时在中断上下文中调用本函数, 所以要保存并关中断.
+	// Called from bio completion (interrupt context) for async I/O,
+	// so interrupts are saved and disabled.
+	irqflags = secondfs_c_helper_spin_lock_irqsave(&sh->b_queue_lock);
 
 	/* 注意以下操作并没有清除B_DELWRI、B_WRITE、B_READ、B_DONE标志
 	 * B_DELWRI表示虽然将该控制块释放到自由队列里面，但是有可能还没有些到磁盘上。
 	 * B_DONE则是指该缓存的内容正确地反映了存储在或应存储在磁盘上的信息 
 	 */
 	bp->b_flags &= ~(Buf::B_WANTED | Buf::B_BUSY | Buf::B_ASYNC);
-	(this->bFreeList.av_back)->av_forw = bp;
-	bp->av_back = this->bFreeList.av_back;
-	bp->av_forw = &(this->bFreeList);
-	this->bFreeList.av_back = bp;
+
+	/* 2Q: 热块放到热队列尾 (LRU), 其余放到冷队列尾 (FIFO)
+	 * Hot Bufs go to the tail of the hot list, the others to the cold list */
+	if (bp->b_flags & Buf::B_HOT)
+	{
+		list = &(sh->bHotList);
+		sh->b_nhot++;
+	}
+	else
+	{
+		list = &(sh->bFreeList);
+		sh->b_ncold++;
+	}
+	(list->av_back)->av_forw = bp;
+	bp->av_back = list->av_back;
+	bp->av_forw = list;
+	list->av_back = bp;
 	
-	secondfs_c_helper_spin_unlock(&secondfs_buffermanagerp->b_queue_lock);
+	secondfs_c_helper_spin_unlock_irqrestore(&sh->b_queue_lock, irqflags);
 
 	secondfs_dbg(BUFFER, "Brelse Buf[%d/%p/%d]", bp->b_index, bp->b_dev, bp->b_blkno);
 	if (SFDBG_ENA(BUFFERQ)) {
@@ -269,82 +507,190 @@ void BufferManager::Brelse(Buf* bp)
 	}
 	// Wake up all processes waiting this Buf to be free
 	// 唤醒等待该缓存块的进程
-	if (secondfs_c_helper_mutex_is_locked(&bp->b_wait_free_lock)) {
-		secondfs_c_helper_mutex_unlock(&bp->b_wait_free_lock);
-	}
+	secondfs_c_helper_up(&bp->b_wait_free_lock);
+	// 在 BreadShared() 中等待的读者不在信号量上睡眠, 另外唤醒
+	// Readers waiting in BreadShared() sleep on b_wait, not on the semaphore
+	secondfs_c_helper_wake_up_sleepers(&bp->b_wait);
 
 	// Wake up processes those are waiting for freeBuf
 	// 唤醒等待空闲缓存块的进程
 	// 尝试 P, 再 V : 结果就是, 若信号量非正, 递增信号量; 否则不递增.
-	secondfs_c_helper_down_trylock(&this->b_bFreeList_lock);
-	secondfs_c_helper_up(&this->b_bFreeList_lock);
+	secondfs_c_helper_down_trylock(&sh->b_bFreeList_lock);
+	secondfs_c_helper_up(&sh->b_bFreeList_lock);
 
 	return;
 }
 
-#if false
+extern "C" void BufferManager_IOWait(BufferManager *bm, Buf* bp) { bm->IOWait(bp); }
 void BufferManager::IOWait(Buf* bp)
 {
-	User& u = Kernel::Instance().GetUser();
-
 	/* 这里涉及到临界区
 	 * 因为在执行这段程序的时候，很有可能出现硬盘中断，
 	 * 在硬盘中断中，将会修改B_DONE如果此时已经进入循环
 	 * 则将使得改进程永远睡眠
 	 */
-	X86Assembly::CLI();
-	while( (bp->b_flags & Buf::B_DONE) == 0 )
-	{
-		u.u_procp->Sleep((unsigned long)bp, ProcessManager::PRIBIO);
-	}
-	X86Assembly::STI();
+	// @Feng Shun: wait_event 先把进程挂到等待队列上再检查 B_DONE,
+	// 不会错过 IODone() 的唤醒.
+	// wait_event() queues us before testing B_DONE, so the wake-up
+	// from IODone() cannot be missed.
+	secondfs_c_helper_wait_event_mask(&bp->b_wait, &bp->b_flags, Buf::B_DONE);
 
-	this->GetError(bp);
+	// this->GetError(bp);
 	return;
 }
-#endif
 
 extern "C" void BufferManager_IODone(BufferManager *bm, Buf* bp) { bm->IODone(bp); }
 void BufferManager::IODone(Buf* bp)
 {
+	// 由 bio 完成回调在中断上下文中调用 (提交失败时由提交者调用)
+	// Called by the bio completion callback in interrupt context
+	// (or by the submitter if the bio could not be submitted)
+	secondfs_dbg(BUFFER, "IODone Buf[%d/%p/%d|%X]", bp->b_index, bp->b_dev, bp->b_blkno, bp->b_flags);
+
+	if (bp->b_flags & Buf::B_WRITE)
+	{
+		/* 写操作结束, 若这是最后一个未完成的写, 唤醒 Bflush() */
+		bp->b_flags &= ~Buf::B_WRITE;
+		if (secondfs_c_helper_atomic_dec_and_test(&this->b_nwrite))
+			secondfs_c_helper_wake_up(&this->b_io_wait);
+	}
+
 	/* 置上I/O完成标志 */
 	bp->b_flags |= Buf::B_DONE;
 	if(bp->b_flags & Buf::B_ASYNC)
 	{
+		/* 异步读 (预读) 出错, 缓存内容无效, 不能让别人命中 */
+		if ((bp->b_flags & (Buf::B_READ | Buf::B_ERROR)) == (Buf::B_READ | Buf::B_ERROR))
+			bp->b_flags &= ~(Buf::B_DONE | Buf::B_ERROR);
 		/* 如果是异步操作,立即释放缓存块 */
-		// 不会被执行到, 这里没有异步操作
-		// There is no asynchronized operations here
-		// This branch will never be reached
 		this->Brelse(bp);
 	}
 	else
 	{
 		/* 清除B_WANTED标志位 */
 		// bp->b_flags &= (~Buf::B_WANTED);
-
-		// No need to wake; IODone is called by current process
-		// rather than DiskHandler.
-		// 原 UNIXV6PP 中, IODone 由磁盘中断处理函数调用,
-		// 会唤醒所有等待该 Buf I/O 完成的进程.
-		// 本模块中, IODone 在每个 bio 请求后由进程调用,
-		// 所以无需唤醒.
-		// Kernel::Instance().GetProcessManager().WakeUpAll((unsigned long)bp);
+		/* 唤醒在 IOWait() 中等待的进程 */
+		secondfs_c_helper_wake_up(&bp->b_wait);
 	}
-	secondfs_dbg(BUFFER, "IODone Buf[%d/%p/%d]", bp->b_index, bp->b_dev, bp->b_blkno);
+
+	/* @Feng Shun: 最后才减 b_nio: 它归零后 Bdrain() 返回, 缓存池随即可能被释放,
+	 * 此后不能再碰 bp 和 this.
+	 * Drop b_nio last: once it reaches zero Bdrain() returns and the pool
+	 * may be freed, so neither bp nor this may be touched afterwards. */
+	secondfs_c_helper_atomic_dec_and_wake(&this->b_nio, &this->b_io_wait);
 	return;
 }
 
-extern "C" Buf* BufferManager_Bread(BufferManager *bm, Devtab *dev, int blkno) { return bm->Bread(dev, blkno); }
-Buf* BufferManager::Bread(Devtab *dev, int blkno)
+void BufferManager::Strategy(Buf *bp)
+{
+	/* 单个 Buf 就是长度为 1 的一串 */
+	bp->av_forw = NULL;
+	this->StrategyRange(bp);
+}
+
+void BufferManager::StrategyRange(Buf *first)
 {
 	Buf* bp;
-	int ret;
 
+	// @Feng Shun: 原 UnixV6++ 中由设备驱动的 Strategy() 把请求排入设备队列.
+	// 这里直接提交 bio (连续的块合并在一个 bio 中); 完成时 secondfs_end_bio()
+	// 对每个 Buf 调用 IODone().
+	// The chain is submitted right away, merged into as few bios as
+	// possible; secondfs_end_bio() calls IODone() on each Buf.
+	// The chain is linked by av_forw, which is unused while off the free list.
+	for (bp = first; bp != NULL; bp = bp->av_forw)
+	{
+		bp->b_error = 0;
+		secondfs_c_helper_atomic_inc(&this->b_nio);
+		if ((bp->b_flags & Buf::B_READ) == 0)
+			secondfs_c_helper_atomic_inc(&this->b_nwrite);
+	}
+
+	/* buffer_head 后端下每块一个 submit_bh(), 由块层合并
+	 * One submit_bh() per block with buffer_heads; the block layer merges them */
+	if (this->m_bh)
+	{
+		if (first->b_flags & Buf::B_READ)
+			secondfs_submit_bh_range_read(first);
+		else
+			secondfs_submit_bh_range_write(first, (first->b_flags & Buf::B_ASYNC) == 0);
+	}
+	else if (first->b_flags & Buf::B_READ)
+		secondfs_submit_bio_range_read(first);
+	else
+		secondfs_submit_bio_range_write(first, (first->b_flags & Buf::B_ASYNC) == 0);
+}
+
+void BufferManager::StrategyGroup(Buf *bp)
+{
+	Buf* leader = this->Leader(bp);
+	Buf* head = NULL;
+	Buf* tail = NULL;
+	Buf* sp;
+	int nblocks = bp->b_dev->d_nblocks;
+	int k;
+
+	// @Feng Shun: bp 已构成读请求. 新换入的组中其余的块还由我们占用, 把卷内的
+	// 那些作为异步读和 bp 一起提交, 读完由 IODone() 释放. 一组共用一个缓冲区,
+	// 整组在 bio 中只占一段. 卷的大小还不知道 (正在读超块) 时只读 bp.
+	// bp is set up for reading. The rest of the new group is still ours;
+	// the blocks inside the volume go along as asynchronous reads, released
+	// by IODone(). A group shares one buffer, so it is a single bio segment.
+	// Only bp is read while the volume size is not known yet.
+	for (k = 0; k < (1 << this->m_gshift); k++)
+	{
+		sp = leader + k;
+		if (sp != bp)
+		{
+			if (sp->b_blkno >= nblocks || bp->b_blkno >= nblocks)
+			{
+				/* 不读, 留在缓存中, 用到时再读 Left cached unread */
+				this->Brelse(sp);
+				continue;
+			}
+			sp->b_flags |= (Buf::B_READ | Buf::B_ASYNC);
+			sp->b_wcount = SECONDFS_BUFFER_SIZE;
+		}
+		if (head == NULL)
+			head = sp;
+		else
+			tail->av_forw = sp;
+		tail = sp;
+	}
+
+	tail->av_forw = NULL;
+	this->StrategyRange(head);
+}
+
+void BufferManager::ReleaseSiblings(Buf *bp)
+{
+	Buf* leader = this->Leader(bp);
+	int k;
+
+	for (k = 0; k < (1 << this->m_gshift); k++)
+	{
+		if (leader + k != bp)
+			this->Brelse(leader + k);
+	}
+}
+
+extern "C" Buf* BufferManager_Bread(BufferManager *bm, Devtab *dev, int blkno) { return bm->Bread(dev, blkno); }
+Buf* BufferManager::Bread(Devtab *dev, int blkno)
+{
 	secondfs_dbg(BUFFER, "Bread Buf: %p/%d", dev, blkno);
 
+	bool fresh;
+	Buf* bp;
+
 	// Search for Buf in memory or allocate Buf in memory
-	/* 根据设备号，字符块号申请缓存 */
-	bp = this->GetBlk(dev, blkno);
+	/* 根据设备号，字符块号申请缓存; 新取得的组整组读入 */
+	bp = this->GetBlkGroup(dev, blkno, &fresh);
+	return this->ReadIn(bp, fresh);
+}
+
+Buf* BufferManager::ReadIn(Buf *bp, bool fresh)
+{
+	int ret = 0;
 
 	// Read done before
 	/* 如果在设备队列中找到所需缓存，即B_DONE已设置，就不需进行I/O操作 */
@@ -355,18 +701,26 @@ Buf* BufferManager::Bread(Devtab *dev, int blkno)
 
 	// Not found/Not read before; submit BIO
 	/* 没有找到相应缓存，构成I/O读请求块 */
+	bp->b_flags &= ~Buf::B_ERROR;
 	bp->b_flags |= Buf::B_READ;
 	bp->b_wcount = SECONDFS_BUFFER_SIZE;
 
 	/* 
-	 * 同步执行该 I/O 请求
+	 * 提交该 I/O 请求, 并同步等待其结束
 	 */
-	secondfs_dbg(BUFFER, "Bread Buf: %p/%d: submit bio", dev, blkno);
+	secondfs_dbg(BUFFER, "Bread Buf: %p/%d: submit bio", bp->b_dev, bp->b_blkno);
 
-	ret = secondfs_submit_bio_sync_read(dev->d_bdev, bp->b_blkno, bp->b_addr);
+	if (fresh)
+		this->StrategyGroup(bp);
+	else
+		this->Strategy(bp);
+	this->IOWait(bp);
+
+	if (bp->b_flags & Buf::B_ERROR)
+		ret = bp->b_error;
 
 	secondfs_dbg(BUFFER, "Bread Buf: %p/%d: after bio, ret=%d,"
-	 	" content: %x %x %x %x %x %x %x %x ...", dev, blkno, ret,
+	 	" content: %x %x %x %x %x %x %x %x ...", bp->b_dev, bp->b_blkno, ret,
 		bp->b_addr[0],
 		bp->b_addr[1],
 		bp->b_addr[2],
@@ -377,9 +731,10 @@ Buf* BufferManager::Bread(Devtab *dev, int blkno)
 		bp->b_addr[7]
 	);
 
-	this->IODone(bp);
-
 	if (ret != 0) {
+		// The content is not valid; don't let others hit it
+		// 缓存内容无效, 不能让别人命中
+		bp->b_flags &= ~(Buf::B_DONE | Buf::B_ERROR);
 		// Returns the errno cast to a pointer
 		// ERR_PTR(ret)
 		Brelse(bp);
@@ -389,71 +744,50 @@ Buf* BufferManager::Bread(Devtab *dev, int blkno)
 	}
 }
 
-#if false
-Buf* BufferManager::Breada(short adev, int blkno, int rablkno)
+extern "C" Buf* BufferManager_Breada(BufferManager *bm, Devtab *dev, int blkno, int rablkno, int nra) { return bm->Breada(dev, blkno, rablkno, nra); }
+Buf* BufferManager::Breada(Devtab *dev, int blkno, int rablkno, int nra)
 {
 	Buf* bp = NULL;	/* 非预读字符块的缓存Buf */
-	Buf* abp;		/* 预读字符块的缓存Buf */
-	short major = Utility::GetMajor(adev);	/* 主设备号 */
+	bool fresh;
+	int ret = 0;
+
+	secondfs_dbg(BUFFER, "Breada Buf: %p/%d, ra %d+%d", dev, blkno, rablkno, nra);
 
 	/* 当前字符块是否已在设备Buf队列中 */
-	if( !this->InCore(adev, blkno) )
+	if( !this->InCore(dev, blkno) )
 	{
-		bp = this->GetBlk(adev, blkno);		/* 若没找到，GetBlk()分配缓存 */
-		
+		bp = this->GetBlkGroup(dev, blkno, &fresh);	/* 若没找到，GetBlk()分配缓存 */
+
 		/* 如果分配到缓存的B_DONE标志已设置，意味着在InCore()检查之后，
 		 * 其它进程碰巧读取同一字符块，因而在GetBlk()中再次搜索的时候
 		 * 发现该字符块已在设备Buf队列缓冲区中，本进程重用该缓存。*/
 		if( (bp->b_flags & Buf::B_DONE) == 0 )
 		{
-			/* 构成读请求块 */
+			/* 构成读请求块, 先提交, 不等待 */
+			bp->b_flags &= ~Buf::B_ERROR;
 			bp->b_flags |= Buf::B_READ;
-			bp->b_wcount = BufferManager::BUFFER_SIZE;
-			/* 驱动块设备进行I/O操作 */
-			this->m_DeviceManager->GetBlockDevice(major).Strategy(bp);
+			bp->b_wcount = SECONDFS_BUFFER_SIZE;
+			if (fresh)
+				this->StrategyGroup(bp);
+			else
+				this->Strategy(bp);
 		}
 	}
-	else
-		/*UNIX V6没这条语句。加入的原因：如果当前块在缓存池中，放弃预读
-		 * 这是因为，预读的价值在于利用当前块和预读块磁盘位置大概率邻近的事实，
-		 * 用预读操作减少磁臂移动次数提高有效磁盘读带宽。若当前块在缓存池，磁头不一定在当前块所在的位置，
-		 * 此时预读，收益有限*/
-		rablkno = 0;
+	/* @Feng Shun: UNIX V6++ 在当前块已在缓存池中时放弃预读 (磁头不一定在附近).
+	 * 这里预读窗口由调用者 (Inode::ReadAhead()) 决定, 当前块命中正说明
+	 * 之前的异步预读起了作用, 所以照常预读.
+	 * V6++ gave up read-ahead when the current block was cached. The
+	 * window is now decided by the caller, and a hit on the current block
+	 * means read-ahead is paying off, so keep going. */
 
 	/* 预读操作有2点值得注意：
-	 * 1、rablkno为0，说明UNIX打算放弃预读。
-	 *      这是开销与收益的权衡
-	 * 2、若预读字符块在设备Buf队列中，针对预读块的操作已经成功
-	 * 		这是因为：
-	 * 		作为预读块，并非是进程此次读盘的目的。
-	 * 		所以如果不及时释放，将使得预读块一直得不到释放。
-	 * 		而将其释放它依然存在在设备队列中，如果在短时间内
-	 * 		使用这一块，那么依然可以找到。
+	 * 1、rablkno为0，说明调用者打算放弃预读。
+	 * 2、预读块中已在缓存中的, Bprefetch() 直接跳过;
+	 *    其余的异步读入, 读完后由 IODone() 释放, 留在设备队列中等待命中.
 	 * */
-	if( rablkno && !this->InCore(adev, rablkno) )
-	{
-		abp = this->GetBlk(adev, rablkno);	/* 若没找到，GetBlk()分配缓存 */
-		
-		/* 检查B_DONE标志位，理由同上。 */
-		if(abp->b_flags & Buf::B_DONE)
-		{
-			/* 预读字符块已在缓存中，释放占用的缓存。
-			 * 因为进程未必后面一定会使用预读的字符块，
-			 * 也就不会去释放该缓存，有可能导致缓存资源
-			 * 的长时间占用。
-			 */
-			this->Brelse(abp);
-		}
-		else
-		{
-			/* 异步读预读字符块 */
-			abp->b_flags |= (Buf::B_READ | Buf::B_ASYNC);
-			abp->b_wcount = BufferManager::BUFFER_SIZE;
-			/* 驱动块设备进行I/O操作 */
-			this->m_DeviceManager->GetBlockDevice(major).Strategy(abp);
-		}
-	}
-	
+	if( rablkno && nra > 0 )
+		this->Bprefetch(dev, rablkno, nra);
+
 	/* bp == NULL意味着InCore()函数检查时刻，非预读块在设备队列中，
 	 * 但是InCore()只是“检查”，并不“摘取”。经过一段时间执行到此处，
 	 * 有可能该字符块已经重新分配它用。
@@ -463,38 +797,172 @@ Buf* BufferManager::Breada(short adev, int blkno, int rablkno)
 	 */
 	if(NULL == bp)
 	{
-		return (this->Bread(adev, blkno));
+		return (this->Bread(dev, blkno));
 	}
-	
+
 	/* InCore()函数检查时刻未找到非预读字符块，等待I/O操作完成 */
-	this->IOWait(bp);
+	if ((bp->b_flags & Buf::B_DONE) == 0)
+		this->IOWait(bp);
+
+	if (bp->b_flags & Buf::B_ERROR)
+		ret = bp->b_error;
+
+	if (ret != 0) {
+		// Same as Bread(): don't let others hit the invalid content
+		// 与 Bread() 相同: 缓存内容无效, 不能让别人命中
+		bp->b_flags &= ~(Buf::B_DONE | Buf::B_ERROR);
+		Brelse(bp);
+		return (Buf *)(intptr_t)ret;
+	}
 	return bp;
 }
-#endif
+
+extern "C" Buf* BufferManager_BreadShared(BufferManager *bm, Devtab *dev, int blkno, u32 bflags) { return bm->BreadShared(dev, blkno, bflags); }
+Buf* BufferManager::BreadShared(Devtab *dev, int blkno, u32 bflags)
+{
+	Buf* bp;
+	BufShard* sh = this->ShardOf(dev, blkno);
+	bool fresh = false;
+	int joined;
+
+loop:
+	// @Feng Shun: 命中一个已被共享的 Buf 时不加任何锁: 在 RCU 读临界区内
+	// 查散列表, 用 atomic_inc_not_zero() 加入共享者. 加入成功后 Buf 不会
+	// 再被换作他用, 但找到它和加入之间它可能已换过, 所以要再核对一次.
+	// 有人在等待独占时不加入, 让写者先来.
+	// 快速路径不改 b_flags (B_REF/B_HOT), 它已在第一个共享者独占时置过.
+	// A hit on a Buf that is already shared takes no lock at all: the hash
+	// is searched under RCU and the reader joins with atomic_inc_not_zero().
+	// Once joined the Buf cannot change block, but it may have changed
+	// between the lookup and the join, so check again. Back off if a
+	// writer is waiting.
+	// The fast path leaves b_flags alone; the first holder did the 2Q
+	// bookkeeping while it owned the Buf.
+	secondfs_c_helper_rcu_read_lock();
+	bp = this->HashLookupRcu(dev, blkno);
+	if (bp != NULL && !secondfs_c_helper_atomic_inc_not_zero(&bp->b_count))
+		bp = NULL;
+	secondfs_c_helper_rcu_read_unlock();
+
+	if (bp != NULL)
+	{
+		if (bp->b_dev == dev && bp->b_blkno == blkno && secondfs_c_helper_atomic_read(&bp->b_nwant) == 0)
+		{
+			secondfs_dbg(BUFFER, "BreadShared Buf: %p/%d: joined [%d]", dev, blkno, bp->b_index);
+			return bp;
+		}
+		this->BrelseShared(bp);
+	}
+
+	// 慢速路径: 加锁再查一次
+	// Slow path: look again under the shard lock
+	secondfs_c_helper_spin_lock_irq(&sh->b_queue_lock);
+	bp = this->HashLookup(dev, blkno);
+
+	if (bp == NULL)
+	{
+		/* 不在缓存中, 照常独占地分配 Not cached; allocate it exclusively as usual */
+		secondfs_c_helper_spin_unlock_irq(&sh->b_queue_lock);
+		bp = this->GetBlkGroup(dev, blkno, &fresh);
+	}
+	else if (secondfs_c_helper_atomic_read(&bp->b_nwant) == 0 && secondfs_c_helper_atomic_inc_not_zero(&bp->b_count))
+	{
+		/* 共享组在锁内不会解散 (要先独占才能换盘块) The group cannot move to another block under us */
+		secondfs_c_helper_spin_unlock_irq(&sh->b_queue_lock);
+		return bp;
+	}
+	else if (secondfs_c_helper_down_trylock(&bp->b_wait_free_lock) == 0)
+	{
+		/* 空闲, 独占它; NotAvail 会把自旋锁解锁 Free; take it, NotAvail drops the lock */
+		this->NotAvail(bp, 0);
+		this->Reference(bp);
+	}
+	else
+	{
+		// 正被独占 (写者, 或是正在读入它的另一个读者). 不在信号量上排队,
+		// 否则要等到整个共享组解散; 等它变为可加入或空闲.
+		// Owned exclusively, by a writer or by another reader still
+		// reading it in. Queuing on the semaphore would mean waiting for
+		// the whole shared group to finish; wait until we can join it or
+		// it is free instead.
+		secondfs_c_helper_spin_unlock_irq(&sh->b_queue_lock);
+		joined = secondfs_c_helper_wait_event_join(&bp->b_wait, &bp->b_count, &bp->b_nwant, &bp->b_wait_free_lock);
+
+		/* 睡眠期间它可能已换作他用 It may have changed block while we slept */
+		if (bp->b_blkno != blkno || bp->b_dev != dev)
+		{
+			if (joined)
+			{
+				this->BrelseShared(bp);
+			}
+			else
+			{
+				/* 还在自由队列上, 只需放开信号量 Still on the free list; just let go of it */
+				secondfs_c_helper_up(&bp->b_wait_free_lock);
+				secondfs_c_helper_wake_up_sleepers(&bp->b_wait);
+			}
+			goto loop;
+		}
+		if (joined)
+			return bp;
+		this->NotAvail(bp, 1);
+		this->Reference(bp);
+	}
+
+	// 现在独占着 bp: 读入内容, 再把独占转为第一个共享者. 缓存内容和
+	// b_flags 的写入都要先于 b_count 对其他 CPU 可见.
+	// We own bp now: fill it, then turn the exclusive hold into the first
+	// shared one. Content and b_flags must be visible before b_count is.
+	bp->b_flags |= bflags;
+	bp = this->ReadIn(bp, fresh);
+	if ((uintptr_t)bp >= (uintptr_t)-4095)
+		return bp;
+
+	secondfs_c_helper_atomic_set_release(&bp->b_count, 1);
+	secondfs_c_helper_wake_up_sleepers(&bp->b_wait);
+	secondfs_dbg(BUFFER, "BreadShared Buf: %p/%d: shared [%d]", dev, blkno, bp->b_index);
+	return bp;
+}
+
+extern "C" void BufferManager_BrelseShared(BufferManager *bm, Buf* bp) { bm->BrelseShared(bp); }
+void BufferManager::BrelseShared(Buf* bp)
+{
+	/* 计数归零后没人能再加入 (inc_not_zero), 最后一个共享者代表大家释放 Buf
+	 * Nobody can join once the count is zero; the last holder releases the Buf */
+	if (secondfs_c_helper_atomic_dec_and_test(&bp->b_count))
+		this->Brelse(bp);
+}
 
 extern "C" int BufferManager_Bwrite(BufferManager *bm, Buf *bp) { return bm->Bwrite(bp); }
 int BufferManager::Bwrite(Buf *bp)
 {
 	unsigned int flags;
-	int ret;
+	int ret = 0;
 
 	flags = bp->b_flags;
+	if (flags & Buf::B_DELWRI)
+		secondfs_c_helper_atomic_dec(&this->b_ndirty);
+	this->Bunpin(bp);
 	bp->b_flags &= ~(Buf::B_READ | Buf::B_DONE | Buf::B_ERROR | Buf::B_DELWRI);
+	bp->b_flags |= Buf::B_WRITE;
 	bp->b_wcount = SECONDFS_BUFFER_SIZE;		/* 512字节 */
 
-	// Sync write
-	// 同步写
-
-	secondfs_dbg(BUFFER, "Bwrite Buf[%d/%p/%d]: submit bio", bp->b_index, bp->b_dev, bp->b_blkno);
+	secondfs_dbg(BUFFER, "Bwrite Buf[%d/%p/%d]: submit bio%s", bp->b_index, bp->b_dev, bp->b_blkno, (flags & Buf::B_ASYNC) ? " (async)" : "");
 
-	ret = secondfs_submit_bio_sync_write(bp->b_dev->d_bdev, bp->b_blkno, bp->b_addr);
-
-	secondfs_dbg(BUFFER, "Bwrite Buf[%d/%p/%d]: after bio, ret=%d", bp->b_index, bp->b_dev, bp->b_blkno, ret);
-
-	this->IODone(bp);
+	// After this, an async Buf belongs to the I/O; IODone() releases it
+	// 此后异步写的 Buf 归 I/O 所有, 由 IODone() 释放, 不能再碰
+	this->Strategy(bp);
 
 	if( (flags & Buf::B_ASYNC) == 0 )
 	{
+		// Sync write: wait for it
+		// 同步写: 等待写完
+		this->IOWait(bp);
+		if (bp->b_flags & Buf::B_ERROR)
+			ret = bp->b_error;
+
+		secondfs_dbg(BUFFER, "Bwrite Buf[%d/%p/%d]: after bio, ret=%d", bp->b_index, bp->b_dev, bp->b_blkno, ret);
+
 		// After synchronized writing, 
 		// the Buf is released.
 		this->Brelse(bp);
@@ -521,12 +989,53 @@ void BufferManager::Bdwrite(Buf *bp)
 {
 	/* 置上B_DONE允许其它进程使用该磁盘块内容 */
 	secondfs_dbg(BUFFER, "Bdwrite Buf[%d/%p/%d]", bp->b_index, bp->b_dev, bp->b_blkno);
+	/* 记下第一次变脏的时刻, 后台回写按此判断年龄 Remember when it first became dirty */
+	if ((bp->b_flags & Buf::B_DELWRI) == 0)
+	{
+		bp->b_dirty_time = secondfs_c_helper_jiffies();
+		secondfs_c_helper_atomic_inc(&this->b_ndirty);
+	}
 	bp->b_flags |= (Buf::B_DELWRI | Buf::B_DONE);
 	this->Brelse(bp);
+
+	/* 脏块太多时让后台回写立即开始, 免得 GetBlk() 只能拿到脏块
+	 * Start background writeback early when too many Bufs are dirty,
+	 * so that GetBlk() keeps finding clean ones */
+	secondfs_balance_dirty(this);
 	return;
 }
 
-#if false
+void BufferManager::Bpin(Buf *bp)
+{
+	/* @Feng Shun: 用于指向页缓存中新数据块的间接索引表. 数据写到盘上之前
+	 * 写出表, 崩溃后文件里就会露出这些盘块以前的内容; 由 Inode::Unpin() 放开.
+	 * For index tables pointing to new data still in the page cache.
+	 * Written before the data, a crash would expose the old contents of
+	 * those blocks in the file. Inode::Unpin() lets go of them. */
+	if ((bp->b_flags & Buf::B_PIN) == 0)
+	{
+		bp->b_flags |= Buf::B_PIN;
+		secondfs_c_helper_atomic_inc(&this->b_npin);
+	}
+	this->Bdwrite(bp);
+}
+
+void BufferManager::Bunpin(Buf *bp)
+{
+	if (bp->b_flags & Buf::B_PIN)
+	{
+		bp->b_flags &= ~Buf::B_PIN;
+		secondfs_c_helper_atomic_dec(&this->b_npin);
+	}
+}
+
+bool BufferManager::PinFull()
+{
+	/* 成组时钉住一块就占住整组 In group mode a pinned Buf holds its whole group */
+	return secondfs_c_helper_atomic_read(&this->b_npin) >= (this->m_nbuf >> this->m_gshift) / 4;
+}
+
+extern "C" void BufferManager_Bawrite(BufferManager *bm, Buf *bp) { bm->Bawrite(bp); }
 void BufferManager::Bawrite(Buf *bp)
 {
 	/* 标记为异步写 */
@@ -534,7 +1043,119 @@ void BufferManager::Bawrite(Buf *bp)
 	this->Bwrite(bp);
 	return;
 }
-#endif
+
+extern "C" void BufferManager_BawriteRange(BufferManager *bm, Buf *first) { bm->BawriteRange(first); }
+void BufferManager::BawriteRange(Buf *first)
+{
+	Buf* bp;
+
+	// Like Bawrite() on each of them, but as one I/O request
+	// 相当于对每一块 Bawrite(), 只是合并成一个 I/O 请求
+	for (bp = first; bp != NULL; bp = bp->av_forw)
+	{
+		if (bp->b_flags & Buf::B_DELWRI)
+			secondfs_c_helper_atomic_dec(&this->b_ndirty);
+		this->Bunpin(bp);
+		bp->b_flags &= ~(Buf::B_READ | Buf::B_DONE | Buf::B_ERROR | Buf::B_DELWRI);
+		bp->b_flags |= Buf::B_WRITE | Buf::B_ASYNC;
+		bp->b_wcount = SECONDFS_BUFFER_SIZE;
+	}
+
+	secondfs_dbg(BUFFER, "BawriteRange Buf[%d/%p/%d]...: submit bio", first->b_index, first->b_dev, first->b_blkno);
+	this->StrategyRange(first);
+}
+
+extern "C" void BufferManager_Bprefetch(BufferManager *bm, Devtab *dev, int blkno, int nr) { bm->Bprefetch(dev, blkno, nr); }
+void BufferManager::Bprefetch(Devtab *dev, int blkno, int nr)
+{
+	Buf* head = NULL;
+	Buf* tail = NULL;
+	Buf* bp;
+	int gsize = 1 << this->m_gshift;
+	int i, k, n;
+
+	secondfs_dbg(BUFFER, "Bprefetch %p/%d+%d", dev, blkno, nr);
+
+	/* 成组时一次换入一整组 A whole group at a time in group mode */
+	for (i = 0; i < nr; i += n)
+	{
+		n = gsize - ((blkno + i) & (gsize - 1));
+
+		/* 已在缓存中 (或暂时没有自由缓存) 的块打断连续串, 先把已攒的读出去 */
+		bp = this->GetBlkNoWait(dev, blkno + i);
+
+		/* buffer_head 后端: 页缓存中已有的块不必读 Blocks in the page cache need no read */
+		if (bp != NULL && this->m_bh)
+		{
+			this->AttachBh(bp);
+			if (bp->b_flags & Buf::B_DONE)
+			{
+				this->Brelse(bp);
+				bp = NULL;
+			}
+		}
+
+		if (bp == NULL)
+		{
+			if (head != NULL)
+			{
+				this->StrategyRange(head);
+				head = NULL;
+			}
+			continue;
+		}
+
+		/* 构成异步读请求块, 读完后由 IODone() 释放. 组中超出卷尾的块不读 */
+		for (k = 0; k < gsize; k++, bp++)
+		{
+			if (gsize > 1 && bp->b_blkno >= dev->d_nblocks)
+			{
+				this->Brelse(bp);
+				continue;
+			}
+			bp->b_flags |= (Buf::B_READ | Buf::B_ASYNC);
+			bp->b_wcount = SECONDFS_BUFFER_SIZE;
+			bp->av_forw = NULL;
+			if (head == NULL)
+				head = bp;
+			else
+				tail->av_forw = bp;
+			tail = bp;
+		}
+	}
+
+	if (head != NULL)
+		this->StrategyRange(head);
+}
+
+extern "C" int BufferManager_RangeLimit(BufferManager *bm) { return bm->RangeLimit(); }
+int BufferManager::RangeLimit()
+{
+	// A caller holds all Bufs of a range at once; leave enough for others
+	// 调用者会同时占用一串中的所有缓存块, 要给别人留够
+	int limit = secondfs_c_helper_atomic_read(&this->b_nalloc) / 4;
+
+	return limit < SECONDFS_MAX_RANGE_BLOCKS ? limit : SECONDFS_MAX_RANGE_BLOCKS;
+}
+
+extern "C" void BufferManager_Binval(BufferManager *bm, Buf *bp) { bm->Binval(bp); }
+void BufferManager::Binval(Buf *bp)
+{
+	// The content is stale (e.g. the block now belongs to the page cache):
+	// never write it back, never let others hit it
+	// 缓存内容已作废 (例如该块的数据改由页缓存负责): 不写回, 也不能让别人命中
+	secondfs_dbg(BUFFER, "Binval Buf[%d/%p/%d]", bp->b_index, bp->b_dev, bp->b_blkno);
+	if (bp->b_flags & Buf::B_DELWRI)
+		secondfs_c_helper_atomic_dec(&this->b_ndirty);
+	this->Bunpin(bp);
+	/* 也不必再占着热队列 No reason to keep it hot either */
+	bp->b_flags &= ~(Buf::B_DONE | Buf::B_DELWRI | Buf::B_REF | Buf::B_HOT);
+	/* 页缓存中的副本同样作废, 否则以后 AttachBh() 会把它当作有效内容
+	 * The page cache copy is stale too, or AttachBh() would trust it later */
+	if (bp->b_bh != NULL)
+		secondfs_c_helper_clear_buffer_uptodate(bp->b_bh);
+	this->Brelse(bp);
+}
 
 extern "C" void BufferManager_ClrBuf(BufferManager *bm, Buf *bp) { bm->ClrBuf(bp); }
 void BufferManager::ClrBuf(Buf *bp)
@@ -553,49 +1174,176 @@ extern "C" void BufferManager_Bflush(BufferManager *bm, Devtab *dev) { bm->Bflus
 void BufferManager::Bflush(Devtab *dev)
 {
 	Buf* bp;
-	/* 注意：这里之所以要在搜索到一个块之后重新开始搜索，
-	 * 因为在bwite()进入到驱动程序中时有开中断的操作，所以
-	 * 等到bwrite执行完成后，CPU已处于开中断状态，所以很
-	 * 有可能在这期间产生磁盘中断，使得bfreelist队列出现变化，
-	 * 如果这里继续往下搜索，而不是重新开始搜索那么很可能在
-	 * 操作bfreelist队列的时候出现错误。
+	Buf* np;
+	Buf** list = this->b_wb_list;
+	BufShard* sh;
+	int n = 0;
+	int nreq;
+	int i, k;
+	u64 start;
+
+	/* @Feng Shun: 原 UnixV6++ 每写一块就从自由队列头重新搜索 (写的时候开了中断,
+	 * 队列可能已经变了), 写 N 块要扫描 O(N^2) 次, 而且按自由队列的顺序逐块写.
+	 * 这里在各分片的自旋锁内一次扫描就把所有空闲的脏块摘下 (摘下后别人碰不到它们),
+	 * 再按盘块号排序合并, 一起提交, 最后只等待一次.
+	 * V6++ rescanned the free list from its head after every write, which
+	 * is O(N^2) and writes in free-list order. Take all free dirty Bufs in
+	 * one pass instead, then write them sorted and merged, and wait once.
 	 */
-	int ret;
-loop:
-	// 替代 CLI/SLI 的方式 : BufferManager 内的自旋锁, 当然这不是等价的.
-	secondfs_c_helper_spin_lock(&secondfs_buffermanagerp->b_queue_lock);
-	secondfs_dbg(BUFFER, "BufferManager::Bflush: finding dirty Buf...");
-	for(bp = this->bFreeList.av_forw; bp != &(this->bFreeList); bp = bp->av_forw)
+	start = secondfs_c_helper_ktime_get_ns();
+	secondfs_c_helper_mutex_lock(&this->b_wb_lock);
+
+	for (i = 0; i < this->m_nshard; i++)
 	{
-		/* Find all dirty buffers */
-		/* 找出自由队列中所有延迟写的块 */
-		if( (bp->b_flags & Buf::B_DELWRI) && (dev == 0 || dev == bp->b_dev) )
+		sh = &(this->m_shard[i]);
+		secondfs_c_helper_spin_lock_irq(&sh->b_queue_lock);
+		for (k = 0; k < 2; k++)
 		{
-			secondfs_dbg(BUFFER, "writing dirty Buf[%d/%p/%d|%X]...", bp->b_index, bp->b_dev, bp->b_blkno, bp->b_flags);
-			/* Sync write them to disk
-			 */
-			/* @Feng Shun: 在原 Unix V6++ 中, 对于所有脏块,
-			 * 采取的操作仅为"异步写"
-			 * 此处改为 "同步写"
-			 */
-			// bp->b_flags |= Buf::B_ASYNC;
-
-			// NotAvail will unlock queue lock
-			// 在 NotAvail 中会把自旋锁解锁
-			this->NotAvail(bp, 0);
-			ret = this->Bwrite(bp);
-
-			if (ret < 0) {
-				secondfs_err("writing dirty Buf[%d/%p/%d] failed! errno: %d", bp->b_index, bp->b_dev, bp->b_blkno, ret);
+			Buf* head = (k == 0) ? &(sh->bFreeList) : &(sh->bHotList);
+			for(bp = head->av_forw; bp != head; bp = np)
+			{
+				np = bp->av_forw;
+				/* 找出冷热两条自由队列中所有延迟写的块 */
+				if ((dev == 0 || dev == bp->b_dev) && this->TryTakeDirty(bp))
+					list[n++] = bp;
 			}
-
-			goto loop;
 		}
+		secondfs_c_helper_spin_unlock_irq(&sh->b_queue_lock);
 	}
-	secondfs_c_helper_spin_unlock(&secondfs_buffermanagerp->b_queue_lock);
+
+	nreq = this->BwriteSorted(list, n);
+	secondfs_c_helper_mutex_unlock(&this->b_wb_lock);
+
+	/* @Feng Shun: 调用者 (fsync, sync_fs 等) 要求返回时脏块已在磁盘上,
+	 * 所以等待所有写操作完成.
+	 * Callers (fsync, sync_fs, ...) expect the blocks to be on disk
+	 * on return, so wait for all writes in flight. */
+	secondfs_c_helper_wait_event_zero(&this->b_io_wait, &this->b_nwrite);
+
+	if (n != 0)
+		secondfs_dbg(FLUSH, "Bflush: %d dirty Bufs in %d requests, %llu us", n, nreq,
+			(unsigned long long)((secondfs_c_helper_ktime_get_ns() - start) / 1000));
 	return;
 }
 
+extern "C" void BufferManager_Bdrain(BufferManager *bm) { bm->Bdrain(); }
+void BufferManager::Bdrain()
+{
+	/* @Feng Shun: Bflush() 只等写操作. 预读 (Breada(), Bprefetch()) 的异步读
+	 * 完成时 IODone() 还要 Brelse() 缓存, 卸载时必须等它们也结束, 否则缓存池
+	 * 释放后中断里还会访问它.
+	 * Bflush() only waits for writes. Asynchronous read-ahead (Breada(),
+	 * Bprefetch()) still Brelse()s its Buf in IODone(); wait for those too
+	 * before the pool is freed, or the interrupt would touch freed memory. */
+	secondfs_c_helper_wait_event_zero_final(&this->b_io_wait, &this->b_nio);
+}
+
+/* 按 (设备, 盘块号) 排序, 供 BwriteSorted() 合并物理连续的脏块 */
+static int CompareDevBlkno(const void *a, const void *b)
+{
+	const Buf* x = *(Buf* const *)a;
+	const Buf* y = *(Buf* const *)b;
+
+	if (x->b_dev != y->b_dev)
+		return (uintptr_t)x->b_dev < (uintptr_t)y->b_dev ? -1 : 1;
+	if (x->b_blkno != y->b_blkno)
+		return x->b_blkno < y->b_blkno ? -1 : 1;
+	return 0;
+}
+
+int BufferManager::BwriteSorted(Buf **list, int n)
+{
+	struct {u8 data[SECONDFS_BLK_PLUG_SIZE];} __attribute__((aligned(8))) plug;
+	int limit = this->RangeLimit();
+	int nreq = 0;
+	int i, j;
+
+	if (n == 0)
+		return 0;
+
+	/* 按盘块号顺序, 把连续的块合并成一个写请求 Write in blkno order, merging runs */
+	secondfs_c_helper_sort(list, n, sizeof(Buf *), CompareDevBlkno);
+
+	// The plug lets the block layer merge and dispatch the requests together
+	// plug 让块设备层把这些请求攒在一起合并, 再一次性下发
+	secondfs_c_helper_blk_start_plug(&plug);
+	for (i = 0; i < n; i = j)
+	{
+		for (j = i + 1; j < n && j - i < limit && list[j]->b_dev == list[i]->b_dev
+			&& list[j]->b_blkno == list[j - 1]->b_blkno + 1; j++)
+			list[j - 1]->av_forw = list[j];
+		list[j - 1]->av_forw = NULL;
+		/* 提交后这一串归 I/O 所有, 不能再碰 */
+		this->BawriteRange(list[i]);
+		nreq++;
+	}
+	secondfs_c_helper_blk_finish_plug(&plug);
+
+	return nreq;
+}
+
+extern "C" int BufferManager_Bwriteback(BufferManager *bm, unsigned long expire, int ratio) { return bm->Bwriteback(expire, ratio); }
+int BufferManager::Bwriteback(unsigned long expire, int ratio)
+{
+	Buf* bp;
+	Buf* np;
+	Buf** list = this->b_wb_list;
+	BufShard* sh;
+	int ndirty;
+	int nalloc;
+	int over = 0;
+	int n = 0;
+	int i, k;
+	unsigned long now;
+
+	// @Feng Shun: 由后台回写任务 (super.c) 定期调用.
+	// Called periodically by the writeback work (super.c).
+	/* 钉住的脏块写不了, 不算 Pinned dirty Bufs cannot be written; don't count them */
+	ndirty = secondfs_c_helper_atomic_read(&this->b_ndirty) - secondfs_c_helper_atomic_read(&this->b_npin);
+	if (ndirty <= 0)
+		return 0;
+
+	/* 脏块超过现有缓冲区的 ratio% 时, 不论年龄写到 ratio/2 % 以下 */
+	nalloc = secondfs_c_helper_atomic_read(&this->b_nalloc);
+	if (ndirty * 100 > ratio * nalloc)
+		over = ndirty - ratio * nalloc / 200;
+
+	now = secondfs_c_helper_jiffies();
+	secondfs_c_helper_mutex_lock(&this->b_wb_lock);
+
+	/* 扫描一遍自由队列, 摘下所有该写的脏块; 正被占用的脏块等它被释放后再说 */
+	for (i = 0; i < this->m_nshard; i++)
+	{
+		sh = &(this->m_shard[i]);
+		secondfs_c_helper_spin_lock_irq(&sh->b_queue_lock);
+		for (k = 0; k < 2; k++)
+		{
+			Buf* head = (k == 0) ? &(sh->bFreeList) : &(sh->bHotList);
+			for(bp = head->av_forw; bp != head; bp = np)
+			{
+				np = bp->av_forw;
+				if ((bp->b_flags & Buf::B_DELWRI) == 0)
+					continue;
+				if (over <= 0 && now - bp->b_dirty_time < expire)
+					continue;
+				if (this->TryTakeDirty(bp))
+				{
+					list[n++] = bp;
+					over--;
+				}
+			}
+		}
+		secondfs_c_helper_spin_unlock_irq(&sh->b_queue_lock);
+	}
+
+	this->BwriteSorted(list, n);
+	secondfs_c_helper_mutex_unlock(&this->b_wb_lock);
+
+	if (n != 0)
+		secondfs_dbg(BUFFER, "Bwriteback: %d of %d dirty Bufs written", n, ndirty);
+	return n;
+}
+
 #if false
 bool BufferManager::Swap(int blkno, unsigned long addr, int count, enum Buf::BufFlag flag)
 {
@@ -656,14 +1404,15 @@ void BufferManager::GetError(Buf* bp)
 extern "C" void BufferManager_NotAvail(BufferManager *bm, Buf *bp, u32 lockFirst) { bm->NotAvail(bp, lockFirst); }
 void BufferManager::NotAvail(Buf *bp, u32 lockFirst)
 {
+	BufShard* sh = this->ShardOfBuf(bp);
+
 	if (lockFirst) 
-		secondfs_c_helper_spin_lock(&this->b_queue_lock);
+		secondfs_c_helper_spin_lock_irq(&sh->b_queue_lock);
 	/* 从自由队列中取出 */
-	bp->av_back->av_forw = bp->av_forw;
-	bp->av_forw->av_back = bp->av_back;
+	this->Unfree(bp);
 	/* 设置B_BUSY标志 */
 	//bp->b_flags |= Buf::B_BUSY;
-	secondfs_c_helper_spin_unlock(&this->b_queue_lock);
+	secondfs_c_helper_spin_unlock_irq(&sh->b_queue_lock);
 
 	return;
 }
@@ -672,51 +1421,576 @@ extern "C" Buf* BufferManager_InCore(BufferManager *bm, Devtab *adev, int blkno)
 Buf* BufferManager::InCore(Devtab *adev, int blkno)
 {
 	Buf* bp;
-	Devtab* dp;
-	if (adev)
-		dp = adev;
+	BufShard* sh = this->ShardOf(adev, blkno);
+
+	secondfs_c_helper_spin_lock_irq(&sh->b_queue_lock);
+	bp = this->HashLookup(adev, blkno);
+	secondfs_c_helper_spin_unlock_irq(&sh->b_queue_lock);
+
+	return bp;
+}
+
+Buf* BufferManager::GetBlkNoWait(Devtab *dev, int blkno)
+{
+	Buf* leader;
+	int gsize = 1 << this->m_gshift;
+	int base = blkno & ~(gsize - 1);
+	int k;
+	BufShard* sh = this->ShardOf(dev, blkno);
+
+	// Everything is done under the spinlock, so (dev, blkno) cannot
+	// be brought in by someone else in the meantime
+	// 全程持有自旋锁, 期间别人不可能为 (dev, blkno) 分配缓存
+	secondfs_c_helper_spin_lock_irq(&sh->b_queue_lock);
+
+	/* 已在缓存中 (可能正在 I/O), 不需要读 */
+	if (this->HashLookup(dev, blkno) != NULL)
+	{
+		secondfs_c_helper_spin_unlock_irq(&sh->b_queue_lock);
+		return NULL;
+	}
+
+	/* 取一个 (一组) 干净且能上锁的空闲块; 脏块要先写回, 这里不等 */
+	leader = this->TakeFree(sh, true);
+	if(leader == NULL)
+	{
+		secondfs_c_helper_spin_unlock_irq(&sh->b_queue_lock);
+		return NULL;
+	}
+
+	/* 从自由队列中取出 */
+	this->UnfreeGroup(leader);
+
+	/* 预读进来的块还没被使用过, 不置 B_REF; 等真正读到它时才算第一次使用
+	 * A prefetched block is not referenced yet; the first real read is */
+	for (k = 0; k < gsize; k++)
+	{
+		leader[k].b_flags = (base + k < dev->d_metaend) ? Buf::B_HOT : 0;
+		this->Rehash(leader + k, dev, base + k);
+	}
+
+	secondfs_c_helper_spin_unlock_irq(&sh->b_queue_lock);
+	return leader;
+}
+
+void BufferManager::Reference(Buf *bp)
+{
+	/* 2Q: 第二次被使用的块在释放时升入热队列 A re-referenced Buf goes hot on release */
+	if (bp->b_flags & Buf::B_REF)
+		bp->b_flags |= Buf::B_HOT;
+	else
+		bp->b_flags |= Buf::B_REF;
+}
+
+BufShard* BufferManager::ShardOf(Devtab *dev, int blkno)
+{
+	/* 与散列桶一致: 第 i 个散列桶属于第 i % m_nshard 个分片 Same as the hash bucket's shard */
+	return &(this->m_shard[(this->HashIndex(dev, blkno) >> this->m_gshift) & (this->m_nshard - 1)]);
+}
+
+BufShard* BufferManager::ShardOfBuf(Buf *bp)
+{
+	return &(this->m_shard[(bp->b_index >> this->m_gshift) & (this->m_nshard - 1)]);
+}
+
+Buf* BufferManager::Leader(Buf *bp)
+{
+	return this->m_Buf + (bp->b_index & ~((1 << this->m_gshift) - 1));
+}
+
+bool BufferManager::FillGroup(Buf *leader, bool nofs)
+{
+	u8* addr;
+	int k;
+
+	// buffer_head 后端下缓冲区在换到盘块时由 AttachBh() 取得, 这里没什么可分配的
+	// With buffer_heads AttachBh() gets the buffer once the Buf is mapped
+	if (this->m_bh)
+		return true;
+
+	// 成组时一组的缓冲区来自按 SECONDFS_GROUP_SIZE 对齐的 kmem_cache, 不会跨页
+	// In group mode a group's buffer comes from a kmem_cache aligned to
+	// SECONDFS_GROUP_SIZE, so it never crosses a page either
+	if (this->m_gshift == 0)
+		addr = (u8 *)(nofs ? secondfs_c_helper_alloc_buffer_nofs()
+			: secondfs_c_helper_kmem_cache_alloc_Buffer(SECONDFS_BUFFER_SIZE));
 	else
-		dp = (Devtab *)&this->bFreeList;
+		addr = (u8 *)(nofs ? secondfs_c_helper_alloc_group_nofs()
+			: secondfs_c_helper_kmem_cache_alloc_Group(SECONDFS_GROUP_SIZE));
+	if (addr == NULL)
+		return false;
+
+	for (k = 0; k < (1 << this->m_gshift); k++)
+		leader[k].b_addr = addr + k * SECONDFS_BUFFER_SIZE;
+	return true;
+}
+
+void BufferManager::EmptyGroup(Buf *leader)
+{
+	int k;
 
-	for(bp = dp->b_forw; bp != (Buf *)dp; bp = bp->b_forw)
+	if (this->m_bh)
 	{
-		if(bp->b_blkno == blkno && bp->b_dev == adev)
+		if (leader->b_bh != NULL)
+			this->DetachBh(leader);
+		return;
+	}
+
+	if (this->m_gshift == 0)
+		secondfs_c_helper_kmem_cache_free_Buffer(leader->b_addr);
+	else
+		secondfs_c_helper_kmem_cache_free_Group(leader->b_addr);
+
+	for (k = 0; k < (1 << this->m_gshift); k++)
+		leader[k].b_addr = NULL;
+}
+
+void BufferManager::AttachBh(Buf *bp)
+{
+	// @Feng Shun: 在块设备页缓存中找到 (或建立) 该盘块的 buffer_head 并持有其引用,
+	// 引用不放开, 内核就不会回收它所在的页. 挂载时已把块大小设为 512 字节,
+	// __getblk() 不会失败, 但可能为分配页缓存而睡眠, 所以不能在自旋锁内调用.
+	// Finds (or creates) the block's buffer_head in the block device's page
+	// cache and keeps a reference, which pins its page. The block size was
+	// set to 512 bytes at mount time, so __getblk() cannot fail, but it may
+	// sleep allocating the page: never call this under a spinlock.
+	bp->b_bh = secondfs_c_helper_getblk(bp->b_dev->d_bdev, bp->b_blkno);
+	bp->b_addr = secondfs_c_helper_bh_data(bp->b_bh);
+	if (secondfs_c_helper_buffer_uptodate(bp->b_bh))
+		bp->b_flags |= Buf::B_DONE;
+}
+
+void BufferManager::DetachBh(Buf *bp)
+{
+	// 只是放开引用, 不睡眠; 页留在页缓存中, 由内核在内存紧张时回收
+	// Only drops the reference and never sleeps; the page stays in the
+	// page cache until the kernel reclaims it
+	secondfs_c_helper_brelse(bp->b_bh);
+	bp->b_bh = NULL;
+	bp->b_addr = NULL;
+}
+
+Buf* BufferManager::TakeFree(BufShard *sh, bool clean)
+{
+	Buf* lists[2];
+	Buf* bp;
+	int k;
+
+	/* @Feng Shun: 简化的 2Q 替换策略. 新块进冷队列 (bFreeList, FIFO), 被再次使用
+	 * 或是元数据的块进热队列 (bHotList, LRU). 冷队列多于分片的 1/4 时从冷队列
+	 * 回收, 否则从热队列回收. 一次大的顺序读只会冲刷冷队列, 热的 Inode 区,
+	 * 目录和索引块仍留在缓存中.
+	 * Simplified 2Q: new blocks enter the cold list (FIFO); re-referenced
+	 * blocks and metadata enter the hot list (LRU). Victims come from the
+	 * cold list while it holds more than a quarter of the shard, so a large
+	 * sequential scan cannot flush the hot inode-zone, directory and
+	 * indirect blocks.
+	 */
+	if (sh->b_ncold > sh->s_nbuf / 4 || sh->b_nhot == 0)
+	{
+		lists[0] = &(sh->bFreeList);
+		lists[1] = &(sh->bHotList);
+	}
+	else
+	{
+		lists[0] = &(sh->bHotList);
+		lists[1] = &(sh->bFreeList);
+	}
+
+	/* 成组时要整组都空闲才能换出 In group mode the whole group must be free */
+	for (k = 0; k < 2; k++)
+	{
+		for (bp = lists[k]->av_forw; bp != lists[k]; bp = bp->av_forw)
+		{
+			if (this->LockGroup(this->Leader(bp), clean))
+				return this->Leader(bp);
+		}
+	}
+	return NULL;
+}
+
+bool BufferManager::LockGroup(Buf *leader, bool clean)
+{
+	int gsize = 1 << this->m_gshift;
+	int k;
+
+	// A Buf that can be locked is on a free list. Pinned ones are
+	// treated as in use: they may be neither written nor replaced
+	// 能上锁的 Buf 一定在自由队列中. 钉住的当作正被占用: 不能写出也不能换出
+	for (k = 0; k < gsize; k++)
+	{
+		if ((leader[k].b_flags & Buf::B_PIN)
+			|| (clean && (leader[k].b_flags & Buf::B_DELWRI))
+			|| secondfs_c_helper_down_trylock(&leader[k].b_wait_free_lock) != 0)
+			break;
+	}
+	if (k == gsize)
+		return true;
+
+	/* 有一块正被占用 (或是脏的), 放开已锁上的. 持有分片锁期间没人能等它们
+	 * One of them is in use (or dirty); let go of the rest. Nobody can
+	 * have started waiting for them while we hold the shard lock */
+	while (k-- > 0)
+		secondfs_c_helper_up(&leader[k].b_wait_free_lock);
+	return false;
+}
+
+void BufferManager::UnfreeGroup(Buf *leader)
+{
+	int k;
+
+	for (k = 0; k < (1 << this->m_gshift); k++)
+		this->Unfree(leader + k);
+}
+
+bool BufferManager::FlushGroup(Buf *leader)
+{
+	Buf* head = NULL;
+	Buf* tail = NULL;
+	Buf* bp;
+	int gsize = 1 << this->m_gshift;
+	int k;
+
+	for (k = 0; k < gsize; k++)
+	{
+		if (leader[k].b_flags & Buf::B_DELWRI)
+			break;
+	}
+	if (k == gsize)
+		return false;
+
+	/* 连续的脏块合并成一个写请求, 写完由 IODone() 释放; 干净的直接释放
+	 * Runs of dirty Bufs go out as one write each, released by IODone();
+	 * the clean ones are released right away */
+	for (k = 0; k < gsize; k++)
+	{
+		bp = leader + k;
+		if (bp->b_flags & Buf::B_DELWRI)
+		{
+			bp->av_forw = NULL;
+			if (head == NULL)
+				head = bp;
+			else
+				tail->av_forw = bp;
+			tail = bp;
+			continue;
+		}
+		if (head != NULL)
+		{
+			this->BawriteRange(head);
+			head = NULL;
+		}
+		this->Brelse(bp);
+	}
+	if (head != NULL)
+		this->BawriteRange(head);
+	return true;
+}
+
+void BufferManager::Unfree(Buf *bp)
+{
+	BufShard* sh = this->ShardOfBuf(bp);
+
+	bp->av_back->av_forw = bp->av_forw;
+	bp->av_forw->av_back = bp->av_back;
+	/* B_HOT 只在 Buf 被占用时改变, 所以它说明了 bp 在哪条队列上 */
+	if (bp->b_flags & Buf::B_HOT)
+		sh->b_nhot--;
+	else
+		sh->b_ncold--;
+}
+
+bool BufferManager::TryTakeDirty(Buf *bp)
+{
+	// A Buf that can be locked is on the free list; pinned ones wait
+	// for Bunpin()
+	// 能上锁的 Buf 一定在自由队列中; 钉住的要等 Bunpin()
+	if ((bp->b_flags & (Buf::B_DELWRI | Buf::B_PIN)) != Buf::B_DELWRI
+		|| secondfs_c_helper_down_trylock(&bp->b_wait_free_lock) != 0)
+		return false;
+
+	this->Unfree(bp);
+	return true;
+}
+
+void BufferManager::Rehash(Buf *bp, Devtab *dev, int blkno)
+{
+	/* 新旧两个盘块都属于 bp 的分片, 所以散列队列由调用者持有的分片锁保护;
+	 * 设备队列跨分片, 另用 b_devq_lock 保护 (中断已由分片锁关闭)
+	 * Both blocks belong to bp's shard, whose lock the caller holds; the
+	 * device queues span shards and have their own lock */
+	if (bp->b_dev != NULL)
+		this->HashRemove(bp);
+	/* 旧盘块的 buffer_head 不再需要, 新的由调用者放开自旋锁后取得
+	 * The old block's buffer_head goes; the caller attaches the new one
+	 * once the spinlock is dropped */
+	if (bp->b_bh != NULL)
+		this->DetachBh(bp);
+
+	secondfs_c_helper_spin_lock(&this->b_devq_lock);
+	/* 从原设备队列中抽出 */
+	bp->b_back->b_forw = bp->b_forw;
+	bp->b_forw->b_back = bp->b_back;
+	/* 加入新的设备队列 */
+	bp->b_forw = dev->b_forw;
+	bp->b_back = (Buf *)dev;
+	dev->b_forw->b_back = bp;
+	dev->b_forw = bp;
+	secondfs_c_helper_spin_unlock(&this->b_devq_lock);
+
+	bp->b_dev = dev;
+	bp->b_blkno = blkno;
+	/* 加入新的散列队列 */
+	this->HashInsert(bp);
+}
+
+void BufferManager::Unhash(Buf *bp)
+{
+	BufShard* sh = this->ShardOfBuf(bp);
+
+	if (bp->b_dev != NULL)
+		this->HashRemove(bp);
+	if (bp->b_bh != NULL)
+		this->DetachBh(bp);
+
+	/* 从设备队列移到本分片的 NODEV 队列 (bFreeList 的 b_forw 链)
+	 * Move from the device queue to the shard's NODEV queue */
+	secondfs_c_helper_spin_lock(&this->b_devq_lock);
+	bp->b_back->b_forw = bp->b_forw;
+	bp->b_forw->b_back = bp->b_back;
+	bp->b_back = &(sh->bFreeList);
+	bp->b_forw = sh->bFreeList.b_forw;
+	sh->bFreeList.b_forw->b_back = bp;
+	sh->bFreeList.b_forw = bp;
+	secondfs_c_helper_spin_unlock(&this->b_devq_lock);
+
+	bp->b_dev = NULL;
+	bp->b_blkno = -1;
+}
+
+u32 BufferManager::HashIndex(Devtab *dev, int blkno)
+{
+	/* 相邻的盘块落在相邻的散列桶中; 设备指针低位是对齐产生的 0, 舍去.
+	 * 成组时一组落在 2^m_gshift 个对齐的散列桶中 (同一分片)
+	 * A group lands in 2^m_gshift aligned buckets (of one shard) */
+	return (((u32)((uintptr_t)dev >> 6) << this->m_gshift) + (u32)blkno) & (SECONDFS_NHASH - 1);
+}
+
+Buf* BufferManager::HashLookup(Devtab *dev, int blkno)
+{
+	Buf* bp;
+
+	for(bp = this->b_hash[this->HashIndex(dev, blkno)]; bp != NULL; bp = bp->b_hforw)
+	{
+		if(bp->b_blkno == blkno && bp->b_dev == dev)
+			return bp;
+	}
+	return NULL;
+}
+
+Buf* BufferManager::HashLookupRcu(Devtab *dev, int blkno)
+{
+	Buf* bp;
+	int n = 0;
+
+	// @Feng Shun: Buf 不会被释放, 只会被移到别的散列队列中, 所以无锁的读者
+	// 最坏是走到别的队列上而没找到 (调用者退回加锁的查找). 为防止在不停
+	// 移动的 Buf 之间一直走下去, 最多走 m_nbuf 步.
+	// Bufs are moved between chains, never freed, so a lockless reader may
+	// at worst wander onto another chain and miss (the caller then falls
+	// back to the locked lookup). The walk is capped at m_nbuf steps in
+	// case it keeps following moving Bufs.
+	for(bp = (Buf *)secondfs_c_helper_rcu_dereference(&this->b_hash[this->HashIndex(dev, blkno)]);
+		bp != NULL && n < this->m_nbuf;
+		bp = (Buf *)secondfs_c_helper_rcu_dereference(&bp->b_hforw), n++)
+	{
+		if(bp->b_blkno == blkno && bp->b_dev == dev)
 			return bp;
 	}
 	return NULL;
 }
 
+void BufferManager::HashInsert(Buf *bp)
+{
+	Buf** head = &this->b_hash[this->HashIndex(bp->b_dev, bp->b_blkno)];
+
+	/* 先填好 bp 再发布, HashLookupRcu() 可能同时在走这条队列
+	 * Fill in bp before publishing it; HashLookupRcu() may be walking the chain */
+	bp->b_hback = NULL;
+	secondfs_c_helper_rcu_assign_pointer(&bp->b_hforw, *head);
+	if (*head != NULL)
+		(*head)->b_hback = bp;
+	secondfs_c_helper_rcu_assign_pointer(head, bp);
+}
+
+void BufferManager::HashRemove(Buf *bp)
+{
+	/* bp->b_hforw 保持不变, 正停在 bp 上的无锁读者还能走下去
+	 * Leave bp->b_hforw alone, so a lockless reader standing on bp can go on */
+	if (bp->b_hback != NULL)
+		secondfs_c_helper_rcu_assign_pointer(&bp->b_hback->b_hforw, bp->b_hforw);
+	else
+		secondfs_c_helper_rcu_assign_pointer(&this->b_hash[this->HashIndex(bp->b_dev, bp->b_blkno)], bp->b_hforw);
+	if (bp->b_hforw != NULL)
+		bp->b_hforw->b_hback = bp->b_hback;
+	bp->b_hback = NULL;
+}
+
+extern "C" int BufferManager_Reclaimable(BufferManager *bm) { return bm->Reclaimable(); }
+int BufferManager::Reclaimable()
+{
+	int nfree = 0;
+	int over;
+	int i;
+
+	// 由 shrinker 的 count_objects 调用, 不加锁读计数, 只是估计值
+	// Called from the shrinker's count_objects; an unlocked estimate
+	for (i = 0; i < this->m_nshard; i++)
+		nfree += this->m_shard[i].b_ncold + this->m_shard[i].b_nhot;
+
+	over = secondfs_c_helper_atomic_read(&this->b_nalloc) - this->m_nmin;
+	if (over <= 0)
+		return 0;
+	return nfree < over ? nfree : over;
+}
+
+extern "C" int BufferManager_Shrink(BufferManager *bm, int nr) { return bm->Shrink(nr); }
+int BufferManager::Shrink(int nr)
+{
+	Buf* bp;
+	Buf* np;
+	Buf* leader;
+	BufShard* sh;
+	int gsize = 1 << this->m_gshift;
+	int floor = this->m_nmin / this->m_nshard;
+	int freed = 0;
+	int i, j, k;
+
+	// @Feng Shun: 由 shrinker 的 scan_objects 在内存紧张时调用.
+	// 从冷队列头 (最久未用) 开始, 再到热队列, 回收干净且能上锁的自由缓存:
+	// 把它移出散列表, 释放缓冲区, 缓存控制块放回本分片的空队列, 之后
+	// GetBlk() 可以再为它分配缓冲区. 每个分片都不少于 m_nmin 的平均份额.
+	// 无锁的 HashLookupRcu() 可能正停在这个 Buf 上, 但它的 b_count 为 0,
+	// 读者加入不了, 缓存控制块本身也不释放, 所以是安全的.
+	// 按组模式下以整组为单位回收.
+	// Called from the shrinker's scan_objects under memory pressure.
+	// Clean free Bufs that can be locked are taken from the head of the
+	// cold list (least recently used) first, then the hot list: unhashed,
+	// their buffer freed and the descriptor put back on the shard's empty
+	// list for GetBlk() to refill later. No shard goes below its share of
+	// m_nmin. A lockless HashLookupRcu() may stand on such a Buf, but its
+	// b_count is 0 so nobody can join it, and descriptors are never freed.
+	// In group mode whole groups are reclaimed.
+	for (i = 0; i < this->m_nshard && freed < nr; i++)
+	{
+		sh = &(this->m_shard[i]);
+		secondfs_c_helper_spin_lock_irq(&sh->b_queue_lock);
+		for (k = 0; k < 2; k++)
+		{
+			Buf* head = (k == 0) ? &(sh->bFreeList) : &(sh->bHotList);
+			for (bp = head->av_forw; bp != head && freed < nr && sh->s_nbuf - gsize >= floor; bp = np)
+			{
+				np = bp->av_forw;
+				/* 成组时整组一起回收 A whole group at a time in group mode */
+				leader = this->Leader(bp);
+				if (!this->LockGroup(leader, true))
+					continue;
+
+				for (j = 0; j < gsize; j++)
+				{
+					this->Unfree(leader + j);
+					this->Unhash(leader + j);
+					leader[j].b_flags = 0;
+				}
+				this->EmptyGroup(leader);
+
+				/* b_wait_free_lock 保持占用 b_wait_free_lock stays held */
+				leader->av_forw = sh->s_empty;
+				sh->s_empty = leader;
+				sh->s_nempty += gsize;
+				sh->s_nbuf -= gsize;
+				secondfs_c_helper_atomic_add(&this->b_nalloc, -gsize);
+				freed += gsize;
+
+				/* np 可能是同组的, 已不在队列上, 从头再来 np may have been a sibling; start over */
+				if (gsize > 1)
+					np = head->av_forw;
+			}
+		}
+		secondfs_c_helper_spin_unlock_irq(&sh->b_queue_lock);
+	}
+
+	secondfs_dbg(BUFFER, "Shrink: %d of %d buffers freed, %d left", freed, nr, secondfs_c_helper_atomic_read(&this->b_nalloc));
+	return freed;
+}
+
 extern "C" void BufferManager_Print(BufferManager *bm, Devtab *dev) { bm->Print(dev); }
 void BufferManager::Print(Devtab *dev)
 {
 	const int buflen = 1000;
+	// Leave room for the headers of the remaining lists;
+	// the pool may be much longer than what fits in buf
+	// 缓存池可能很大, 超出 buf 的部分不再打印
+	const int buflimit = buflen - 200;
 	char buf[buflen];
 
 	int length = 0;
 
-	length += secondfs_c_helper_sprintf(buf + length, "bFreeList NODEV:");
-	Buf *bp = bFreeList.b_forw;
-	do {
-		if (!bp) {
-			length += secondfs_c_helper_sprintf(buf + length, "(NULL)");
-			break;
-		}
-		length += secondfs_c_helper_sprintf(buf + length, "[%d/%p/%u]->", bp->b_index, bp->b_dev, bp->b_blkno);
-		bp = bp->b_forw;
-	} while (bp != &bFreeList);
-	length += secondfs_c_helper_sprintf(buf + length, "\n");
-
-	length += secondfs_c_helper_sprintf(buf + length, "bFreeList FREE:");
-	bp = bFreeList.av_forw;
-	do {
-		if (!bp) {
-			length += secondfs_c_helper_sprintf(buf + length, "(NULL)");
+	Buf *bp;
+	for (int i = 0; i < this->m_nshard; i++) {
+		BufShard *sh = &(this->m_shard[i]);
+
+		length += secondfs_c_helper_sprintf(buf + length, "shard %d NODEV:", i);
+		bp = sh->bFreeList.b_forw;
+		do {
+			if (!bp) {
+				length += secondfs_c_helper_sprintf(buf + length, "(NULL)");
+				break;
+			}
+			if (length > buflimit) {
+				length += secondfs_c_helper_sprintf(buf + length, "...");
+				break;
+			}
+			length += secondfs_c_helper_sprintf(buf + length, "[%d/%p/%u]->", bp->b_index, bp->b_dev, bp->b_blkno);
+			bp = bp->b_forw;
+		} while (bp != &sh->bFreeList);
+		length += secondfs_c_helper_sprintf(buf + length, "\n");
+
+		length += secondfs_c_helper_sprintf(buf + length, "shard %d FREE:", i);
+		bp = sh->bFreeList.av_forw;
+		do {
+			if (!bp) {
+				length += secondfs_c_helper_sprintf(buf + length, "(NULL)");
+				break;
+			}
+			if (length > buflimit) {
+				length += secondfs_c_helper_sprintf(buf + length, "...");
+				break;
+			}
+			length += secondfs_c_helper_sprintf(buf + length, "[%d/%p/%u]->", bp->b_index, bp->b_dev, bp->b_blkno);
+			bp = bp->av_forw;
+		} while (bp != &sh->bFreeList);
+		length += secondfs_c_helper_sprintf(buf + length, "\n");
+
+		length += secondfs_c_helper_sprintf(buf + length, "shard %d HOT:", i);
+		bp = sh->bHotList.av_forw;
+		do {
+			if (!bp) {
+				length += secondfs_c_helper_sprintf(buf + length, "(NULL)");
+				break;
+			}
+			if (length > buflimit) {
+				length += secondfs_c_helper_sprintf(buf + length, "...");
+				break;
+			}
+			length += secondfs_c_helper_sprintf(buf + length, "[%d/%p/%u]->", bp->b_index, bp->b_dev, bp->b_blkno);
+			bp = bp->av_forw;
+		} while (bp != &sh->bHotList);
+		length += secondfs_c_helper_sprintf(buf + length, "\n");
+
+		if (length > buflimit)
 			break;
-		}
-		length += secondfs_c_helper_sprintf(buf + length, "[%d/%p/%u]->", bp->b_index, bp->b_dev, bp->b_blkno);
-		bp = bp->av_forw;
-	} while (bp != &bFreeList);
-	length += secondfs_c_helper_sprintf(buf + length, "\n");
+	}
 
 	length += secondfs_c_helper_sprintf(buf + length, "Devtab %p DEVBUFS:", dev);
 	if (dev) {
@@ -726,6 +2000,10 @@ void BufferManager::Print(Devtab *dev)
 				length += secondfs_c_helper_sprintf(buf + length, "(NULL)");
 				break;
 			}
+			if (length > buflimit) {
+				length += secondfs_c_helper_sprintf(buf + length, "...");
+				break;
+			}
 			length += secondfs_c_helper_sprintf(buf + length, "[%d/%p/%u]->", bp->b_index, bp->b_dev, bp->b_blkno);
 			bp = bp->b_forw;
 		} while (bp != (Buf *)dev);
@@ -757,8 +2035,10 @@ extern "C" {
 		SECONDFS_B_ERROR = Buf::BufFlag::B_ERROR,	/* I/O因出错而终止 */
 		SECONDFS_B_BUSY = Buf::BufFlag::B_BUSY,		/* 相应缓存正在使用中 Not used */
 		SECONDFS_B_WANTED = Buf::BufFlag::B_WANTED,	/* 有进程正在等待使用该buf管理的资源，清B_BUSY标志SECONDFS_时，要唤醒这种进程 */
-		SECONDFS_B_ASYNC = Buf::BufFlag::B_ASYNC,	/* 异步I/O，不需要等待其结束 Not used */
-		SECONDFS_B_DELWRI = Buf::BufFlag::B_DELWRI	/* 延迟写，在相应缓存要移做他用时，再将其内容写到相应块设备上 Dirty */
+		SECONDFS_B_ASYNC = Buf::BufFlag::B_ASYNC,	/* 异步I/O，不需要等待其结束 */
+		SECONDFS_B_DELWRI = Buf::BufFlag::B_DELWRI,	/* 延迟写，在相应缓存要移做他用时，再将其内容写到相应块设备上 Dirty */
+		SECONDFS_B_REF = Buf::BufFlag::B_REF,		/* 自分配以来已被 GetBlk() 交给使用者过 */
+		SECONDFS_B_HOT = Buf::BufFlag::B_HOT		/* 释放时进入热队列 */
 	;
 
 	SECONDFS_QUICK_WRAP_CONSTRUCTOR_DESTRUCTOR(Buf);
@@ -8,6 +8,7 @@
 #include "BufferManager_c_wrapper.h"
 
 class Buf;
+class BufferManager;
 
 /* Device (Tab) Devtab definition */
 /* 块设备表devtab定义 */
@@ -26,6 +27,9 @@ public:
 	Buf*	d_actl;
 
 	void * /* struct block_device* */	d_bdev;
+	BufferManager*	d_bufmgr;	/* 该设备的缓存管理器, 供 bio 完成回调找到 IODone() The BufferManager serving this device, for bio completion */
+	s32	d_metaend;	/* 盘块号小于它的是元数据 (超块和外存 Inode 区), 缓存时优先保留 Blocks below are metadata (superblock, inode zone) */
+	s32	d_nblocks;	/* 卷的盘块数 (超块的 s_fsize), 成组读入时不越过它; 0 为未知 Blocks in the volume, or 0 if not known yet */
 };
 
 /*
@@ -49,7 +53,11 @@ public:
 		B_BUSY	= 0x10,		/* 相应缓存正在使用中; Not used, replaced by lock mechanism */
 		B_WANTED = 0x20,	/* 有进程正在等待使用该buf管理的资源，清B_BUSY标志时，要唤醒这种进程; Not used, replaced by lock mechanism */
 		B_ASYNC	= 0x40,		/* 异步I/O，不需要等待其结束 */
-		B_DELWRI = 0x80		/* 延迟写，在相应缓存要移做他用时，再将其内容写到相应块设备上(Dirty flag) */
+		B_DELWRI = 0x80,	/* 延迟写，在相应缓存要移做他用时，再将其内容写到相应块设备上(Dirty flag) */
+		B_REF = 0x100,		/* 自分配以来已被 GetBlk() 交给使用者过 (预读进来的块没有) Handed out by GetBlk() since it was allocated */
+		B_HOT = 0x200,		/* 再次被使用过或是元数据, 释放时进入热队列 Re-referenced or metadata; released onto the hot list */
+		B_PIN = 0x400		/* 延迟写, 但指向的文件数据可能还不在盘上, Bunpin() 之前不写出也不换出
+					 * Delayed write pointing to file data that may not be on disk yet; neither written nor replaced until Bunpin() */
 	};
 	
 public:
@@ -91,8 +99,86 @@ public:
 
 	s32		b_index;		/* For debug - the index in BufferManager */
 
+	/* @Feng Shun:
+	 * Hash chain links. Bufs with the same hash value of (b_dev, b_blkno)
+	 * are linked into a NULL-terminated doubly linked list, whose head is
+	 * in BufferManager::b_hash[]. Guarded by the b_queue_lock of the
+	 * BufShard owning the bucket.
+	 * 散列队列勾连指针. (b_dev, b_blkno) 散列值相同的 Buf 串成一条以 NULL
+	 * 结尾的双向链表, 表头在 BufferManager::b_hash[] 中. 由该散列桶所属
+	 * 分片的 b_queue_lock 保护.
+	 */
+	Buf*		b_hforw;
+	Buf*		b_hback;
+
 	struct {u8 data[SECONDFS_MUTEX_SIZE];} __attribute__((packed))	b_modify_lock;
-	struct {u8 data[SECONDFS_MUTEX_SIZE];} __attribute__((packed))	b_wait_free_lock;
+	/* @Feng Shun:
+	 * Held as long as the Buf is off the free list. It is a semaphore
+	 * rather than a mutex, because an asynchronous I/O releases the Buf
+	 * from the bio completion callback, i.e. not in the owner's context.
+	 * Buf 不在自由队列期间一直持有. 异步 I/O 在 bio 完成回调中释放 Buf,
+	 * 释放者不是获取者, 所以用信号量而不是互斥锁.
+	 */
+	struct {u8 data[SECONDFS_SEMAPHORE_SIZE];} __attribute__((packed))	b_wait_free_lock;
+	/* IOWait() 在此等待 IODone() 置上 B_DONE. IOWait() sleeps here until IODone() sets B_DONE */
+	struct {u8 data[SECONDFS_WAIT_QUEUE_HEAD_SIZE];} __attribute__((packed))	b_wait;
+	/* 置上 B_DELWRI 的时刻 (jiffies), 后台回写据此判断脏块的年龄 When B_DELWRI was set (jiffies); used by Bwriteback() */
+	unsigned long	b_dirty_time;
+	/* @Feng Shun:
+	 * (atomic_t) Number of shared holders (BreadShared()), 0 if none.
+	 * While it is non-zero, b_wait_free_lock is held on behalf of all of
+	 * them and the Buf is a valid, read-only copy of its block; the last
+	 * BrelseShared() releases the Buf. Only an exclusive owner may take
+	 * it from 0 to 1, so a lockless reader can join with
+	 * atomic_inc_not_zero() and then trust b_dev and b_blkno.
+	 * (atomic_t) 共享持有者 (BreadShared()) 的个数, 没有则为 0. 非 0 期间
+	 * b_wait_free_lock 代表所有共享者被持有, Buf 是盘块的有效只读副本;
+	 * 最后一个 BrelseShared() 释放 Buf. 只有独占者能把它从 0 置为 1, 所以
+	 * 无锁查找者用 atomic_inc_not_zero() 加入后, b_dev 和 b_blkno 不会再变.
+	 */
+	s32		b_count;
+	/* (atomic_t) 正在等待独占该 Buf 的进程数. 非 0 时新的共享者不再加入,
+	 * 以免写者被源源不断的读者饿死.
+	 * (atomic_t) Processes waiting to own the Buf exclusively. While it is
+	 * non-zero no new shared holder joins, so writers are not starved. */
+	s32		b_nwant;
+	/* @Feng Shun:
+	 * (struct buffer_head *) buffer_head 后端 (挂载选项 bh) 下, 当前盘块在块设备
+	 * 页缓存中的 buffer_head, 持有其引用; b_addr 指向它的数据. 其他情况下为 NULL.
+	 * With the buffer_head backend (mount option bh), the buffer_head of
+	 * the current block in the block device's page cache, referenced;
+	 * b_addr points into it. NULL otherwise.
+	 */
+	void*		b_bh;
+};
+
+/*
+ * @Feng Shun: 缓存池的一个分片. 盘块 (dev, blkno) 按散列值固定属于一个分片,
+ * 只缓存在该分片的 Buf 中 (第 i 个 Buf 属于第 (i >> m_gshift) % m_nshard 个分片,
+ * 一组总在同一分片). 每个分片有自己的自由队列, 自旋锁和等待自由缓存的信号量,
+ * 所以读不同分片中盘块的进程互不争锁.
+ * A shard of the buffer pool. A block (dev, blkno) belongs to one shard
+ * by its hash and is only cached in that shard's Bufs (Buf i belongs to
+ * shard (i >> m_gshift) % m_nshard, so a group stays in one shard). Each
+ * shard has its own free lists, spinlock and
+ * free-buffer semaphore, so readers of blocks in different shards never
+ * share a lock.
+ */
+class BufShard
+{
+public:
+	Buf bFreeList;					/* 冷自由队列控制块 (2Q 的 A1 队列), 也是本分片 NODEV 设备队列的表头
+							 * Cold free list (A1 of 2Q); also heads this shard's NODEV queue */
+	Buf bHotList;					/* 热自由队列控制块 (2Q 的 Am 队列) Hot free list (Am of 2Q) */
+	s32 s_nbuf;					/* 本分片中有缓冲区的缓存块数 Number of Bufs with a buffer in this shard */
+	s32 b_ncold;					/* 冷/热自由队列中的缓存块数, 由 b_queue_lock 保护 */
+	s32 b_nhot;					/* Lengths of the cold and hot free lists, guarded by b_queue_lock */
+	struct {u8 data[SECONDFS_SPINLOCK_T_SIZE];} __attribute__((packed))	b_queue_lock;		// 保护本分片的自由队列和散列桶 Guards the free lists and hash buckets of this shard
+										// 也会在 bio 完成回调中获取, 所以必须关中断使用 Also taken in bio completion; always used with irqs off
+	struct {u8 data[SECONDFS_SEMAPHORE_SIZE];} __attribute__((packed))	b_bFreeList_lock;	// 表征本分片是否有自由缓存的信号量 Semaphore to indicate free buffers in this shard
+	Buf* s_empty;					/* 没有缓冲区的缓存控制块, 由 av_forw 串起, NULL 结尾. 它们的 b_wait_free_lock 一直被持有
+							 * Bufs without a buffer, linked by av_forw; their b_wait_free_lock stays held */
+	s32 s_nempty;					/* 本分片中还没有缓冲区的缓存控制块数 Number of Bufs without one */
 };
 
 class BufferManager
@@ -108,7 +194,10 @@ public:
 	BufferManager();
 	~BufferManager();
 	
-	void Initialize();			/* 缓存控制块队列的初始化。将缓存控制块中b_addr指向相应缓冲区首地址。*/
+	int Initialize(int nbuf, int nmin, int gshift, int bh);	/* 分配 nbuf 个缓存控制块及其中 nmin 个的缓冲区, 并初始化缓存控制块队列。将缓存控制块中b_addr指向相应缓冲区首地址。
+						 * 其余的缓冲区在缓存不命中时按需分配. gshift 非 0 时每 2^gshift 个缓存控制块成一组,
+						 * 共用一个缓冲区. bh 非 0 时缓冲区改用块设备页缓存中的 buffer_head (不成组).
+						 * 成功返回 0, 内存不足返回 -ENOMEM */
 	
 	Buf* GetBlk(Devtab *dev, int blkno);	/* 申请一块缓存，用于读写设备dev上的字符块blkno。*/
 	void Brelse(Buf* bp);			/* 释放缓存控制块buf */
@@ -116,15 +205,29 @@ public:
 	void IODone(Buf* bp);			/* I/O操作结束善后处理 */
 
 	Buf* Bread(Devtab *dev, int blkno);	/* 读一个磁盘块。dev为主、次设备号，blkno为目标磁盘块逻辑块号。 */
-	Buf* Breada(short adev, int blkno, int rablkno);	/* 读一个磁盘块，带有预读方式。
-								* adev为主、次设备号。blkno为目标磁盘块逻辑块号，同步方式读blkno。
-								* rablkno为预读磁盘块逻辑块号，异步方式读rablkno。 */
+	Buf* Breada(Devtab *dev, int blkno, int rablkno, int nra);	/* 读一个磁盘块，带有预读方式。
+								* dev为设备。blkno为目标磁盘块逻辑块号，同步方式读blkno。
+								* [rablkno, rablkno + nra) 为预读磁盘块，异步方式读入。 */
+	Buf* BreadShared(Devtab *dev, int blkno, u32 bflags);	/* 以共享方式读一个磁盘块, 只能读不能改, 须用 BrelseShared() 释放.
+							 * 命中时不加锁 (RCU 查找散列表). bflags (如 B_HOT) 在独占期间置上.
+							 * Read-only access shared with other readers; lockless on a hit */
+	void BrelseShared(Buf* bp);		/* 释放 BreadShared() 取得的缓存 */
 	int Bwrite(Buf* bp);			/* 写一个磁盘块 */
 	void Bdwrite(Buf* bp);			/* 延迟写磁盘块 */
+	void Bpin(Buf* bp);			/* 同 Bdwrite(), 并置上 B_PIN: 回写, Bflush() 和换出都跳过它, 直到 Bunpin() */
+	void Bunpin(Buf* bp);			/* 清除占用中的 bp 的 B_PIN, 之后照常延迟写 */
+	bool PinFull();				/* 钉住的缓存块已占缓存池的 1/4, 不宜再钉 */
 	void Bawrite(Buf* bp);			/* 异步写磁盘块 */
+	void BawriteRange(Buf* first);		/* 异步写一串物理连续的磁盘块 (av_forw 串起, NULL 结尾), 合并为一个 I/O 请求 */
+	void Bprefetch(Devtab *dev, int blkno, int nr);	/* 异步读入 [blkno, blkno + nr) 中不在缓存的块, 连续的合并为一个 I/O 请求 */
+	int RangeLimit();			/* 一次合并 I/O 最多可占用的缓存块数 */
 
+	void Binval(Buf* bp);			/* 作废缓存内容 (不写回) 并释放 */
 	void ClrBuf(Buf* bp);			/* 清空缓冲区内容 */
-	void Bflush(Devtab *dev);			/* 将dev指定设备队列中延迟写的缓存全部输出到磁盘 */
+	void Bflush(Devtab *dev);			/* 将dev指定设备队列中延迟写的缓存全部输出到磁盘, 并等待写完 */
+	void Bdrain();				/* 等待所有已提交的读写 (包括异步预读) 完成, 之后才能释放缓存池 */
+	int Bwriteback(unsigned long expire, int ratio);	/* 后台回写: 按盘块号顺序异步写出超过 expire (jiffies) 的脏块,
+							 * 脏块超过 ratio% 时不论年龄写到 ratio/2 % 以下. 返回写出的块数 */
 	bool Swap(Devtab *blkno, unsigned long addr, int count, enum Buf::BufFlag flag);
 						/* Swap I/O 用于进程图像在内存和盘交换区之间传输
 							* blkno: 交换区中盘块号；addr:  进程图像(传送部分)内存起始地址；
@@ -136,17 +239,93 @@ public:
 	void NotAvail(Buf* bp, u32 lockFirst);	/* 从自由队列中摘下指定的缓存控制块buf Make bp not available by picking it out the freeBuf queue */
 	Buf* InCore(Devtab *adev, int blkno);	/* 检查指定字符块是否已在缓存中 Is Buf(dev/blkno) in memory? */
 
+	int Reclaimable();			/* 估计能被 Shrink() 回收的缓冲区数 */
+	int Shrink(int nr);			/* 从自由队列的冷端回收至多 nr 个干净, 未被占用的缓冲区, 但不少于下限. 返回回收的个数 */
+
 	void Print(Devtab *dev);
-	
-	Buf bFreeList;					/* 自由缓存队列控制块 */
+
+private:
+	void Strategy(Buf *bp);			/* 按 b_flags 向块设备提交 bp 的异步 I/O 请求, 完成时调用 IODone() */
+	void StrategyRange(Buf *first);		/* 同上, 但针对 av_forw 串起的一串物理连续的 Buf */
+	Buf* GetBlkGroup(Devtab *dev, int blkno, bool *fresh);	/* 同 GetBlk(); 新取得一组时 *fresh 为 true, 组中其余的块也由调用者占用, 尚未读入 */
+	void ReleaseSiblings(Buf *bp);		/* 释放 bp 所在组中除 bp 以外的块 (GetBlkGroup() 新取得的组) */
+	void StrategyGroup(Buf *bp);		/* 读入 bp, 新取得的组中其余的块在卷内的一起异步读入, 合并为一个 I/O 请求 */
+	Buf* ReadIn(Buf *bp, bool fresh);	/* 独占的 bp 若尚无有效内容则同步读入 (fresh 时连同其组); 出错时释放 bp 并返回错误码 */
+	void Reference(Buf *bp);		/* 2Q: 命中时标记 bp, 第二次被使用的块在释放时升入热队列 */
+	Buf* GetBlkNoWait(Devtab *dev, int blkno);	/* 不睡眠地为不在缓存中的 (dev, blkno) 取一个干净的自由缓存, 否则返回 NULL; 按组模式下取整组, 返回组首 */
+	BufShard* ShardOf(Devtab *dev, int blkno);	/* (dev, blkno) 所属的分片 */
+	BufShard* ShardOfBuf(Buf *bp);		/* bp 所属的分片 */
+	Buf* TakeFree(BufShard *sh, bool clean);	/* 按 2Q 规则在分片 sh 中选一组能全部上锁的自由缓存 (clean 时只要干净的), 返回组首, 没有则返回 NULL;
+							 * 组中的块仍在自由队列上. 调用者须持有 sh 的 b_queue_lock */
+	bool LockGroup(Buf *leader, bool clean);	/* 给组中每一块 trylock, 有一块不行就全部放开并返回 false; 调用者须持有其分片的 b_queue_lock */
+	void UnfreeGroup(Buf *leader);		/* 将组中每一块从自由队列中摘下, 调用者须持有其分片的 b_queue_lock */
+	bool FlushGroup(Buf *leader);		/* 组中有脏块则异步写出 (连续的合并), 其余的释放, 返回 true; 组是干净的则什么都不做, 返回 false */
+	Buf* Leader(Buf *bp);			/* bp 所在组的第一块 (不成组时就是 bp) */
+	bool FillGroup(Buf *leader, bool nofs);	/* 为一组缓存控制块分配缓冲区 */
+	void EmptyGroup(Buf *leader);		/* 释放一组缓存控制块的缓冲区 */
+	void AttachBh(Buf *bp);			/* buffer_head 后端: 给刚换到新盘块的 bp 取得其 buffer_head, 页缓存中已有有效内容时置上 B_DONE */
+	void DetachBh(Buf *bp);			/* buffer_head 后端: 放开 bp 持有的 buffer_head; 可在自旋锁内调用 */
+	void Unfree(Buf *bp);			/* 将 bp 从它所在的自由队列中摘下, 调用者须持有其分片的 b_queue_lock */
+	bool TryTakeDirty(Buf *bp);		/* bp 若是空闲的脏块则将其摘下并返回 true, 调用者须持有其分片的 b_queue_lock */
+	int BwriteSorted(Buf **list, int n);	/* 把摘下的 n 个脏块按盘块号排序, 合并连续的块, 在一个 plug 内异步写出. 返回 I/O 请求数 */
+	void Rehash(Buf *bp, Devtab *dev, int blkno);	/* 把 bp 移到 (dev, blkno) 的设备队列和散列队列, 调用者须持有其分片的 b_queue_lock */
+	u32 HashIndex(Devtab *dev, int blkno);	/* 计算 (dev, blkno) 的散列桶下标 */
+	Buf* HashLookup(Devtab *dev, int blkno);	/* 在散列表中查找 (dev, blkno) 对应的 Buf, 调用者须持有其分片的 b_queue_lock */
+	Buf* HashLookupRcu(Devtab *dev, int blkno);	/* 同上, 但不加锁, 调用者须在 RCU 读临界区内; 找到的 Buf 可能随时被换作他用 */
+	void HashInsert(Buf *bp);		/* 将 bp 按其 (b_dev, b_blkno) 插入散列表, 调用者须持有其分片的 b_queue_lock */
+	void HashRemove(Buf *bp);		/* 将 bp 从散列表中摘下, 调用者须持有其分片的 b_queue_lock */
+	void Unhash(Buf *bp);			/* 把 bp 移回其分片的 NODEV 队列, 不再属于任何盘块, 调用者须持有其分片的 b_queue_lock */
+
+public:
 	Buf SwBuf;					/* 进程图像传送请求块 */
-	Buf m_Buf[SECONDFS_NBUF];			/* 缓存控制块数组 All Buf's (Buf actually serves as descriptor) (statistically allocated in BufferManager) */
-	u8 Buffer[SECONDFS_NBUF][SECONDFS_BUFFER_SIZE];	/* 缓冲区数组 All space of buffers */
+	s32 m_nbuf;					/* 缓存控制块的数量, 即缓冲区数量的上限 Number of Bufs, i.e. the most buffers the pool may grow to */
+	s32 m_nmin;					/* 缓冲区数量的下限, Shrink() 不会低于它 The fewest buffers Shrink() leaves */
+	s32 m_nshard;					/* 实际使用的分片数, 2 的幂 Number of shards in use, a power of 2 */
+	s32 m_gshift;					/* @Feng Shun: 成组模式下为 SECONDFS_GROUP_SHIFT, 否则为 0.
+							 * 第 i 个缓存控制块属于第 i >> m_gshift 组; 一组共用一个缓冲区, 缓存盘块号对齐的一组扇区,
+							 * 整组一起换入 (一个 I/O 请求读入), 换出和回收. 使用者占用的仍是单个扇区的 Buf.
+							 * log2 of Bufs per group: SECONDFS_GROUP_SHIFT in group mode, else 0.
+							 * Buf i is in group i >> m_gshift. A group shares one buffer and caches
+							 * an aligned run of sectors; it is brought in (with one read), replaced
+							 * and reclaimed as a whole. Users still hold single-sector Bufs. */
+	s32 m_bh;					/* @Feng Shun: 非 0 时用 buffer_head 后端: 缓冲区就是块设备页缓存中的 buffer_head,
+							 * 缓存控制块只在占用和留在自由队列期间持有它的引用, 经 submit_bh() 读写.
+							 * 被换出或回收的块仍可能在页缓存中, 再用到时不必读盘; 页的回收交给内核.
+							 * Non-zero for the buffer_head backend: a Buf's buffer is the
+							 * buffer_head of its block in the block device's page cache,
+							 * referenced only while the Buf is mapped to that block, and read
+							 * and written with submit_bh(). A block replaced or reclaimed here
+							 * may still be in the page cache and needs no read when wanted
+							 * again; the kernel reclaims the pages. */
+	Buf* m_Buf;					/* 缓存控制块数组 All Buf's (Buf actually serves as descriptor) (vmalloc-ed in Initialize()) */
+							/* 缓冲区不再是 BufferManager 的成员, 而是从 kmem_cache 中逐个分配, 由 b_addr 指向
+							 * Buffers are allocated one by one from a kmem_cache and pointed by b_addr */
+	Buf* b_hash[SECONDFS_NHASH];			/* 散列桶 Hash buckets, indexed by HashIndex(dev, blkno); bucket i belongs to shard (i >> m_gshift) % m_nshard */
+	BufShard m_shard[SECONDFS_NSHARD];		/* 分片, 只用前 m_nshard 个 Shards; only the first m_nshard are used */
 	
 	//DeviceManager* m_DeviceManager;		/* 指向设备管理模块全局对象 */
 
-	struct {u8 data[SECONDFS_SPINLOCK_T_SIZE];} __attribute__((packed))	b_queue_lock;		// 保护整个缓存块队列的自旋锁 Spin lock to guard the two queues
-	struct {u8 data[SECONDFS_SEMAPHORE_SIZE];} __attribute__((packed))	b_bFreeList_lock;	// 表征是否有自由缓存的信号量 Semaphore to indicate the number of free buffers
+	struct {u8 data[SECONDFS_WAIT_QUEUE_HEAD_SIZE];} __attribute__((packed))	b_io_wait;	// Bflush() 在此等待所有写操作完成, Bdrain() 等待所有 I/O Bflush() waits here for writes in flight, Bdrain() for all I/O
+	struct {u8 data[SECONDFS_SPINLOCK_T_SIZE];} __attribute__((packed))	b_devq_lock;		// 保护各设备队列 (只在 Buf 换盘块时用到), 在分片锁之内获取
+										// Guards the device queues (only touched when a Buf changes block); nests inside a shard lock
+	s32 b_nwrite;					/* (atomic_t) 已提交未完成的写操作数 Number of writes in flight */
+	s32 b_ndirty;					/* (atomic_t) 置有 B_DELWRI 的缓存块数 Number of Bufs with B_DELWRI set */
+	s32 b_nalloc;					/* (atomic_t) 现有的缓冲区数 Number of buffers currently allocated */
+	Buf** b_wb_list;				/* Bflush()/Bwriteback() 收集脏块用的数组, m_nbuf 项 (vmalloc-ed in Initialize()) */
+	struct {u8 data[SECONDFS_MUTEX_SIZE];} __attribute__((packed))	b_wb_lock;	// 保护 b_wb_list Guards b_wb_list
+	/* 后台回写的定时任务, 由 C 部分 (super.c) 初始化和调度 Periodic writeback work; set up and queued by super.c */
+	struct {u8 data[SECONDFS_DELAYED_WORK_SIZE];} __attribute__((packed))	b_wb_work;
+	/* 内存紧张时回收缓冲区的 shrinker 和 sysfs 目录, 由 C 部分 (super.c) 创建
+	 * The shrinker and the sysfs directory; created by super.c */
+	void* b_pool;
+	s32 b_nio;					/* (atomic_t) 已提交未完成的 I/O 数 (每个 Buf 计一次, 读写都算); Bdrain() 等它归零
+							 * Number of Bufs with I/O in flight, reads included; Bdrain() waits for zero */
+	s32 b_npin;					/* (atomic_t) 置有 B_PIN 的缓存块数 Number of Bufs with B_PIN set */
+	/* 本卷各 Inode 的预读和映射缓存统计之和, 见 /sys/fs/secondfs/<设备名>/
+	 * Volume totals of the per-Inode read-ahead and mapping cache counters */
+	s32 b_ra_hits;					/* (atomic_t) 预读命中次数 */
+	s32 b_ra_misses;				/* (atomic_t) 预读落空次数 */
+	s32 b_ext_hits;					/* (atomic_t) 映射缓存命中次数 */
 };
 
 #endif // __BUFFERMANAGER_HH__
\ No newline at end of file
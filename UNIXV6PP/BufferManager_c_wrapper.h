@@ -7,6 +7,8 @@
 #include <linux/blkdev.h>
 #include <linux/mutex.h>
 #include <linux/semaphore.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 #endif // __cplusplus
 
 #ifdef __cplusplus
@@ -14,6 +16,8 @@ extern "C" {
 #endif // __cplusplus
 
 struct _Devtab;
+struct _BufferManager;
+struct secondfs_bufpool;
 
 // Buf 类的 C 包装
 
@@ -40,8 +44,18 @@ typedef struct _Buf
 	s32		b_error;	/* I/O出错时信息 */
 	s32		b_resid;	/* I/O出错时尚未传送的剩余字节数 */
 
+	s32		b_index;	/* 调试用, 在 BufferManager 中的下标 */
+
+	struct _Buf*	b_hforw;	/* 散列队列勾连指针 */
+	struct _Buf*	b_hback;
+
 	struct mutex	b_modify_lock;
-	struct mutex	b_wait_free_lock;
+	struct semaphore	b_wait_free_lock;	/* Buf 不在自由队列期间一直持有 */
+	wait_queue_head_t	b_wait;		/* IOWait() 在此等待 B_DONE */
+	unsigned long	b_dirty_time;	/* 置上 B_DELWRI 的时刻 (jiffies) */
+	atomic_t	b_count;	/* 共享持有者的个数 */
+	atomic_t	b_nwant;	/* 等待独占的进程数 */
+	struct buffer_head	*b_bh;	/* buffer_head 后端下当前盘块的 buffer_head, 否则为 NULL */
 } Buf;
 
 // static size_t x = sizeof(Buf);
@@ -58,7 +72,9 @@ extern const u32
 	SECONDFS_B_BUSY,		/* 相应缓存正在使用中 */
 	SECONDFS_B_WANTED,	/* 有进程正在等待使用该buf管理的资源，清B_BUSY标志SECONDFS_时，要唤醒这种进程 */
 	SECONDFS_B_ASYNC,	/* 异步I/O，不需要等待其结束 */
-	SECONDFS_B_DELWRI	/* 延迟写，在相应缓存要移做他用时，再将其内容写到相应块设备上 */
+	SECONDFS_B_DELWRI,	/* 延迟写，在相应缓存要移做他用时，再将其内容写到相应块设备上 */
+	SECONDFS_B_REF,		/* 自分配以来已被 GetBlk() 交给使用者过 */
+	SECONDFS_B_HOT		/* 再次被使用过或是元数据, 释放时进入热队列 */
 ;
 
 SECONDFS_QUICK_WRAP_CONSTRUCTOR_DESTRUCTOR_DECLARATION(Buf)
@@ -74,6 +90,9 @@ typedef struct _Devtab{
 	Buf*	d_actl;
 
 	struct block_device*	d_bdev;
+	struct _BufferManager*	d_bufmgr;	/* 该设备的缓存管理器 */
+	s32	d_metaend;	/* 盘块号小于它的是元数据 */
+	s32	d_nblocks;	/* 卷的盘块数, 0 为未知 */
 } Devtab;
 #else // __cplusplus
 class Devtab;
@@ -84,23 +103,92 @@ SECONDFS_QUICK_WRAP_CONSTRUCTOR_DESTRUCTOR_DECLARATION(Devtab)
 
 // BufferManager 类的 C 包装
 
-// 总共可以分配多少个缓冲块
-#define SECONDFS_NBUF 10
+// 缓存池最多能有多少个缓冲块 (缓冲区按需分配, 内存紧张时回收);
+// 实际数量由模块参数 bufs 指定
+// Default most Bufs the pool may grow to (buffers are allocated on
+// demand and reclaimed under memory pressure); overridden by the "bufs"
+// module parameter
+#ifndef SECONDFS_NBUF
+#define SECONDFS_NBUF 4096
+#endif
+// 缓冲区数量下限的默认值; 实际值由模块参数 bufs_min 指定
+// Default floor of the pool; overridden by the "bufs_min" module parameter
+#define SECONDFS_NBUF_FLOOR 256
+// 缓冲块数量的下限 (每个分片). 一次操作可能同时占用好几个缓冲块 (例如 Bmap 的二次间接索引),
+// 太小会使 GetBlk 永远等不到自由缓存
+// The fewest Bufs (per shard) an operation can always make progress with
+#define SECONDFS_NBUF_MIN 16
 // 缓冲块的大小, 应该等于扇区大小
 #define SECONDFS_BUFFER_SIZE 512
+// 成组模式 (模块参数或挂载选项 bufgroup) 下, 相邻的 2^SECONDFS_GROUP_SHIFT 个缓冲块
+// 共用一个 SECONDFS_GROUP_SIZE 字节的缓冲区, 缓存一组对齐的连续扇区
+// In group mode (the "bufgroup" module parameter or mount option),
+// 2^SECONDFS_GROUP_SHIFT sibling Bufs share one SECONDFS_GROUP_SIZE-byte
+// buffer and cache an aligned run of sectors together
+#define SECONDFS_GROUP_SHIFT 3
+#define SECONDFS_GROUP_SIZE (SECONDFS_BUFFER_SIZE << SECONDFS_GROUP_SHIFT)
+// 散列桶的数量, 必须是 2 的幂
+// Number of hash buckets for Buf lookup; must be a power of 2
+#define SECONDFS_NHASH 64
+// 缓存池最多分成多少片, 必须是 2 的幂且不大于 SECONDFS_NHASH;
+// 每片至少 SECONDFS_SHARD_MIN_BUFS 个缓冲块
+// Max number of buffer pool shards (a power of 2, at most SECONDFS_NHASH),
+// each holding at least SECONDFS_SHARD_MIN_BUFS Bufs
+#define SECONDFS_NSHARD 16
+#define SECONDFS_SHARD_MIN_BUFS 64
+// 一次合并 I/O 最多包含的连续块数 (不超过缓冲块总数的 1/4)
+// Max blocks merged into one I/O (and at most a quarter of the pool)
+#define SECONDFS_MAX_RANGE_BLOCKS 128
+// 后台回写的默认参数; 实际值由模块参数 wb_interval, dirty_expire, dirty_ratio 指定
+// Background writeback defaults; overridden by the module parameters
+// wb_interval, dirty_expire (both in ms) and dirty_ratio (% of the pool)
+#define SECONDFS_WB_INTERVAL_MS 1000
+#define SECONDFS_DIRTY_EXPIRE_MS 5000
+#define SECONDFS_DIRTY_RATIO 25
 
 #ifndef __cplusplus
-typedef struct
+// BufShard 类的 C 包装: 缓存池的一个分片
+typedef struct _BufShard
+{
+	Buf bFreeList;					/* 冷自由队列控制块 */
+	Buf bHotList;					/* 热自由队列控制块 */
+	s32 s_nbuf;					/* 本分片中有缓冲区的缓存块数 */
+	s32 b_ncold;					/* 冷自由队列中的缓存块数 */
+	s32 b_nhot;					/* 热自由队列中的缓存块数 */
+	spinlock_t	b_queue_lock;		// 保护本分片的自由队列和散列桶
+	struct semaphore	b_bFreeList_lock;	// 表征本分片是否有自由缓存的信号量
+	Buf* s_empty;					/* 没有缓冲区的缓存控制块 */
+	s32 s_nempty;					/* 本分片中还没有缓冲区的缓存控制块数 */
+} BufShard;
+
+typedef struct _BufferManager
 {
-	Buf bFreeList;					/* 自由缓存队列控制块 */
 	Buf SwBuf;					/* 进程图像传送请求块 */
-	Buf m_Buf[SECONDFS_NBUF];			/* 缓存控制块数组 */
-	u8 Buffer[SECONDFS_NBUF][SECONDFS_BUFFER_SIZE];	/* 缓冲区数组 */
+	s32 m_nbuf;					/* 缓存控制块的数量, 即缓冲区数量的上限 */
+	s32 m_nmin;					/* 缓冲区数量的下限 */
+	s32 m_nshard;					/* 实际使用的分片数 */
+	s32 m_gshift;					/* 一组缓冲块数的 log2, 不成组时为 0 */
+	s32 m_bh;					/* 非 0 时用 buffer_head 后端 */
+	Buf* m_Buf;					/* 缓存控制块数组 (vmalloc) */
+	Buf* b_hash[SECONDFS_NHASH];			/* 散列桶 */
+	BufShard m_shard[SECONDFS_NSHARD];		/* 分片 */
 	
 	//DeviceManager* m_DeviceManager;		/* 指向设备管理模块全局对象 */
 
-	spinlock_t	b_queue_lock;		// 保护整个缓存块队列的自旋锁
-	struct semaphore	b_bFreeList_lock;	// 表征是否有自由缓存的信号量
+	wait_queue_head_t	b_io_wait;	// Bflush() 在此等待所有写操作完成, Bdrain() 等待所有 I/O
+	spinlock_t	b_devq_lock;		// 保护各设备队列
+	atomic_t	b_nwrite;		// 已提交未完成的写操作数
+	atomic_t	b_ndirty;		// 置有 B_DELWRI 的缓存块数
+	atomic_t	b_nalloc;		// 现有的缓冲区数
+	Buf**	b_wb_list;			// Bflush()/Bwriteback() 收集脏块用的数组
+	struct mutex	b_wb_lock;		// 保护 b_wb_list
+	struct delayed_work	b_wb_work;	// 后台回写的定时任务
+	struct secondfs_bufpool	*b_pool;	// shrinker 和 sysfs 目录 (super.c)
+	atomic_t	b_nio;			// 已提交未完成的 I/O 数, 读写都算
+	atomic_t	b_npin;			// 置有 B_PIN 的缓存块数
+	atomic_t	b_ra_hits;		// 本卷预读命中次数
+	atomic_t	b_ra_misses;		// 本卷预读落空次数
+	atomic_t	b_ext_hits;		// 本卷映射缓存命中次数
 } BufferManager;
 #else // __cplusplus
 class BufferManager;
@@ -109,17 +197,30 @@ class BufferManager;
 
 SECONDFS_QUICK_WRAP_CONSTRUCTOR_DESTRUCTOR_DECLARATION(BufferManager)
 
-void BufferManager_Initialize(BufferManager *bm);
+int BufferManager_Initialize(BufferManager *bm, int nbuf, int nmin, int gshift, int bh);
 Buf* BufferManager_GetBlk(BufferManager *bm, Devtab *dev, int blkno);
 void BufferManager_Brelse(BufferManager *bm, Buf* bp);
+void BufferManager_IOWait(BufferManager *bm, Buf* bp);
 void BufferManager_IODone(BufferManager *bm, Buf* bp);
 Buf* BufferManager_Bread(BufferManager *bm, Devtab *dev, int blkno);
+Buf* BufferManager_Breada(BufferManager *bm, Devtab *dev, int blkno, int rablkno, int nra);
+Buf* BufferManager_BreadShared(BufferManager *bm, Devtab *dev, int blkno, u32 bflags);
+void BufferManager_BrelseShared(BufferManager *bm, Buf* bp);
 int BufferManager_Bwrite(BufferManager *bm, Buf *bp);
+void BufferManager_Bawrite(BufferManager *bm, Buf *bp);
+void BufferManager_BawriteRange(BufferManager *bm, Buf *first);
+void BufferManager_Bprefetch(BufferManager *bm, Devtab *dev, int blkno, int nr);
+int BufferManager_RangeLimit(BufferManager *bm);
 void BufferManager_NotAvail(BufferManager *bm, Buf *bp, u32 lockFirst);
 Buf* BufferManager_InCore(BufferManager *bm, Devtab *adev, int blkno);
+void BufferManager_Binval(BufferManager *bm, Buf *bp);
 void BufferManager_ClrBuf(BufferManager *bm, Buf *bp);
 void BufferManager_Bdwrite(BufferManager *bm, Buf *bp);
 void BufferManager_Bflush(BufferManager *bm, Devtab *dev);
+void BufferManager_Bdrain(BufferManager *bm);
+int BufferManager_Bwriteback(BufferManager *bm, unsigned long expire, int ratio);
+int BufferManager_Reclaimable(BufferManager *bm);
+int BufferManager_Shrink(BufferManager *bm, int nr);
 void BufferManager_Print(BufferManager *bm, Devtab *dev);
 
 #ifdef __cplusplus
@@ -842,7 +842,7 @@ int FileManager::DELocate(Inode *dir, const char *name, u32 namelen, u32 mode, I
 	type = (decltype(type))(((void **)inop)[2]);
 	ppos = (decltype(ppos))(((void **)inop)[3]);
 
-	BufferManager& bufMgr = *secondfs_buffermanagerp;
+	BufferManager& bufMgr = *dir->i_ssb->s_bufmgr;
 
 	pInode = dir;
 
@@ -881,7 +881,7 @@ int FileManager::DELocate(Inode *dir, const char *name, u32 namelen, u32 mode, I
 				secondfs_dbg(DELOCATE, "FileManager::DELocate(): m_Count == 0, DE search complete");
 				if ( NULL != pBuf )
 				{
-					bufMgr.Brelse(pBuf);
+					bufMgr.BrelseShared(pBuf);
 				}
 				/* 如果是创建新文件 */
 				if ( SECONDFS_CREATE == mode )
@@ -934,16 +934,23 @@ int FileManager::DELocate(Inode *dir, const char *name, u32 namelen, u32 mode, I
 				firstTimeRead = 0;
 				if ( NULL != pBuf )
 				{
-					bufMgr.Brelse(pBuf);
+					bufMgr.BrelseShared(pBuf);
 				}
 				/* 计算要读的物理盘块号 */
 				secondfs_dbg(DELOCATE_V, "FileManager::DELocate(): finish current block || firstTimeRead; Bmap(%d)", out_iop->m_Offset / SECONDFS_BLOCK_SIZE);
 				int phyBlkno = pInode->Bmap(out_iop->m_Offset / SECONDFS_BLOCK_SIZE );
 				secondfs_dbg(DELOCATE_V, "FileManager::DELocate(): after Bmap(%d) == %d", out_iop->m_Offset / SECONDFS_BLOCK_SIZE, phyBlkno);
-				pBuf = bufMgr.Bread(pInode->i_ssb->s_dev, phyBlkno );
+				if (phyBlkno <= 0) {
+					secondfs_err("FileManager::DELocate(): Bmap() fail! (%d)", phyBlkno);
+					return phyBlkno < 0 ? phyBlkno : -ENOSPC;
+				}
+				// @Feng Shun: 目录块在这里只读不写, 与同时查找这个目录的进程共享
+				// Directory blocks are only read here; share them with
+				// other processes looking up names in this directory
+				pBuf = bufMgr.BreadShared(pInode->i_ssb->s_dev, phyBlkno, 0);
 				// We just hard-code IS_ERR() macro here
 				if ((uintptr_t)(pBuf) >= (uintptr_t)-4095) {
-					secondfs_err("FileManager::DELocate(): Bread() fail! (%d)", (int)(uintptr_t)(pBuf));
+					secondfs_err("FileManager::DELocate(): BreadShared() fail! (%d)", (int)(uintptr_t)(pBuf));
 					return (int)(uintptr_t)(pBuf);
 				}
 			}
@@ -990,7 +997,7 @@ int FileManager::DELocate(Inode *dir, const char *name, u32 namelen, u32 mode, I
 				out_iop->m_Offset = 0;
 				if ( NULL != pBuf )
 				{
-					bufMgr.Brelse(pBuf);
+					bufMgr.BrelseShared(pBuf);
 				}
 				return 0;
 			}
@@ -1057,7 +1064,7 @@ int FileManager::DELocate(Inode *dir, const char *name, u32 namelen, u32 mode, I
 		 */
 		if ( NULL != pBuf )
 		{
-			bufMgr.Brelse(pBuf);
+			bufMgr.BrelseShared(pBuf);
 		}
 
 		// 处理 LIST 模式上层给出停止信号的情况
@@ -16,12 +16,150 @@ SuperBlock::SuperBlock()
 	secondfs_c_helper_mutex_init(&this->s_update_lock);
 	secondfs_c_helper_mutex_init(&this->s_flock);
 	secondfs_c_helper_mutex_init(&this->s_ilock);
-	//nothing to do here
+	this->s_fmap = NULL;
+	this->s_pmap = NULL;
+	this->s_nfreeblk = 0;
+	this->s_frotor = 0;
+	this->s_fdirty = -1;
+	this->s_fchain = 0;
+	this->s_delalloc = 0;
+	this->s_nresv = 0;
+	this->s_imap = NULL;
+	this->s_nfreeino = 0;
+	this->s_irotor = 0;
 }
 
 SuperBlock::~SuperBlock()
 {
-	//nothing to do here
+	if (this->s_fmap != NULL)
+		secondfs_c_helper_vfree(this->s_fmap);
+	if (this->s_pmap != NULL)
+		secondfs_c_helper_vfree(this->s_pmap);
+	if (this->s_imap != NULL)
+		secondfs_c_helper_vfree(this->s_imap);
+}
+
+/*======================空闲盘块位图 Free block bitmap======================*/
+/* @Feng Shun: 一位对应一个盘块, 置位表示空闲. 调用者须持有 s_flock.
+ * 空闲 Inode 位图 (s_imap, 由 s_ilock 保护) 也用这几个函数.
+ * One bit per block, set if free. The caller holds s_flock.
+ * The free inode bitmap (s_imap, under s_ilock) uses them as well. */
+static inline bool FreeMapTest(const u32 *map, int blkno)
+{
+	return (map[blkno >> 5] >> (blkno & 31)) & 1;
+}
+
+static inline void FreeMapSet(u32 *map, int blkno)
+{
+	map[blkno >> 5] |= 1u << (blkno & 31);
+}
+
+static inline void FreeMapClear(u32 *map, int blkno)
+{
+	map[blkno >> 5] &= ~(1u << (blkno & 31));
+}
+
+/* [blkno, end) 中最小的空闲盘块, 没有则返回 -1. 整字为 0 的一次跳过
+ * The lowest free block in [blkno, end), or -1; skips a word at a time */
+static int FreeMapNext(const u32 *map, int blkno, int end)
+{
+	u32 w;
+
+	while (blkno < end)
+	{
+		w = map[blkno >> 5] >> (blkno & 31);
+		if (w != 0)
+		{
+			blkno += __builtin_ctz(w);
+			return blkno < end ? blkno : -1;
+		}
+		blkno = (blkno | 31) + 1;
+	}
+	return -1;
+}
+
+/* [start, blkno] 中在 map 或 map2 中置位的最大盘块, 没有则返回 -1
+ * The highest block in [start, blkno] set in map or map2, or -1 */
+static int FreeMapPrev(const u32 *map, const u32 *map2, int start, int blkno)
+{
+	u32 w;
+
+	while (blkno >= start)
+	{
+		w = (map[blkno >> 5] | map2[blkno >> 5]) & (0xFFFFFFFFu >> (31 - (blkno & 31)));
+		if (w != 0)
+		{
+			blkno = (blkno & ~31) + 31 - __builtin_clz(w);
+			return blkno >= start ? blkno : -1;
+		}
+		blkno = (blkno & ~31) - 1;
+	}
+	return -1;
+}
+
+/* 空闲段的长度, 至多 want 块 Length of the free run at blkno, up to want */
+static inline int FreeMapRun(const u32 *map, int blkno, int end, int want)
+{
+	int n = 1;
+
+	while (n < want && blkno + n < end && FreeMapTest(map, blkno + n))
+		n++;
+	return n;
+}
+
+/* 找空闲段时最多往后看这么多块, 再远就取遇到的第一个空闲盘块
+ * How far to look for a long enough run before taking the first free block */
+static const int FREEMAP_RUN_SCAN = 4096;
+
+/* 
+ * [from, to) 中第一段不短于 want 块的空闲盘块, 找不到时取第一个空闲盘块
+ * (段长可到 end 为止); 没有空闲盘块返回 -1.
+ * The first free run of want blocks starting in [from, to) (runs may
+ * reach end), else the first free block; -1 if none.
+ */
+static int FreeMapFindRun(const u32 *map, int from, int to, int end, int want, int *got)
+{
+	int first = -1;
+	int blkno = from;
+	int n;
+
+	while ((blkno = FreeMapNext(map, blkno, to)) >= 0)
+	{
+		n = FreeMapRun(map, blkno, end, want);
+		if (n == want)
+		{
+			*got = n;
+			return blkno;
+		}
+		if (first < 0)
+		{
+			first = blkno;
+			*got = n;
+		}
+		if (blkno - from >= FREEMAP_RUN_SCAN)
+			break;
+		blkno += n;
+	}
+	return first;
+}
+
+/* 数据区的第一个盘块 (外存 Inode 区之后) The first block after the inode zone */
+static inline int DataStart(SuperBlock *sb)
+{
+	return FileSystem::INODE_ZONE_START_SECTOR + (s32)le32_to_cpu(sb->s_isize);
+}
+
+/* 记下 blkno 的空闲状态变了, SaveFreeMap() 要重写它以下的链块.
+ * 盘上的链还不是 SaveFreeMap() 写的 (例如 mkfs 写的) 时, 第一次要整条重写.
+ * Note that blkno changed, so SaveFreeMap() rewrites the chain blocks
+ * up to it. A chain SaveFreeMap() did not write (e.g. from mkfs) is
+ * rewritten whole the first time. */
+static inline void FreeMapChanged(SuperBlock *sb, int blkno)
+{
+	if (!sb->s_fchain)
+		sb->s_fdirty = (s32)le32_to_cpu(sb->s_fsize) - 1;
+	else if (blkno > sb->s_fdirty)
+		sb->s_fdirty = blkno;
 }
 
 FileSystem::FileSystem()
@@ -38,7 +176,6 @@ FileSystem::~FileSystem()
 extern "C" void FileSystem_Initialize(FileSystem *fs) { fs->Initialize(); }
 void FileSystem::Initialize()
 {
-	this->m_BufferManager = this->m_BufferManager;
 	//this->updlock = 0;
 }
 
@@ -47,14 +184,14 @@ extern "C" int FileSystem_LoadSuperBlock(FileSystem *fs, SuperBlock *secsb) { re
 // Endian 的转换! Unix V6++ 卷的所有多字节数据都以小端序存放
 int FileSystem::LoadSuperBlock(SuperBlock *secsb)
 {
-	BufferManager& bufMgr = *this->m_BufferManager;
+	BufferManager& bufMgr = *secsb->s_bufmgr;
 	Buf* pBuf;
 
 	for (int i = 0; i < 2; i++)
 	{
 		u8* p = (u8 *)secsb + i * SECONDFS_BLOCK_SIZE;
 
-		pBuf = bufMgr.Bread(secsb->s_dev, FileSystem::SUPER_BLOCK_SECTOR_NUMBER + i);
+		pBuf = bufMgr.BreadShared(secsb->s_dev, FileSystem::SUPER_BLOCK_SECTOR_NUMBER + i, 0);
 
 		// We just hard-code IS_ERR() macro here
 		if ((uintptr_t)(pBuf) >= (uintptr_t)-4095) {
@@ -64,7 +201,7 @@ int FileSystem::LoadSuperBlock(SuperBlock *secsb)
 
 		secondfs_c_helper_memcpy(p, pBuf->b_addr, SECONDFS_BLOCK_SIZE);
 
-		bufMgr.Brelse(pBuf);
+		bufMgr.BrelseShared(pBuf);
 	}
 
 	if ((s32)secondfs_c_helper_le32_to_cpu(secsb->s_nfree) < 0 || (s32)secondfs_c_helper_le32_to_cpu(secsb->s_nfree) > 100) {
@@ -99,6 +236,9 @@ void FileSystem::PrintSuperBlock(SuperBlock *secsb)
 	length += secondfs_c_helper_sprintf(buf + length, "s_fsize(Total blocks): %d\n", secondfs_c_helper_le32_to_cpu(secsb->s_fsize));
 	length += secondfs_c_helper_sprintf(buf + length, "s_nfree(Freeblock stack height): %d\n", secondfs_c_helper_le32_to_cpu(secsb->s_nfree));
 	length += secondfs_c_helper_sprintf(buf + length, "top elements of s_free: %d %d %d %d %d\n", secondfs_c_helper_le32_to_cpu(secsb->s_free[(int)secondfs_c_helper_le32_to_cpu(secsb->s_nfree) - 1]), secondfs_c_helper_le32_to_cpu(secsb->s_free[(int)secondfs_c_helper_le32_to_cpu(secsb->s_nfree) - 2]), secondfs_c_helper_le32_to_cpu(secsb->s_free[(int)secondfs_c_helper_le32_to_cpu(secsb->s_nfree) - 3]), secondfs_c_helper_le32_to_cpu(secsb->s_free[(int)secondfs_c_helper_le32_to_cpu(secsb->s_nfree) - 4]), secondfs_c_helper_le32_to_cpu(secsb->s_free[(int)secondfs_c_helper_le32_to_cpu(secsb->s_nfree) - 5]));
+	length += secondfs_c_helper_sprintf(buf + length, "s_nfreeblk(Free blocks in bitmap): %d\n", secsb->s_nfreeblk);
+	length += secondfs_c_helper_sprintf(buf + length, "s_nresv(Reserved for delayed allocation): %d\n", secsb->s_nresv);
+	length += secondfs_c_helper_sprintf(buf + length, "s_nfreeino(Free inodes in bitmap): %d\n", secsb->s_nfreeino);
 	length += secondfs_c_helper_sprintf(buf + length, "s_ninode(Freeinode stack height): %d\n", secondfs_c_helper_le32_to_cpu(secsb->s_ninode));
 	length += secondfs_c_helper_sprintf(buf + length, "top elements of s_inode: %d %d %d %d %d\n", secondfs_c_helper_le32_to_cpu(secsb->s_inode[(int)secondfs_c_helper_le32_to_cpu(secsb->s_ninode) - 1]), secondfs_c_helper_le32_to_cpu(secsb->s_inode[(int)secondfs_c_helper_le32_to_cpu(secsb->s_ninode) - 2]), secondfs_c_helper_le32_to_cpu(secsb->s_inode[(int)secondfs_c_helper_le32_to_cpu(secsb->s_ninode) - 3]), secondfs_c_helper_le32_to_cpu(secsb->s_inode[(int)secondfs_c_helper_le32_to_cpu(secsb->s_ninode) - 4]), secondfs_c_helper_le32_to_cpu(secsb->s_inode[(int)secondfs_c_helper_le32_to_cpu(secsb->s_ninode) - 5]));
 
@@ -173,6 +313,13 @@ void FileSystem::Update(SuperBlock *secsb)
 	/* 写入SuperBlock最后存访时间 */
 	sb->s_time = cpu_to_le32(secondfs_c_helper_ktime_get_real_seconds());
 
+	/* @Feng Shun: 按空闲盘块位图重新生成 s_free[] 和空闲盘块链.
+	 * 链块先写到盘上, 再写指向它们的超块.
+	 * Regenerate s_free[] and the free chain from the bitmap; the chain
+	 * blocks reach the disk before the superblock pointing at them. */
+	if (this->SaveFreeMap(sb) > 0)
+		sb->s_bufmgr->Bflush(sb->s_dev);
+
 	/* 
 	* 为将要写回到磁盘上去的SuperBlock申请一块缓存，由于缓存块大小为512字节，
 	* SuperBlock大小为1024字节，占据2个连续的扇区，所以需要2次写入操作。
@@ -185,13 +332,13 @@ void FileSystem::Update(SuperBlock *secsb)
 		u8* p = (u8 *)sb + j * SECONDFS_BLOCK_SIZE;
 
 		/* 将要写入到设备dev上的SUPER_BLOCK_SECTOR_NUMBER + j扇区中去 */
-		pBuf = this->m_BufferManager->GetBlk(sb->s_dev, SECONDFS_SUPER_BLOCK_SECTOR_NUMBER + j);
+		pBuf = sb->s_bufmgr->GetBlk(sb->s_dev, SECONDFS_SUPER_BLOCK_SECTOR_NUMBER + j);
 
 		/* 将SuperBlock中第0 - 511字节写入缓存区 */
 		secondfs_c_helper_memcpy(pBuf->b_addr, p, SECONDFS_BLOCK_SIZE);
 
 		/* 将缓冲区中的数据写到磁盘上 */
-		ret = this->m_BufferManager->Bwrite(pBuf);
+		ret = sb->s_bufmgr->Bwrite(pBuf);
 
 		// After every (sync) write, the Buf will be released.
 
@@ -199,7 +346,6 @@ void FileSystem::Update(SuperBlock *secsb)
 			secondfs_err("FileSystem::Update: Bwrite() failed!");
 			goto out;
 		}
-		goto flush_out;
 	}
 	
 	// Synchronize all Inodes to disk (we won't do this)
@@ -210,10 +356,9 @@ void FileSystem::Update(SuperBlock *secsb)
 	/* Unlock update lock */
 	/* 清除Update()函数锁 */	
 
-flush_out:
 	/* Flush the dirty buffers */
 	/* 将延迟写的缓存块写到磁盘上 */
-	this->m_BufferManager->Bflush(secsb->s_dev);
+	secsb->s_bufmgr->Bflush(secsb->s_dev);
 
 out:
 	secondfs_c_helper_mutex_unlock(&secsb->s_update_lock);
@@ -244,59 +389,31 @@ Inode* FileSystem::IAlloc(SuperBlock *secsb)
 		// 前面已经上锁
 
 		/* 外存Inode编号从0开始，这不同于Unix V6中外存Inode从1开始编号 */
-		ino = -1;
+		int ninode = (s32)le32_to_cpu(sb->s_isize) * FileSystem::INODE_NUMBER_PER_SECTOR;
 
-		/* 依次读入磁盘Inode区中的磁盘块，搜索其中空闲外存Inode，记入空闲Inode索引表 */
-		for(int i = 0; i < ((s32)le32_to_cpu(sb->s_isize)); i++)
+		/* 
+		 * @Feng Shun: 不再依次读入磁盘Inode区, 而是从空闲 Inode 位图的
+		 * s_irotor 起取至多 100 个空闲外存Inode, 与卷的占用程度无关.
+		 * 原来要用 ilookup 排除 i_mode 为 0 但内存中已分配的 Inode;
+		 * 这些 Inode 从 s_inode[] 取走时已不在位图中, 所以不必再查.
+		 * (在 s_ilock 下 ilookup 还会等待正在释放的 Inode, 而它的
+		 * IFree() 要等 s_ilock.)
+		 * Take up to 100 free inodes from the bitmap, starting at
+		 * s_irotor, instead of reading the inode zone from its start,
+		 * however full the volume is. Inodes allocated in memory but not
+		 * written yet left the bitmap when they were handed out, so the
+		 * old ilookup check is not needed (and under s_ilock it could
+		 * wait for an inode being evicted, whose IFree() waits for s_ilock).
+		 */
+		for (ino = FreeMapNext(sb->s_imap, sb->s_irotor, ninode); ino >= 0;
+			ino = FreeMapNext(sb->s_imap, ino + 1, ninode))
 		{
-			pBuf = this->m_BufferManager->Bread(sb->s_dev, FileSystem::INODE_ZONE_START_SECTOR + i);
-
-			/* 获取缓冲区首址 */
-			s32* p = (s32 *)pBuf->b_addr;
-
-			/* 检查该缓冲区中每个外存Inode的i_mode != 0，表示已经被占用 */
-			for(int j = 0; j < FileSystem::INODE_NUMBER_PER_SECTOR; j++)
-			{
-				ino++;
-
-				s32 mode = *( p + j * sizeof(DiskInode)/sizeof(s32) );
-
-				/* 该外存Inode已被占用，不能记入空闲Inode索引表 */
-				if(mode != 0)
-				{
-					continue;
-				}
-
-				secondfs_dbg(INODE, "IAlloc %p: found Inode %d free", secsb, ino);
-
-				// If we met a free inode, we should lookup if its
-				// inode number is being used by system now
-				/* 
-				 * 如果外存inode的i_mode==0，此时并不能确定
-				 * 该inode是空闲的，因为有可能是内存inode没有写到
-				 * 磁盘上,所以要继续搜索内存inode中是否有相应的项
-				 */
-				if( secondfs_c_helper_ilookup_without_iget(secsb->s_vsb, ino) == NULL )
-				{
-
-					/* 该外存Inode没有对应的内存拷贝，将其记入空闲Inode索引表 */
-					sb->s_inode[le32_to_cpu(sb->s_ninode)] = cpu_to_le32(ino);
-					secondfs_dbg(INODE, "IAlloc %p: s_inode[%d] = %d", le32_to_cpu(sb->s_ninode), ino);
-					sb->s_ninode = cpu_to_le32(le32_to_cpu(sb->s_ninode) + 1);
-
-
-					/* 如果空闲索引表已经装满，则不继续搜索 */
-					if(le32_to_cpu(sb->s_ninode) >= 100)
-					{
-						break;
-					}
-				} else {
-					secondfs_dbg(INODE, "IAlloc %p: but free Inode %d is being used in memory", secsb, ino);
-				}
-			}
-
-			/* 至此已读完当前磁盘块，释放相应的缓存 */
-			this->m_BufferManager->Brelse(pBuf);
+			/* 将该外存Inode记入空闲Inode索引表 */
+			FreeMapClear(sb->s_imap, ino);
+			sb->s_nfreeino--;
+			sb->s_inode[le32_to_cpu(sb->s_ninode)] = cpu_to_le32(ino);
+			secondfs_dbg(INODE, "IAlloc %p: s_inode[%d] = %d", secsb, le32_to_cpu(sb->s_ninode), ino);
+			sb->s_ninode = cpu_to_le32(le32_to_cpu(sb->s_ninode) + 1);
 
 			/* 如果空闲索引表已经装满，则不继续搜索 */
 			if(le32_to_cpu(sb->s_ninode) >= 100)
@@ -304,17 +421,17 @@ Inode* FileSystem::IAlloc(SuperBlock *secsb)
 				break;
 			}
 		}
-		/* 解除对空闲外存Inode索引表的锁，唤醒因为等待锁而睡眠的进程 */
-		// 稍后解锁
-		
+		/* 取到的最后一个之前位图中已没有空闲 Inode */
+		sb->s_irotor = ino >= 0 ? ino + 1 : ninode;
+
 		/* 如果在磁盘上没有搜索到任何可用外存Inode，返回NULL */
 		if(le32_to_cpu(sb->s_ninode) <= 0)
 		{
 			secondfs_err("IAlloc %p: No Inode left!!", secsb);
+			secondfs_c_helper_mutex_unlock(&sb->s_ilock);
 			return NULL;
 		}
 	}
-	secondfs_c_helper_mutex_unlock(&sb->s_ilock);
 
 	// Above part ensured there is something in Inode fast stack.
 	// Now we just pick the top Inode of it.
@@ -328,6 +445,7 @@ Inode* FileSystem::IAlloc(SuperBlock *secsb)
 		/* 从索引表“栈顶”获取空闲外存Inode编号 */
 		sb->s_ninode = cpu_to_le32(le32_to_cpu(sb->s_ninode) - 1);
 		ino = le32_to_cpu(sb->s_inode[le32_to_cpu(sb->s_ninode)]);
+		secondfs_c_helper_mutex_unlock(&sb->s_ilock);
 
 		secondfs_dbg(INODE, "IAlloc %p: got Inode %d from top of fast stack", secsb, ino);
 		secondfs_dbg(INODE, "IAlloc %p: now sb->s_ninode == %d", secsb, le32_to_cpu(sb->s_ninode));
@@ -361,6 +479,8 @@ Inode* FileSystem::IAlloc(SuperBlock *secsb)
 		if(NULL == pNode)
 		{
 			secondfs_err("IAlloc %p: failed igetting %d", secsb, ino);
+			/* 把没用上的外存Inode还回去 Give the inode back */
+			this->IFree(secsb, ino);
 			return NULL;
 		}
 
@@ -394,25 +514,34 @@ extern "C" void FileSystem_IFree(FileSystem *fs, SuperBlock *secsb, int number)
 void FileSystem::IFree(SuperBlock *secsb, int number)
 {
 	SuperBlock* sb = secsb;
-	
-	// If the time is not proper to write to fast stack,
-	// let the Inode rest in Inode area without record.
-	
-	/* 
-	 * 如果超级块直接管理的空闲Inode表上锁，
-	 * 则释放的外存Inode散落在磁盘Inode区中。
-	 */
-	if (secondfs_c_helper_mutex_is_locked(&sb->s_ilock))
+
+	if (number < 0 || number >= (s32)le32_to_cpu(sb->s_isize) * FileSystem::INODE_NUMBER_PER_SECTOR)
 	{
+		secondfs_err("IFree %p: bad Inode number %d!", secsb, number);
 		return;
 	}
 
+	// @Feng Shun: IAlloc() 补充 s_inode[] 时不再读盘, 这里可以等锁
+	// IAlloc() no longer reads the disk under s_ilock, so wait for it
+	secondfs_c_helper_mutex_lock(&sb->s_ilock);
+
 	/* 
 	 * 如果超级块直接管理的空闲外存Inode超过100个，
-	 * 同样让释放的外存Inode散落在磁盘Inode区中。
+	 * 释放的外存Inode记入空闲 Inode 位图, 由 IAlloc() 以后取用.
+	 * With s_inode[] full, record it in the free inode bitmap instead
+	 * of leaving it for a scan of the inode zone to find.
 	 */
 	if(le32_to_cpu(sb->s_ninode) >= 100)
 	{
+		if (!FreeMapTest(sb->s_imap, number))
+		{
+			FreeMapSet(sb->s_imap, number);
+			sb->s_nfreeino++;
+			if (number < sb->s_irotor)
+				sb->s_irotor = number;
+		}
+		secondfs_dbg(INODE, "IFree: released %d to the bitmap, curr sb->s_nfreeino == %d", number, sb->s_nfreeino);
+		secondfs_c_helper_mutex_unlock(&sb->s_ilock);
 		return;
 	}
 
@@ -422,101 +551,112 @@ void FileSystem::IFree(SuperBlock *secsb, int number)
 
 	/* 设置SuperBlock被修改标志 */
 	sb->s_fmod = cpu_to_le32(1);
+	secondfs_c_helper_mutex_unlock(&sb->s_ilock);
 }
 
 extern "C" void FileSystem_Alloc(FileSystem *fs, SuperBlock *secsb) { fs->Alloc(secsb); }
 Buf* FileSystem::Alloc(SuperBlock *secsb)
 {
 	int blkno;	/* 分配到的空闲磁盘块编号 */
+	int got;
 	SuperBlock* sb = secsb;
 	Buf* pBuf;
 
-	secondfs_dbg(FILE, "FileSystem::Alloc(%p)...", secsb);
+	if ((blkno = this->Alloc(secsb, 0, 1, &got)) == 0)
+		return NULL;
+
+	/* 普通情况下成功分配到一空闲磁盘块 */
+	pBuf = sb->s_bufmgr->GetBlk(sb->s_dev, blkno);	/* 为该磁盘块申请缓存 */
+	sb->s_bufmgr->ClrBuf(pBuf);	/* 清空缓存中的数据 */
+
+	return pBuf;
+}
+
+int FileSystem::Alloc(SuperBlock *secsb, int goal, int want, int *got, bool prealloc, int resv)
+{
+	SuperBlock* sb = secsb;
+	int fsize = le32_to_cpu(sb->s_fsize);
+	int blkno;
+	int n;
+
+	secondfs_dbg(FILE, "FileSystem::Alloc(%p, %d, %d)...", secsb, goal, want);
 
 	/* 
-	 * 如果空闲磁盘块索引表正在被上锁，表明有其它进程
-	 * 正在操作空闲磁盘块索引表，因而对其上锁。这通常
+	 * 如果空闲磁盘块位图正在被上锁，表明有其它进程
+	 * 正在操作它，因而对其上锁。这通常
 	 * 是由于其余进程调用Free()或Alloc()造成的。
 	 */
 	secondfs_c_helper_mutex_lock(&sb->s_flock);
 
-	/* Pick a block at the top of fast stack */
-	/* 从索引表“栈顶”获取空闲磁盘块编号 */
-	sb->s_nfree = cpu_to_le32(le32_to_cpu(sb->s_nfree) - 1);
-	blkno = le32_to_cpu(sb->s_free[le32_to_cpu(sb->s_nfree)]);
-
-	secondfs_dbg(FILE, "FileSystem::Alloc(%p): blkno = s_free[%d] == %d", secsb, le32_to_cpu(sb->s_nfree), blkno);
-
 	/* 
-	 * 若获取磁盘块编号为零，则表示已分配尽所有的空闲磁盘块。
-	 * 或者分配到的空闲磁盘块编号不属于数据盘块区域中(由BadBlock()检查)，
-	 * 都意味着分配空闲磁盘块操作失败。
+	 * @Feng Shun: s_frotor 之前没有空闲盘块, 所以没有目标 (或目标在它之前) 时
+	 * 从它开始找到的就是最小的空闲盘块. 目标空闲时不论段长都从它开始,
+	 * 这样文件能接着上一块往下写; 否则从目标往后找一段够长的, 再从头找.
+	 * 不再读盘上的空闲盘块链.
+	 * There is no free block below s_frotor, so without a goal (or with
+	 * one below it) the search from it finds the lowest free block. A free
+	 * goal is taken whatever its run, so the file continues where it left
+	 * off; otherwise look for a long enough run after it, then from the
+	 * start. The chain on disk is no longer read here.
 	 */
-	if(0 == blkno )
+	if (want < 1)
+		want = 1;
+
+	/* @Feng Shun: 别人预留的块不能动 Blocks reserved by others are off limits */
+	if (want > sb->s_nfreeblk - sb->s_nresv + resv)
+		want = sb->s_nfreeblk - sb->s_nresv + resv;
+	if (want < 1)
 	{
-		secondfs_err("FileSystem::Alloc(%p): zero! No space left!", secsb);
-		sb->s_nfree = cpu_to_le32(1);
+		secondfs_dbg(DATABLK, "FileSystem::Alloc(%p): the free blocks left are reserved (%d free, %d reserved)", secsb, sb->s_nfreeblk, sb->s_nresv);
 		secondfs_c_helper_mutex_unlock(&sb->s_flock);
+		*got = 0;
+		return 0;
+	}
 
-		// Diagnose::Write("No Space On %d !\n", dev);
-		// u.u_error = User::ENOSPC;
-		// secondfs_c_helper_bug();
-		return NULL;
+	if (goal < sb->s_frotor || goal >= fsize)
+		goal = sb->s_frotor;
+	if (goal < fsize && FreeMapTest(sb->s_fmap, goal))
+	{
+		blkno = goal;
+		n = FreeMapRun(sb->s_fmap, blkno, fsize, want);
 	}
-	/* if( this->BadBlock(sb, dev, blkno) )
+	else
 	{
-		return NULL;
-	} */
-
-	/* 
-	 * 栈已空，新分配到空闲磁盘块中记录了下一组空闲磁盘块的编号,
-	 * 将下一组空闲磁盘块的编号读入SuperBlock的空闲磁盘块索引表s_free[100]中。
-	 */
-	if((s32)le32_to_cpu(sb->s_nfree) <= 0)
+		blkno = FreeMapFindRun(sb->s_fmap, goal, fsize, fsize, want, &n);
+		if (blkno < 0 && goal > sb->s_frotor)
+			blkno = FreeMapFindRun(sb->s_fmap, sb->s_frotor, goal, fsize, want, &n);
+	}
+	if (blkno < 0)
 	{
-		/* 
-		 * 此处加锁，因为以下要进行读盘操作，有可能发生进程切换，
-		 * 新上台的进程可能对SuperBlock的空闲盘块索引表访问，会导致不一致性。
-		 */
-		// 上面已经加过锁了
-
-		secondfs_dbg(FILE, "FileSystem::Alloc(%p): s_nfree == %d; read next group of free data blocks", secsb, le32_to_cpu(sb->s_nfree));
-
-		/* 读入该空闲磁盘块 */
-		pBuf = this->m_BufferManager->Bread(sb->s_dev, blkno);
-		// We just hard-code IS_ERR() macro here
-		if ((uintptr_t)(pBuf) >= (uintptr_t)-4095) {
-			secondfs_err("FileSystem::Alloc(%p): reading %p/%d failed! errno: %d", secsb, sb->s_dev, blkno, (int)(intptr_t)pBuf);
-
-			secondfs_c_helper_mutex_unlock(&sb->s_flock);
-			return NULL;
-		}
-
-		/* 从该磁盘块的0字节开始记录，共占据4(s_nfree)+400(s_free[100])个字节 */
-		s32* p = (s32 *)pBuf->b_addr;
-
-		/* 首先读出空闲盘块数s_nfree */
-		sb->s_nfree = (*p++);
-
-		/* 读取缓存中后续位置的数据，写入到SuperBlock空闲盘块索引表s_free[100]中 */
-		secondfs_c_helper_memcpy(sb->s_free, p, sizeof(sb->s_free));
-
-		secondfs_dbg(FILE, "FileSystem::Alloc(%p): s_nfree == %d, s_free[top] == %d", secsb, le32_to_cpu(sb->s_nfree), le32_to_cpu(sb->s_free[99]));
+		secondfs_err("FileSystem::Alloc(%p): No space left!", secsb);
+		sb->s_frotor = fsize;
+		secondfs_c_helper_mutex_unlock(&sb->s_flock);
 
-		/* 缓存使用完毕，释放以便被其它进程使用 */
-		this->m_BufferManager->Brelse(pBuf);
+		// Diagnose::Write("No Space On %d !\n", dev);
+		// u.u_error = User::ENOSPC;
+		*got = 0;
+		return 0;
+	}
 
-		/* 解除对空闲磁盘块索引表的锁，唤醒因为等待锁而睡眠的进程 */
+	for (int i = 0; i < n; i++)
+	{
+		FreeMapClear(sb->s_fmap, blkno + i);
+		/* 第一块之外的是预分配的 All but the first are preallocated */
+		if (prealloc && i > 0)
+			FreeMapSet(sb->s_pmap, blkno + i);
 	}
+	sb->s_nfreeblk -= n;
+	if (blkno == sb->s_frotor)
+		sb->s_frotor = blkno + n;
+	FreeMapChanged(sb, blkno + n - 1);
+
+	secondfs_dbg(FILE, "FileSystem::Alloc(%p, %d, %d): [%d, %d), %d free", secsb, goal, want, blkno, blkno + n, sb->s_nfreeblk);
 
 	secondfs_c_helper_mutex_unlock(&sb->s_flock);
 
-	/* 普通情况下成功分配到一空闲磁盘块 */
-	pBuf = this->m_BufferManager->GetBlk(sb->s_dev, blkno);	/* 为该磁盘块申请缓存 */
-	this->m_BufferManager->ClrBuf(pBuf);	/* 清空缓存中的数据 */
 	sb->s_fmod = cpu_to_le32(1);	/* 设置SuperBlock被修改标志 */
-
-	return pBuf;
+	*got = n;
+	return blkno;
 }
 
 extern "C" int FileSystem_Free(FileSystem *fs, SuperBlock *secsb, int blkno) { return fs->Free(secsb, blkno); }
@@ -524,7 +664,6 @@ int FileSystem::Free(SuperBlock *secsb, int blkno)
 {
 	// Release data block
 	SuperBlock* sb = secsb;
-	Buf* pBuf;
 	int ret = 0;
 
 	/* 
@@ -534,72 +673,404 @@ int FileSystem::Free(SuperBlock *secsb, int blkno)
 	 */
 	sb->s_fmod = cpu_to_le32(1);
 
-	/* 如果空闲磁盘块索引表被上锁，则睡眠等待解锁 */
+	/* 如果空闲磁盘块位图被上锁，则睡眠等待解锁 */
 	secondfs_c_helper_mutex_lock(&sb->s_flock);
 
 	/* 检查释放磁盘块的合法性 */
-	/*if(this->BadBlock(sb, dev, blkno))
+	if (blkno < DataStart(sb) || blkno >= (s32)le32_to_cpu(sb->s_fsize) ||
+		FreeMapTest(sb->s_fmap, blkno))
 	{
+		secondfs_err("FileSystem::Free(%p,%d): bad block or already free!", secsb, blkno);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	/* @Feng Shun: 只改位图, 空闲盘块链到 Update() 时才写
+	 * Only the bitmap changes; the chain is written at Update() */
+	FreeMapSet(sb->s_fmap, blkno);
+	FreeMapClear(sb->s_pmap, blkno);	/* 可能是归还的预分配块 It may be a preallocated block given back */
+	sb->s_nfreeblk++;
+	if (blkno < sb->s_frotor)
+		sb->s_frotor = blkno;
+	FreeMapChanged(sb, blkno);
+	secondfs_dbg(DATABLK, "FileSystem::Free(%p,%d): %d free", secsb, blkno, sb->s_nfreeblk);
+
+out:
+	secondfs_c_helper_mutex_unlock(&sb->s_flock);
+	return ret;
+}
+
+void FileSystem::TakePrealloc(SuperBlock *secsb, int blkno, int n)
+{
+	SuperBlock* sb = secsb;
+
+	if (n < 1)
 		return;
-	}*/
+	secondfs_c_helper_mutex_lock(&sb->s_flock);
+	for (int i = 0; i < n; i++)
+		FreeMapClear(sb->s_pmap, blkno + i);
+	FreeMapChanged(sb, blkno + n - 1);
+	secondfs_c_helper_mutex_unlock(&sb->s_flock);
+	sb->s_fmod = cpu_to_le32(1);
+}
 
+int FileSystem::AllocAt(SuperBlock *secsb, int blkno, int want, int resv)
+{
+	SuperBlock* sb = secsb;
+	int fsize = le32_to_cpu(sb->s_fsize);
+	int n = 0;
+
+	secondfs_c_helper_mutex_lock(&sb->s_flock);
+	/* 同 Alloc(), 别人预留的块不能动 As in Alloc(), reservations of others are off limits */
+	if (want > sb->s_nfreeblk - sb->s_nresv + resv)
+		want = sb->s_nfreeblk - sb->s_nresv + resv;
+	if (want > 0 && blkno >= DataStart(sb) && blkno < fsize && FreeMapTest(sb->s_fmap, blkno))
+	{
+		n = FreeMapRun(sb->s_fmap, blkno, fsize, want);
+		for (int i = 0; i < n; i++)
+			FreeMapClear(sb->s_fmap, blkno + i);
+		sb->s_nfreeblk -= n;
+		if (blkno == sb->s_frotor)
+			sb->s_frotor = blkno + n;
+		FreeMapChanged(sb, blkno + n - 1);
+	}
+	secondfs_dbg(FILE, "FileSystem::AllocAt(%p, %d, %d): %d", secsb, blkno, want, n);
+	secondfs_c_helper_mutex_unlock(&sb->s_flock);
+
+	if (n > 0)
+		sb->s_fmod = cpu_to_le32(1);
+	return n;
+}
+
+extern "C" int FileSystem_Reserve(FileSystem *fs, SuperBlock *secsb, int n) { return fs->Reserve(secsb, n); }
+int FileSystem::Reserve(SuperBlock *secsb, int n)
+{
+	SuperBlock* sb = secsb;
+	int ret = 0;
+
+	secondfs_c_helper_mutex_lock(&sb->s_flock);
 	/* 
-	 * Releasing the first free block into fast stack
-	 * Note: this should be an abnormal state. When the
-	 * last data block is allocated, s_nfree == 1.
-	 */
-	/* 
-	 * 如果先前系统中已经没有空闲盘块，
-	 * 现在释放的是系统中第1块空闲盘块
+	 * @Feng Shun: 回写时除了预留的数据块还要分配索引表, 每 128 块约一张,
+	 * 所以另留出预留数的 1/64 和几块余量.
+	 * Writeback also allocates index blocks, about one per 128 data
+	 * blocks, so 1/64 of the reservations plus a few are held back.
 	 */
-	if((s32) le32_to_cpu(sb->s_nfree) <= 0)
+	if (sb->s_nfreeblk - sb->s_nresv - n < (sb->s_nresv + n) / 64 + 8)
+		ret = -ENOSPC;
+	else
+		sb->s_nresv += n;
+	secondfs_c_helper_mutex_unlock(&sb->s_flock);
+	return ret;
+}
+
+extern "C" void FileSystem_Unreserve(FileSystem *fs, SuperBlock *secsb, int n) { fs->Unreserve(secsb, n); }
+void FileSystem::Unreserve(SuperBlock *secsb, int n)
+{
+	SuperBlock* sb = secsb;
+
+	secondfs_c_helper_mutex_lock(&sb->s_flock);
+	sb->s_nresv -= n;
+	if (sb->s_nresv < 0)
 	{
-		secondfs_err("FileSystem::Free(%p,%d): abnormal situation.", secsb, blkno);
-		sb->s_nfree = (s32) cpu_to_le32(1);
-		sb->s_free[0] = 0;	/* 使用0标记空闲盘块链结束标志 */
+		secondfs_err("FileSystem::Unreserve(%p,%d): reservations went negative!", secsb, n);
+		sb->s_nresv = 0;
 	}
+	secondfs_c_helper_mutex_unlock(&sb->s_flock);
+}
+
+extern "C" int FileSystem_LoadFreeMap(FileSystem *fs, SuperBlock *secsb) { return fs->LoadFreeMap(secsb); }
+int FileSystem::LoadFreeMap(SuperBlock *secsb)
+{
+	SuperBlock* sb = secsb;
+	int fsize = le32_to_cpu(sb->s_fsize);
+	int start = DataStart(sb);
+	s32* list = sb->s_free;		/* 当前一组 The current group */
+	int n = le32_to_cpu(sb->s_nfree);
+	int nchain = 0;
+	int ndup = 0;
+	bool loop = false;	/* 链指针重复 The chain pointer was seen before */
+	int blkno;
+	int i;
+	Buf* pBuf = NULL;
+	int ret = 0;
 
-	/* The fast stack in SuperBlock is full */
-	/* SuperBlock中直接管理空闲磁盘块号的栈已满 */
-	if((s32) le32_to_cpu(sb->s_nfree) >= 100)
+	if (fsize <= start || n > 100)
 	{
-		sb->s_nfree = cpu_to_le32(100);
-		secondfs_dbg(DATABLK, "FileSystem::Free(%p,%d): fast stack full.", secsb, blkno);
-		/* 
-		 * 使用当前Free()函数正要释放的磁盘块，存放前一组100个空闲
-		 * 磁盘块的索引表
-		 */
-		pBuf = this->m_BufferManager->GetBlk(secsb->s_dev, blkno);	/* 为当前正要释放的磁盘块分配缓存 */
+		secondfs_err("FileSystem::LoadFreeMap(%p): bad superblock (s_fsize %d, s_isize %d, s_nfree %d)!",
+			secsb, fsize, le32_to_cpu(sb->s_isize), n);
+		return -EINVAL;
+	}
+
+	sb->s_fmap = (u32 *)secondfs_c_helper_vzalloc(((fsize + 31) / 32) * sizeof(u32));
+	if (sb->s_fmap == NULL)
+		return -ENOMEM;
+	sb->s_pmap = (u32 *)secondfs_c_helper_vzalloc(((fsize + 31) / 32) * sizeof(u32));
+	if (sb->s_pmap == NULL)
+	{
+		secondfs_c_helper_vfree(sb->s_fmap);
+		sb->s_fmap = NULL;
+		return -ENOMEM;
+	}
+	sb->s_nfreeblk = 0;
+	sb->s_frotor = start;
+	sb->s_fdirty = -1;
+	sb->s_fchain = 0;
+
+	/* 
+	 * 每组的 list[1..n-1] 是空闲盘块; list[0] 也是空闲盘块, 其中存着下一组
+	 * (4 字节的个数和 100 个盘块号), 为 0 时链结束. 越界的盘块拒绝挂载.
+	 * SaveFreeMap() 就地重写链块, 新的超块写到盘上之前崩溃的话, 旧超块
+	 * 指向的链中会出现重复的盘块: 重复的跳过, 链指针重复 (成环) 时到此为止.
+	 * In each group list[1..n-1] are free blocks; list[0] is a free block
+	 * too, holding the next group (a 4-byte count and 100 block numbers),
+	 * and 0 ends the chain. A block out of range fails the mount.
+	 * SaveFreeMap() rewrites chain blocks in place, so a crash before the
+	 * new superblock is on disk leaves duplicates in the chain the old one
+	 * points to: duplicates are skipped, and a duplicate chain pointer (a
+	 * loop) ends the chain.
+	 */
+	while (n > 0)
+	{
+		for (i = n - 1; i >= 0; i--)
+		{
+			blkno = le32_to_cpu(list[i]);
+			if (i == 0 && blkno == 0)
+				break;
+			if (blkno < start || blkno >= fsize)
+			{
+				secondfs_err("FileSystem::LoadFreeMap(%p): bad free block %d in group %d!", secsb, blkno, nchain);
+				ret = -EINVAL;
+				goto out;
+			}
+			if (FreeMapTest(sb->s_fmap, blkno))
+			{
+				ndup++;
+				if (i == 0)
+					loop = true;
+				continue;
+			}
+			FreeMapSet(sb->s_fmap, blkno);
+			sb->s_nfreeblk++;
+		}
+
+		blkno = loop ? 0 : le32_to_cpu(list[0]);
+		if (pBuf != NULL)
+		{
+			sb->s_bufmgr->BrelseShared(pBuf);
+			pBuf = NULL;
+		}
+		if (blkno == 0)
+			break;
+
+		pBuf = sb->s_bufmgr->BreadShared(sb->s_dev, blkno, 0);
+		// We just hard-code IS_ERR() macro here
+		if ((uintptr_t)(pBuf) >= (uintptr_t)-4095) {
+			secondfs_err("FileSystem::LoadFreeMap(%p): reading %p/%d failed! errno: %d", secsb, sb->s_dev, blkno, (int)(intptr_t)pBuf);
+			ret = (int)(intptr_t)pBuf;
+			pBuf = NULL;
+			goto out;
+		}
 
 		/* 从该磁盘块的0字节开始记录，共占据4(s_nfree)+400(s_free[100])个字节 */
-		u32* p = (u32 *)pBuf->b_addr;
-		
-		/* This block is used to store n_free(most of the time 100) and 100 free
-		 * block numbers stored in fast stack. Then this block is sent to disk,
-		 * and fast stack cleared.
-		 */
-		/* 首先写入空闲盘块数，100块 */
-		*p++ = sb->s_nfree;
-		/* 将SuperBlock的空闲盘块索引表s_free[100]写入缓存中后续位置 */
-		secondfs_c_helper_memcpy(p, sb->s_free, sizeof(sb->s_free));
-
-		sb->s_nfree = cpu_to_le32(0);
-		/* 将存放空闲盘块索引表的“当前释放盘块”写入磁盘，即实现了空闲盘块记录空闲盘块号的目标 */
-		ret = this->m_BufferManager->Bwrite(pBuf);
-		
-		if (ret < 0) {
-			secondfs_err("FileSystem::Free(%p,%d) write failed!", secsb, blkno);
+		list = (s32 *)pBuf->b_addr;
+		n = le32_to_cpu(*list++);
+		nchain++;
+		if (n < 0 || n > 100)
+		{
+			secondfs_err("FileSystem::LoadFreeMap(%p): bad count %d in chain block %d!", secsb, n, blkno);
+			ret = -EINVAL;
 			goto out;
 		}
 	}
+
+	/* 链有问题: 下次 Update() 按位图整条重写 The chain is damaged; have the next Update() rewrite it whole */
+	if (ndup != 0)
+	{
+		secondfs_warn("FileSystem::LoadFreeMap(%p): skipped %d duplicate free blocks; rewriting the free chain", secsb, ndup);
+		sb->s_fdirty = fsize - 1;
+		sb->s_fmod = cpu_to_le32(1);
+	}
+
+	secondfs_dbg(DATABLK, "FileSystem::LoadFreeMap(%p): %d free blocks in %d chain blocks", secsb, sb->s_nfreeblk, nchain);
+
 out:
+	if (pBuf != NULL)
+		sb->s_bufmgr->BrelseShared(pBuf);
+	if (ret < 0)
+	{
+		secondfs_c_helper_vfree(sb->s_fmap);
+		sb->s_fmap = NULL;
+		secondfs_c_helper_vfree(sb->s_pmap);
+		sb->s_pmap = NULL;
+	}
+	return ret;
+}
+
+extern "C" int FileSystem_LoadInodeMap(FileSystem *fs, SuperBlock *secsb) { return fs->LoadInodeMap(secsb); }
+int FileSystem::LoadInodeMap(SuperBlock *secsb)
+{
+	SuperBlock* sb = secsb;
+	int ninode = (s32)le32_to_cpu(sb->s_isize) * FileSystem::INODE_NUMBER_PER_SECTOR;
+	int n = le32_to_cpu(sb->s_ninode);
+	int ino = 0;
+	int i, j, k;
+	Buf* pBuf;
+
+	if (ninode <= 0 || n < 0 || n > 100)
+	{
+		secondfs_err("FileSystem::LoadInodeMap(%p): bad superblock (s_isize %d, s_ninode %d)!",
+			secsb, le32_to_cpu(sb->s_isize), n);
+		return -EINVAL;
+	}
+
+	sb->s_imap = (u32 *)secondfs_c_helper_vzalloc(((ninode + 31) / 32) * sizeof(u32));
+	if (sb->s_imap == NULL)
+		return -ENOMEM;
+	sb->s_nfreeino = 0;
+	sb->s_irotor = 0;
+
+	/* 依次读入磁盘Inode区中的磁盘块, i_mode == 0 的外存Inode是空闲的 */
+	for (i = 0; i < (s32)le32_to_cpu(sb->s_isize); i++)
+	{
+		pBuf = sb->s_bufmgr->BreadShared(sb->s_dev, FileSystem::INODE_ZONE_START_SECTOR + i, 0);
+		// We just hard-code IS_ERR() macro here
+		if ((uintptr_t)(pBuf) >= (uintptr_t)-4095) {
+			secondfs_err("FileSystem::LoadInodeMap(%p): reading %p/%d failed! errno: %d", secsb, sb->s_dev,
+				FileSystem::INODE_ZONE_START_SECTOR + i, (int)(intptr_t)pBuf);
+			secondfs_c_helper_vfree(sb->s_imap);
+			sb->s_imap = NULL;
+			return (int)(intptr_t)pBuf;
+		}
+
+		s32* p = (s32 *)pBuf->b_addr;
+		for (j = 0; j < FileSystem::INODE_NUMBER_PER_SECTOR; j++, ino++)
+		{
+			if (*( p + j * sizeof(DiskInode)/sizeof(s32) ) == 0)
+			{
+				FreeMapSet(sb->s_imap, ino);
+				sb->s_nfreeino++;
+			}
+		}
+		sb->s_bufmgr->BrelseShared(pBuf);
+	}
+
+	/* s_inode[] 中的不再在位图中; 已占用或重复的项丢弃 Keep s_inode[] out of the bitmap */
+	for (i = 0, k = 0; i < n; i++)
+	{
+		ino = le32_to_cpu(sb->s_inode[i]);
+		if (ino < 0 || ino >= ninode || !FreeMapTest(sb->s_imap, ino))
+		{
+			secondfs_err("FileSystem::LoadInodeMap(%p): dropping bad free Inode %d in s_inode[%d]", secsb, ino, i);
+			continue;
+		}
+		FreeMapClear(sb->s_imap, ino);
+		sb->s_nfreeino--;
+		sb->s_inode[k++] = cpu_to_le32(ino);
+	}
+	if (k != n)
+	{
+		sb->s_ninode = cpu_to_le32(k);
+		sb->s_fmod = cpu_to_le32(1);
+	}
+
+	secondfs_dbg(INODE, "FileSystem::LoadInodeMap(%p): %d free inodes besides s_inode[%d]", secsb, sb->s_nfreeino, k);
+	return 0;
+}
+
+int FileSystem::SaveFreeMap(SuperBlock *secsb)
+{
+	SuperBlock* sb = secsb;
+	int fsize = le32_to_cpu(sb->s_fsize);
+	int start = DataStart(sb);
+	int blkno;
+	int chain = fsize;	/* 最近选作链块的盘块 The chain block chosen last */
+	int n;
+	int nwritten = 0;
+	Buf* pBuf;
+	u32* p;
+
+	secondfs_c_helper_mutex_lock(&sb->s_flock);
+
+	if (sb->s_fdirty < 0)
+	{
+		secondfs_c_helper_mutex_unlock(&sb->s_flock);
+		return 0;
+	}
+
+	/* 
+	 * @Feng Shun: 从最大的空闲盘块往下装 s_free[], 装满 100 个时写进下一个
+	 * 空闲盘块, 它成为新一组的 s_free[0]. 这样每组栈顶是组中最小的盘块,
+	 * 别的 V6 实现按栈分配时也是从小到大.
+	 * 一个链块的内容只取决于比它大的空闲盘块, 所以比 s_fdirty 大的链块
+	 * 和上次写的一样, 不必重写.
+	 * Fill s_free[] from the highest free block down; when 100 are in,
+	 * write them into the next free block, which becomes s_free[0] of the
+	 * new group. The top of each group is its lowest block, so stack-order
+	 * allocation by other V6 implementations is ascending too.
+	 * A chain block's content depends only on the free blocks above it,
+	 * so chain blocks above s_fdirty are as last written and are skipped.
+	 *
+	 * 预分配给文件而未用的盘块 (s_pmap) 也按空闲写出, 崩溃后不会丢失.
+	 * 但它们很快会被写入文件数据, 不能当链块: 链块取 chain 之下真正空闲的
+	 * 最大盘块, 它与当前位置之间的预分配块进入新的一组. 因此 chain 及其
+	 * 之上尚未走到的真正空闲盘块都已是链块, 走到时跳过.
+	 * Blocks preallocated to files but unused (s_pmap) are saved as free
+	 * too, so a crash does not leak them. They are about to receive file
+	 * data, though, so they never become chain blocks: the chain block is
+	 * the highest really free block below the last one, and preallocated
+	 * blocks between it and here go into the new group. Really free blocks
+	 * at or above chain not reached yet are thus chain blocks; skip them.
+	 */
+	n = 1;
+	sb->s_free[0] = 0;	/* 使用0标记空闲盘块链结束标志 */
+	for (blkno = FreeMapPrev(sb->s_fmap, sb->s_pmap, start, fsize - 1); blkno >= 0;
+		blkno = FreeMapPrev(sb->s_fmap, sb->s_pmap, start, blkno - 1))
+	{
+		if (blkno >= chain && FreeMapTest(sb->s_fmap, blkno))
+			continue;
+
+		if (n < 100)
+		{
+			sb->s_free[n++] = cpu_to_le32(blkno);
+			continue;
+		}
+
+		/* 组已满, blkno 留给下一组 The group is full; blkno goes to the next one */
+		chain = FreeMapPrev(sb->s_fmap, sb->s_fmap, start, (blkno < chain ? blkno : chain - 1));
+		if (chain < 0)
+		{
+			/* 只剩预分配的块, 记不下了 Only preallocated blocks are left; they cannot be recorded */
+			secondfs_dbg(DATABLK, "FileSystem::SaveFreeMap(%p): no free block left for the chain at %d", secsb, blkno);
+			break;
+		}
+
+		if (chain <= sb->s_fdirty)
+		{
+			pBuf = sb->s_bufmgr->GetBlk(sb->s_dev, chain);
+			sb->s_bufmgr->ClrBuf(pBuf);
+			p = (u32 *)pBuf->b_addr;
+			*p++ = cpu_to_le32(n);
+			secondfs_c_helper_memcpy(p, sb->s_free, sizeof(sb->s_free));
+			sb->s_bufmgr->Bdwrite(pBuf);
+			nwritten++;
+		}
+		n = 1;
+		sb->s_free[0] = cpu_to_le32(chain);
+		/* blkno 本身就是链块时已经用掉了 blkno is used up if it is the chain block itself */
+		if (blkno != chain)
+			sb->s_free[n++] = cpu_to_le32(blkno);
+	}
+
+	for (int i = n; i < 100; i++)
+		sb->s_free[i] = 0;
+	sb->s_nfree = cpu_to_le32(n);
+	sb->s_fdirty = -1;
+	sb->s_fchain = 1;
+
 	secondfs_c_helper_mutex_unlock(&sb->s_flock);
-	sb->s_free[le32_to_cpu(sb->s_nfree)] = cpu_to_le32(blkno);	/* SuperBlock中记录下当前释放盘块号 */
-	sb->s_nfree = cpu_to_le32(le32_to_cpu(sb->s_nfree) + 1);
-	sb->s_fmod = cpu_to_le32(1);
-	secondfs_dbg(DATABLK, "FileSystem::Free(%p,%d): sb->s_free[%d] = %d", secsb, blkno, le32_to_cpu(sb->s_nfree) - 1, sb->s_free[le32_to_cpu(sb->s_nfree) - 1]);
 
-	return ret;
+	secondfs_dbg(DATABLK, "FileSystem::SaveFreeMap(%p): %d chain blocks written", secsb, nwritten);
+	return nwritten;
 }
 
 #if false
@@ -57,10 +57,52 @@ public:
 	Inode*	s_inodep;		// SuperBlock 所在文件系统的根节点
 	Devtab*	s_dev;			// SuperBlock 所在文件系统的设备
 	void * /* struct super_block * */s_vsb;		// VFS 超块
+	BufferManager*	s_bufmgr;		// 本文件系统专用的缓存管理器 Buffer pool & locks of this volume
 
 	struct {u8 data[SECONDFS_MUTEX_SIZE];} __attribute__((packed))	s_update_lock;
 	struct {u8 data[SECONDFS_MUTEX_SIZE];} __attribute__((packed))	s_flock;
 	struct {u8 data[SECONDFS_MUTEX_SIZE];} __attribute__((packed))	s_ilock;
+
+	/* @Feng Shun:
+	 * 空闲盘块位图, 挂载时由 LoadFreeMap() 沿空闲盘块链建立, 置位表示空闲.
+	 * Alloc() 和 Free() 只改位图 (由 s_flock 保护), 不再读写盘上的链;
+	 * s_nfree, s_free[] 和链由 SaveFreeMap() 在 Update() 时按 V6 格式重新生成.
+	 * The free block bitmap, one bit per block, set if free; built by
+	 * LoadFreeMap() from the free chain at mount time. Alloc() and Free()
+	 * only touch the bitmap (under s_flock); s_nfree, s_free[] and the
+	 * chain on disk are regenerated in V6 format by SaveFreeMap() in Update().
+	 */
+	u32*	s_fmap;			// vmalloc-ed, (s_fsize + 31) / 32 个字
+	s32	s_nfreeblk;		// 空闲盘块数 Free blocks
+	s32	s_frotor;		// 它之前没有空闲盘块, Alloc() 从这里往后找 No free block below it; Alloc() searches from here
+	s32	s_fdirty;		// 上次写回链以来变过的最大盘块号, 没有则为 -1 Highest block changed since the chain was saved, or -1
+	s32	s_fchain;		// 盘上的链是否是 SaveFreeMap() 写的 Whether the chain on disk was written by SaveFreeMap()
+
+	/* @Feng Shun: 延迟分配: 写入页缓存时只预留空间 (Reserve()), 回写时才分配盘块.
+	 * Delayed allocation: buffered writes only reserve space (Reserve());
+	 * blocks are allocated at writeback. */
+	s32	s_delalloc;		// 本卷是否延迟分配 (挂载选项 delalloc/nodelalloc) Whether this volume delays allocation
+	s32	s_nresv;		// 已预留而未分配的盘块数, 由 s_flock 保护 Blocks reserved but not allocated yet, under s_flock
+
+	/* @Feng Shun:
+	 * 空闲外存 Inode 位图, 挂载时由 LoadInodeMap() 扫描外存 Inode 区建立.
+	 * 置位表示空闲且不在 s_inode[] 中; IAlloc() 从这里补充 s_inode[],
+	 * IFree() 在 s_inode[] 满时记到这里 (均由 s_ilock 保护).
+	 * The free inode bitmap, built by LoadInodeMap() from the inode zone
+	 * at mount time. A bit is set if the inode is free and not in
+	 * s_inode[]; IAlloc() refills s_inode[] from it and IFree() records
+	 * inodes here when s_inode[] is full (both under s_ilock).
+	 */
+	u32*	s_imap;			// vmalloc-ed, (s_isize * 8 + 31) / 32 个字
+	s32	s_nfreeino;		// 位图中的空闲 Inode 数 Free inodes in the bitmap
+	s32	s_irotor;		// 它之前位图中没有空闲 Inode No free inode in the bitmap below it
+
+	/* @Feng Shun: 预分配给文件而未用的盘块 (见 Inode::AllocBlock()), 不在 s_fmap 中,
+	 * 但 SaveFreeMap() 仍按空闲写出, 崩溃后不会丢失. 由 s_flock 保护.
+	 * Blocks preallocated to files but unused (see Inode::AllocBlock()).
+	 * They are not in s_fmap, but SaveFreeMap() still saves them as free,
+	 * so a crash does not leak them. Under s_flock. */
+	u32*	s_pmap;			// vmalloc-ed, 与 s_fmap 同样大小 Same size as s_fmap
 };
 
 /*
@@ -145,10 +187,76 @@ public:
 	 * @comment 在存储设备dev上分配空闲磁盘块
 	 */
 	Buf* Alloc(SuperBlock *secsb);
+	/* 
+	 * @comment 从 goal 起分配至多 want 个物理连续的空闲盘块, 不申请缓存.
+	 * goal 空闲时从它开始, 否则往后找一段够长的; goal 为 0 时从最小的空闲盘块找.
+	 * 返回第一块的块号, *got 为分到的块数; 没有空间时返回 0.
+	 * Allocate up to want contiguous free blocks, starting at goal if it
+	 * is free, else at the next run long enough; goal 0 means the lowest
+	 * free block. Returns the first block (0 if full), the count in *got.
+	 * prealloc 时第一块之外的记为预分配 (s_pmap), 用到时调用 TakePrealloc().
+	 * 已预留的盘块 (s_nresv) 只留给延迟分配: 本次请求中只有 resv 块
+	 * 是预留过的, 其余的只能用预留之外的空闲盘块.
+	 * With prealloc, all blocks but the first are marked preallocated
+	 * (s_pmap); call TakePrealloc() when one is used.
+	 * Reserved blocks (s_nresv) are kept for delayed allocation: only resv
+	 * of the blocks asked for were reserved, the rest must come from the
+	 * free blocks beyond the reservations.
+	 */
+	int Alloc(SuperBlock *secsb, int goal, int want, int *got, bool prealloc = false, int resv = 0);
+	/* 
+	 * @comment 预分配的盘块 [blkno, blkno + n) 已被文件用上. 归还预分配的块用 Free().
+	 * The preallocated blocks [blkno, blkno + n) are now in use. Give
+	 * unused ones back with Free().
+	 */
+	void TakePrealloc(SuperBlock *secsb, int blkno, int n = 1);
+	/* 
+	 * @comment 从 blkno 起分配至多 want 个物理连续的空闲盘块, 必须正好从
+	 * blkno 开始 (用于接着一段往下映射), 不预分配, 不申请缓存.
+	 * 返回分到的块数, blkno 不空闲时为 0. resv 同 Alloc().
+	 * Allocate up to want contiguous free blocks starting exactly at
+	 * blkno (to extend a run), without preallocation or Bufs. Returns
+	 * the count, 0 if blkno is not free. resv as in Alloc().
+	 */
+	int AllocAt(SuperBlock *secsb, int blkno, int want, int resv = 0);
 	/* 
 	 * @comment 释放secsb所在文件系统编号为blkno的磁盘块
 	 */
 	int Free(SuperBlock *secsb, int blkno);
+	/* 
+	 * @comment 为延迟分配预留 n 个盘块 (只计数, 不占位图). 空闲盘块扣除
+	 * 已有的预留和为索引表留的余量后不够时返回 -ENOSPC.
+	 * Reserve n blocks for delayed allocation (a count only). Returns
+	 * -ENOSPC unless that many are free beyond the existing reservations
+	 * and a margin left for index blocks.
+	 */
+	int Reserve(SuperBlock *secsb, int n);
+	/* 
+	 * @comment 撤销 n 个盘块的预留 (已分配或不再需要)
+	 */
+	void Unreserve(SuperBlock *secsb, int n);
+
+	/* 
+	 * @comment 沿空闲盘块链建立 secsb 的空闲盘块位图, 挂载时调用.
+	 * 链损坏时返回 -EINVAL.
+	 * Build the free block bitmap from the free chain at mount time.
+	 */
+	int LoadFreeMap(SuperBlock *secsb);
+	/* 
+	 * @comment 扫描外存 Inode 区建立 secsb 的空闲 Inode 位图, 挂载时调用.
+	 * s_inode[] 中已被占用或重复的项被丢弃.
+	 * Build the free inode bitmap from the inode zone at mount time.
+	 * Entries of s_inode[] in use or seen twice are dropped.
+	 */
+	int LoadInodeMap(SuperBlock *secsb);
+	/* 
+	 * @comment 按空闲盘块位图重新生成 s_free[] 和空闲盘块链 (延迟写),
+	 * 保持 V6 格式. 由 Update() 在写超块前调用.
+	 * Regenerate s_free[] and the free chain (delayed writes) from the
+	 * bitmap, in V6 format. Called by Update() before writing the superblock.
+	 * Returns the number of chain blocks written.
+	 */
+	int SaveFreeMap(SuperBlock *secsb);
 #if false
 	/* 
 	 * @comment 查找文件系统装配表，搜索指定Inode对应的Mount装配块
@@ -166,7 +274,7 @@ public:
 	/* Members */
 	// Mount m_Mount[NMOUNT];		/* 文件系统装配块表，Mount[0]用于根文件系统 */
 
-	BufferManager* m_BufferManager;		/* FileSystem类需要缓存管理模块(BufferManager)提供的接口 */
+	/* @Feng Shun: 缓存管理器不再是全局唯一的, 改由每个 SuperBlock 的 s_bufmgr 提供 */
 	struct {u8 data[SECONDFS_MUTEX_SIZE];} updlock;	/* Update()函数的锁，该函数用于同步内存各个SuperBlock副本以及，
 						被修改过的内存Inode。任一时刻只允许一个进程调用该函数 */
 };
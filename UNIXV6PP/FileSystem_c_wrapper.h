@@ -34,9 +34,25 @@ typedef struct _SuperBlock
 	Inode*	s_inodep;		// SuperBlock 所在文件系统的根节点
 	Devtab*	s_dev;			// SuperBlock 所在文件系统的设备
 	struct super_block *s_vsb;	// 指向 VFS 超块的指针
+	BufferManager*	s_bufmgr;	// 本文件系统专用的缓存管理器
 	struct mutex s_update_lock;	// Update 锁
 	struct mutex s_flock;		// 空闲盘块索引表的锁
 	struct mutex s_ilock;		// 空闲 Inode 索引表的锁
+
+	u32*	s_fmap;			// 空闲盘块位图, 置位表示空闲
+	s32	s_nfreeblk;		// 空闲盘块数
+	s32	s_frotor;		// 它之前没有空闲盘块, Alloc() 从这里往后找
+	s32	s_fdirty;		// 上次写回链以来变过的最大盘块号, 没有则为 -1
+	s32	s_fchain;		// 盘上的链是否是 SaveFreeMap() 写的
+
+	s32	s_delalloc;		// 本卷是否延迟分配 (挂载选项 delalloc/nodelalloc)
+	s32	s_nresv;		// 已预留而未分配的盘块数, 由 s_flock 保护
+
+	u32*	s_imap;			// 空闲外存 Inode 位图, 置位表示空闲且不在 s_inode[] 中
+	s32	s_nfreeino;		// 位图中的空闲 Inode 数
+	s32	s_irotor;		// 它之前位图中没有空闲 Inode
+
+	u32*	s_pmap;			// 预分配给文件而未用的盘块, SaveFreeMap() 按空闲写出
 } SuperBlock;
 
 //static size_t x = sizeof(Superblock);
@@ -52,7 +68,6 @@ SECONDFS_QUICK_WRAP_CONSTRUCTOR_DESTRUCTOR_DECLARATION(SuperBlock)
 #ifndef __cplusplus
 typedef struct FileSystem
 {
-	BufferManager* m_BufferManager;		/* FileSystem类需要缓存管理模块(BufferManager)提供的接口 */
 	struct mutex updlock;				/* Update()函数的锁，该函数用于同步内存各个SuperBlock副本以及，
 						被修改过的内存Inode。任一时刻只允许一个进程调用该函数 */
 } FileSystem;
@@ -83,6 +98,10 @@ void FileSystem_IFree(FileSystem *fs, SuperBlock *secsb, int number);
 void FileSystem_Alloc(FileSystem *fs, SuperBlock *secsb);
 Inode *FileSystem_IAlloc(FileSystem *fs, SuperBlock *secsb);
 int FileSystem_Free(FileSystem *fs, SuperBlock *secsb, int blkno);
+int FileSystem_LoadFreeMap(FileSystem *fs, SuperBlock *secsb);
+int FileSystem_LoadInodeMap(FileSystem *fs, SuperBlock *secsb);
+int FileSystem_Reserve(FileSystem *fs, SuperBlock *secsb, int n);
+void FileSystem_Unreserve(FileSystem *fs, SuperBlock *secsb, int n);
 
 #ifdef __cplusplus
 }
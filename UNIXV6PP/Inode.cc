@@ -58,6 +58,16 @@ Inode::Inode()
 	this->i_gid = -1;
 	this->i_size = 0;
 	this->i_lastr = -1;
+	this->i_ra_window = 0;
+	this->i_ra_next = 0;
+	this->i_ra_hits = 0;
+	this->i_ra_misses = 0;
+	this->i_ext_hits = 0;
+	this->ExtentInvalidate();
+	this->i_pa_start = 0;
+	this->i_pa_len = 0;
+	this->i_lastpbn = 0;
+	secondfs_c_helper_atomic_set(&this->i_nwriting, 0);
 	for(int i = 0; i < 10; i++)
 	{
 		this->i_addr[i] = 0;
@@ -79,10 +89,12 @@ void Inode::ReadI(IOParameter *io_paramp)
 	int bn;		/* lbn对应的物理盘块号 */
 	int offset;	/* 当前字符块内起始传送位置 */
 	int nbytes;	/* 传送至用户目标区字节数量 */
+	int rabn = 0;	/* 预读起始物理块号, 0 表示不预读 */
+	int nra = 0;	/* 预读块数 */
 	Devtab *dev;
 	Buf* pBuf;
 
-	BufferManager& bufMgr = *secondfs_buffermanagerp;
+	BufferManager& bufMgr = *this->i_ssb->s_bufmgr;
 
 	secondfs_dbg(FILE, "Inode::ReadI(%p,%d,%d)...", io_paramp->m_Base, io_paramp->m_Count, io_paramp->m_Offset);
 
@@ -123,14 +135,32 @@ void Inode::ReadI(IOParameter *io_paramp)
 			/* 将逻辑块号lbn转换成物理盘块号bn ，Bmap有设置Inode::rablock。当UNIX认为获取预读块的开销太大时，
 			 * 会放弃预读，此时 Inode::rablock 值为 0。
 			 * */
-			if( (bn = this->Bmap(lbn)) == 0 )
+			if( (bn = this->Bmap(lbn)) <= 0 )
 			{
 				secondfs_err("Inode::ReadI(%p,%d,%d): Bmap(%d) failed", io_paramp->m_Base, io_paramp->m_Count, io_paramp->m_Offset, lbn);
-				io_paramp->err = -ENOSPC;
+				io_paramp->err = bn < 0 ? bn : -ENOSPC;
 				return;
 			}
 			secondfs_dbg(FILE, "Inode::ReadI(%p,%d,%d): Bmap(%d) -> %d", io_paramp->m_Base, io_paramp->m_Count, io_paramp->m_Offset, lbn, bn);
 			dev = this->i_ssb->s_dev;
+
+			/* @Feng Shun: 顺序读时, 由预读窗口决定异步预读哪些后续块 */
+			rabn = this->ReadAhead(lbn, bn, &nra);
+
+			/* @Feng Shun: 当前块不在缓存中时, 把本次请求范围内物理上连续的
+			 * 后续块一并读入, 合并为一个 I/O 请求.
+			 * If this block is not cached, read the physically contiguous
+			 * blocks of the rest of the request along with it, in one request. */
+			if (bufMgr.InCore(dev, bn) == NULL)
+			{
+				int end = io_paramp->m_Offset + io_paramp->m_Count;
+				int lastlbn = ((end < this->i_size ? end : this->i_size) - 1) / Inode::BLOCK_SIZE;
+				int maxn = lastlbn - lbn + 1;
+
+				if (maxn > bufMgr.RangeLimit())
+					maxn = bufMgr.RangeLimit();
+				bufMgr.Bprefetch(dev, bn, this->ContiguousRun(lbn, bn, maxn));
+			}
 		}
 		else	/* 如果是特殊块设备文件, 我们不处理 */
 		{
@@ -139,21 +169,21 @@ void Inode::ReadI(IOParameter *io_paramp)
 			return;
 		}
 
-		if( this->i_lastr + 1 == lbn && false )	/* 即使是顺序读, 为简单我们也不进行预读 */
+		if( rabn != 0 )
 		{
-			/* 读当前块，并预读下一块 */
-			//pBuf = bufMgr.Breada(dev, bn, Inode::rablock);
+			/* 读当前块，并异步预读其后的窗口 */
+			pBuf = bufMgr.Breada(dev, bn, rabn, nra);
 		}
 		else
 		{
 			pBuf = bufMgr.Bread(dev, bn);
-			// We just hard-code IS_ERR() macro here
-			if ((uintptr_t)(pBuf) >= (uintptr_t)-4095) {
-				secondfs_err("Inode::ReadI(%p,%d,%d): Bread() fail!", io_paramp->m_Base, io_paramp->m_Count, io_paramp->m_Offset);
-				io_paramp->err = (int)(uintptr_t)pBuf;
-				bufMgr.Brelse(pBuf);
-				return;
-			}
+		}
+		// We just hard-code IS_ERR() macro here
+		if ((uintptr_t)(pBuf) >= (uintptr_t)-4095) {
+			secondfs_err("Inode::ReadI(%p,%d,%d): Bread() fail!", io_paramp->m_Base, io_paramp->m_Count, io_paramp->m_Offset);
+			io_paramp->err = (int)(uintptr_t)pBuf;
+			// Bread() has released the Buf already
+			return;
 		}
 		/* 记录最近读取字符块的逻辑块号 */
 		this->i_lastr = lbn;
@@ -191,7 +221,11 @@ void Inode::WriteI(IOParameter *io_paramp)
 	int nbytes;	/* 传送字节数量 */
 	Devtab *dev;
 	Buf* pBuf;
-	BufferManager& bufMgr = *secondfs_buffermanagerp;
+	BufferManager& bufMgr = *this->i_ssb->s_bufmgr;
+	/* 尚未提交的一串物理连续的满块, 用 av_forw 串起 Full blocks waiting to be written as one request */
+	Buf* pRunHead = NULL;
+	Buf* pRunTail = NULL;
+	int nRun = 0;
 
 	secondfs_dbg(FILE, "Inode::WriteI(%p,%d,%d)...", io_paramp->m_Base, io_paramp->m_Count, io_paramp->m_Offset);
 
@@ -226,11 +260,11 @@ void Inode::WriteI(IOParameter *io_paramp)
 		{	/* 普通文件 */
 
 			/* 将逻辑块号lbn转换成物理盘块号bn */
-			if( (bn = this->Bmap(lbn)) == 0 )
+			if( (bn = this->Bmap(lbn)) <= 0 )
 			{
 				secondfs_err("Inode::WriteI(%p,%d,%d): Bmap(%d) failed", io_paramp->m_Base, io_paramp->m_Count, io_paramp->m_Offset, lbn);
-				io_paramp->err = -ENOSPC;
-				return;
+				io_paramp->err = bn < 0 ? bn : -ENOSPC;
+				goto out;
 			}
 			secondfs_dbg(FILE, "Inode::WriteI(%p,%d,%d): Bmap(%d) -> %d", io_paramp->m_Base, io_paramp->m_Count, io_paramp->m_Offset, lbn, bn);
 			dev = this->i_ssb->s_dev;
@@ -257,9 +291,9 @@ void Inode::WriteI(IOParameter *io_paramp)
 			// We just hard-code IS_ERR() macro here
 			if ((uintptr_t)(pBuf) >= (uintptr_t)-4095) {
 				secondfs_err("Inode::WriteI(%p,%d,%d): Bread() fail!", io_paramp->m_Base, io_paramp->m_Count, io_paramp->m_Offset);
-				bufMgr.Brelse(pBuf);
+				// Bread() has released the Buf already
 				io_paramp->err = (int)(uintptr_t)pBuf;
-				return;
+				goto out;
 			}
 		}
 
@@ -284,10 +318,26 @@ void Inode::WriteI(IOParameter *io_paramp)
 		if( (io_paramp->m_Offset % Inode::BLOCK_SIZE) == 0 )	/* 如果写满一个字符块 */
 		{
 			/* 以异步方式将字符块写入磁盘，进程不需等待I/O操作结束，可以继续往下执行 */
-			// bufMgr.Bawrite(pBuf);
-			// 所有的异步写改为同步写
-			secondfs_dbg(FILE_V, "Inode::WriteI(%p,%d,%d): written to edge of a block; Bwrite()", io_paramp->m_Base, io_paramp->m_Count, io_paramp->m_Offset);
-			bufMgr.Bwrite(pBuf);
+			/* @Feng Shun: 与前一块物理相邻时先攒起来, 合并为一个写请求
+			 * Blocks physically following the previous one are merged into one request */
+			secondfs_dbg(FILE_V, "Inode::WriteI(%p,%d,%d): written to edge of a block; Bawrite()", io_paramp->m_Base, io_paramp->m_Count, io_paramp->m_Offset);
+			if (pRunHead != NULL && (bn != pRunTail->b_blkno + 1 || nRun >= bufMgr.RangeLimit()))
+			{
+				bufMgr.BawriteRange(pRunHead);
+				pRunHead = NULL;
+			}
+			pBuf->av_forw = NULL;
+			if (pRunHead == NULL)
+			{
+				pRunHead = pBuf;
+				nRun = 0;
+			}
+			else
+			{
+				pRunTail->av_forw = pBuf;
+			}
+			pRunTail = pBuf;
+			nRun++;
 		}
 		else /* 如果缓冲区未写满 */
 		{
@@ -313,19 +363,421 @@ void Inode::WriteI(IOParameter *io_paramp)
 		 */
 		this->i_flag |= Inode::IUPD;
 	}
+
+out:
+	if (pRunHead != NULL)
+		bufMgr.BawriteRange(pRunHead);
+}
+
+/* @Feng Shun:
+ * ContiguousRun : 从逻辑块 lbn (对应物理块 bn) 起, 有多少块在物理上连续.
+ *                 How many blocks from lbn (mapped to bn) are physically
+ *                 contiguous, at most maxn.
+ * 返回值至少为 1.
+ */
+extern "C" int Inode_ContiguousRun(Inode *i, int lbn, int bn, int maxn) { return i->ContiguousRun(lbn, bn, maxn); }
+int Inode::ContiguousRun(int lbn, int bn, int maxn)
+{
+	int n;
+
+	for (n = 1; n < maxn; n++)
+	{
+		/* 只查不分配: 文件中的空洞打断连续串 */
+		if (this->Bmap(lbn + n, SECONDFS_BMAP_LOOKUP) != bn + n)
+			break;
+	}
+	return n;
+}
+
+/* @Feng Shun:
+ * ReadAhead : 顺序读时维护本文件的预读窗口.
+ *             Maintain the sequential read-ahead window of this file.
+ *      lbn : 本次要读的逻辑块号 (对应物理块 bn)
+ *      nra : 返回应预读的块数
+ *
+ * 返回值: 应预读的起始物理块号, 0 表示这次不预读.
+ *
+ * 非顺序读时窗口复位. 顺序读到之前预读过的块时统计命中/落空:
+ * 落空 (块已被换出) 说明窗口太大, 窗口减半并从当前位置重新预读;
+ * 读者仍在上一个窗口内时就发起下一个窗口 (剩余不足半个窗口时),
+ * 说明预读一直跟得上, 窗口加倍.
+ * A non-sequential read resets the window. A miss on a block we read
+ * ahead (it got evicted) halves the window; issuing the next window
+ * while the reader is still inside the previous one doubles it.
+ */
+int Inode::ReadAhead(int lbn, int bn, int *nra)
+{
+	BufferManager& bufMgr = *this->i_ssb->s_bufmgr;
+	int start, end, lastlbn, rabn, n;
+	int maxwin;
+
+	*nra = 0;
+
+	if (this->i_ra_window < Inode::RA_MIN_WINDOW)
+		this->i_ra_window = Inode::RA_MIN_WINDOW;
+
+	/* 非顺序读: 窗口复位, 不预读 */
+	if (this->i_lastr + 1 != lbn)
+	{
+		this->i_ra_window = Inode::RA_MIN_WINDOW;
+		this->i_ra_next = 0;
+		return 0;
+	}
+
+	/* 本块在上次预读的范围内 */
+	if (lbn < this->i_ra_next)
+	{
+		if (bufMgr.InCore(this->i_ssb->s_dev, bn) != NULL)
+		{
+			this->i_ra_hits++;
+			secondfs_c_helper_atomic_inc(&bufMgr.b_ra_hits);
+		}
+		else
+		{
+			this->i_ra_misses++;
+			secondfs_c_helper_atomic_inc(&bufMgr.b_ra_misses);
+			this->i_ra_window /= 2;
+			if (this->i_ra_window < Inode::RA_MIN_WINDOW)
+				this->i_ra_window = Inode::RA_MIN_WINDOW;
+			this->i_ra_next = lbn;
+		}
+	}
+
+	/* 已预读的块还剩半个窗口以上, 暂不发起 */
+	if (this->i_ra_next - lbn > this->i_ra_window / 2)
+		return 0;
+
+	/* 读者仍在上一个窗口内, 预读跟得上: 窗口加倍 */
+	maxwin = bufMgr.RangeLimit() < Inode::RA_MAX_WINDOW ? bufMgr.RangeLimit() : Inode::RA_MAX_WINDOW;
+	if (this->i_ra_next > lbn)
+	{
+		this->i_ra_window *= 2;
+	}
+	if (this->i_ra_window > maxwin)
+		this->i_ra_window = maxwin;
+
+	start = this->i_ra_next > lbn + 1 ? this->i_ra_next : lbn + 1;
+	end = lbn + this->i_ra_window;
+	lastlbn = (this->i_size - 1) / Inode::BLOCK_SIZE;
+	if (end > lastlbn)
+		end = lastlbn;
+	if (start > end)
+		return 0;
+
+	/* 空洞不预读, 下次从其后继续; 读索引表出错也不预读 */
+	if ((rabn = this->Bmap(start, SECONDFS_BMAP_LOOKUP)) <= 0)
+	{
+		this->i_ra_next = start + 1;
+		return 0;
+	}
+
+	n = this->ContiguousRun(start, rabn, end - start + 1);
+	this->i_ra_next = start + n;
+	*nra = n;
+
+	secondfs_dbg(READAHEAD, "Inode::ReadAhead(%p,%d): lbn %d: window %d, ra %d+%d (hits %u, misses %u)",
+		this->i_ssb, this->i_number, lbn, this->i_ra_window, start, n, this->i_ra_hits, this->i_ra_misses);
+	return rabn;
+}
+
+/* @Feng Shun:
+ * ExtentLookup : 在映射缓存中查找逻辑块 lbn, 命中返回物理块号, 否则返回 0.
+ *                Look lbn up in the mapping cache; 0 on a miss.
+ */
+int Inode::ExtentLookup(int lbn)
+{
+	for (int i = 0; i < SECONDFS_EXTENT_CACHE_SIZE; i++)
+	{
+		if (lbn >= this->i_ext_lbn[i] && lbn < this->i_ext_lbn[i] + this->i_ext_len[i])
+			return this->i_ext_pbn[i] + (lbn - this->i_ext_lbn[i]);
+	}
+	return 0;
+}
+
+/* @Feng Shun:
+ * ExtentInsert : 记录一段映射 [lbn, lbn + len) -> [pbn, pbn + len).
+ *                能接在已有一段之后的就延长它, 否则轮流替换一个槽.
+ *                Extend a run it continues, or replace slots round-robin.
+ */
+void Inode::ExtentInsert(int lbn, int pbn, int len)
+{
+	int i;
+
+	for (i = 0; i < SECONDFS_EXTENT_CACHE_SIZE; i++)
+	{
+		if (this->i_ext_len[i] != 0
+			&& this->i_ext_lbn[i] + this->i_ext_len[i] == lbn
+			&& this->i_ext_pbn[i] + this->i_ext_len[i] == pbn)
+		{
+			this->i_ext_len[i] += len;
+			return;
+		}
+	}
+
+	i = this->i_ext_next;
+	this->i_ext_next = (i + 1) % SECONDFS_EXTENT_CACHE_SIZE;
+	this->i_ext_lbn[i] = lbn;
+	this->i_ext_pbn[i] = pbn;
+	this->i_ext_len[i] = len;
+}
+
+void Inode::ExtentInvalidate()
+{
+	for (int i = 0; i < SECONDFS_EXTENT_CACHE_SIZE; i++)
+		this->i_ext_len[i] = 0;
+	this->i_ext_next = 0;
+}
+
+/* @Feng Shun:
+ * AllocBlock : 为本文件分配一个盘块, 尽量就是 goal (通常是前一块的物理块号 + 1,
+ *              为 0 时接着最近分给本文件的盘块). 普通文件一次向
+ *              FileSystem::Alloc() 要 want 块 (在 PREALLOC_BLOCKS 到
+ *              PREALLOC_MAX_BLOCKS 之间), 余下的预分配给接下来的写,
+ *              几个文件同时增长时也不会交错. 返回清零的缓存, 失败返回 NULL.
+ *              Allocate a block for this file, at goal if possible (usually
+ *              the previous block + 1; 0 continues after the last block
+ *              allocated). Regular files take want blocks at a time
+ *              (PREALLOC_BLOCKS to PREALLOC_MAX_BLOCKS) and keep the rest
+ *              for the next writes, so files growing together do not
+ *              interleave. Returns a zeroed Buf or NULL.
+ *      resv : 这几块已经预留 (延迟分配), 见 FileSystem::Alloc()
+ *             How many of the blocks asked for are already reserved
+ */
+Buf* Inode::AllocBlock(int goal, int want, int resv)
+{
+	BufferManager& bufMgr = *this->i_ssb->s_bufmgr;
+	Buf* pBuf;
+	int blkno;
+
+	if ((blkno = this->AllocBlkno(goal, want, resv)) == 0)
+		return NULL;
+
+	pBuf = bufMgr.GetBlk(this->i_ssb->s_dev, blkno);	/* 为该磁盘块申请缓存 */
+	bufMgr.ClrBuf(pBuf);	/* 清空缓存中的数据 */
+	return pBuf;
+}
+
+/* @Feng Shun:
+ * AllocBlkno : 同 AllocBlock(), 只分配盘块, 不申请缓存. 失败返回 0.
+ *              Like AllocBlock(), but returns the block number only (0 on
+ *              failure), for data the page cache writes.
+ */
+int Inode::AllocBlkno(int goal, int want, int resv)
+{
+	FileSystem& fileSys = *secondfs_filesystemp;
+	int blkno;
+	int got;
+
+	if (goal == 0 && this->i_lastpbn != 0)
+		goal = this->i_lastpbn + 1;
+
+	if (this->i_pa_len > 0 && this->i_pa_start == goal)
+	{
+		blkno = this->i_pa_start++;
+		this->i_pa_len--;
+		fileSys.TakePrealloc(this->i_ssb, blkno);
+	}
+	else
+	{
+		/* 不是接着写, 预分配的块用不上了 Not a continuation; the rest is of no use */
+		this->DiscardPrealloc();
+		if ((this->i_mode & Inode::IFMT) != 0)
+			want = 1;
+		else if (want < Inode::PREALLOC_BLOCKS)
+			want = Inode::PREALLOC_BLOCKS;
+		else if (want > Inode::PREALLOC_MAX_BLOCKS)
+			want = Inode::PREALLOC_MAX_BLOCKS;
+		if ((blkno = fileSys.Alloc(this->i_ssb, goal, want, &got, true, resv)) == 0)
+			return 0;
+		this->i_pa_start = blkno + 1;
+		this->i_pa_len = got - 1;
+	}
+	this->i_lastpbn = blkno;
+	return blkno;
+}
+
+/* @Feng Shun:
+ * DropStale : [blkno, blkno + n) 刚分配给页缓存. 缓存池中若还留着这些块
+ *             以前的内容 (如已删除的目录), 作废它们, 以免以后命中或写回.
+ *             不在缓存中的块什么也不做.
+ *             [blkno, blkno + n) were just given to the page cache. Drop
+ *             what the pool still holds of their old contents (e.g. a
+ *             removed directory) so it is never hit or written back.
+ *             Blocks not in the pool cost a hash lookup only.
+ */
+void Inode::DropStale(int blkno, int n)
+{
+	BufferManager& bufMgr = *this->i_ssb->s_bufmgr;
+
+	for (int i = 0; i < n; i++)
+	{
+		if (bufMgr.InCore(this->i_ssb->s_dev, blkno + i) != NULL)
+			bufMgr.Binval(bufMgr.GetBlk(this->i_ssb->s_dev, blkno + i));
+	}
+}
+
+extern "C" void Inode_DiscardPrealloc(Inode *i) { i->DiscardPrealloc(); }
+void Inode::DiscardPrealloc()
+{
+	FileSystem& fileSys = *secondfs_filesystemp;
+
+	for (; this->i_pa_len > 0; this->i_pa_len--)
+		fileSys.Free(this->i_ssb, this->i_pa_start++);
+}
+
+/* @Feng Shun:
+ * DataBusy : 逻辑块 [lbn, lbn + n) 的页缓存数据是否可能还不在盘上:
+ *            所在的页是脏的或正在回写, 或者有调用已分配了盘块而页还没弄脏.
+ *            Whether the page cache data of [lbn, lbn + n) may not be on
+ *            disk yet: its pages are dirty or under writeback, or a call
+ *            has mapped blocks without dirtying the pages so far.
+ */
+bool Inode::DataBusy(int lbn, int n)
+{
+	if (secondfs_c_helper_atomic_read(&this->i_nwriting) > 0)
+		return true;
+	return secondfs_c_helper_range_busy(&this->vfs_inode, lbn, n) != 0;
+}
+
+/* @Feng Shun:
+ * UnpinTable : 一次间接索引表 blkno 管逻辑块 [lbn, lbn + 128).
+ *              这些块的数据都写到盘上了 (或 force) 就放开它, 让它照常延迟写.
+ *              The single-indirect table blkno maps [lbn, lbn + 128).
+ *              Unpin it once all that data is on disk (or on force).
+ */
+int Inode::UnpinTable(int blkno, int lbn, bool force)
+{
+	BufferManager& bufMgr = *this->i_ssb->s_bufmgr;
+	Buf* bp;
+	int left = 0;
+
+	if (bufMgr.InCore(this->i_ssb->s_dev, blkno) == NULL)
+		return 0;
+	bp = bufMgr.GetBlk(this->i_ssb->s_dev, blkno);
+	if (bp->b_flags & Buf::B_PIN) {
+		if (force || !this->DataBusy(lbn, Inode::ADDRESS_PER_INDEX_BLOCK))
+			bufMgr.Bunpin(bp);
+		else
+			left = 1;
+	}
+	bufMgr.Brelse(bp);
+	return left;
 }
 
-extern "C" int Inode_Bmap(Inode *i, int lbn) { return i->Bmap(lbn); }
-int Inode::Bmap(int lbn)
+extern "C" int Inode_Unpin(Inode *i, int force) { return i->Unpin(force != 0); }
+/* @Feng Shun:
+ * Unpin : Bmap() 给页缓存分配新块时, 指向它们的一次间接索引表被钉住 (Bpin()),
+ *         直接块则只置 IPIN, 以免索引先于数据写到盘上 (崩溃后文件里是旧盘块
+ *         的内容). 数据写完后在这里放开, 调用者持有 i_lock. 返回仍不能放开的个数,
+ *         为 0 时清除 IPIN. force 时全部放开 (文件被删除或出错时).
+ *         When Bmap() gives new blocks to the page cache, the single-indirect
+ *         table pointing to them is pinned (Bpin()) and direct blocks just
+ *         set IPIN, so no index reaches disk before its data (which would
+ *         leave stale contents in the file after a crash). Unpin them here
+ *         once the data is written; the caller holds i_lock. Returns how
+ *         many are still pinned and clears IPIN at 0. force unpins all.
+ */
+int Inode::Unpin(bool force)
+{
+	BufferManager& bufMgr = *this->i_ssb->s_bufmgr;
+	int left = 0;
+
+	if ((this->i_flag & Inode::IPIN) == 0)
+		return 0;
+
+	/* 直接块由 IUpdate() 检查, 这里只看数据是否已写完
+	 * Direct blocks are checked by IUpdate(); only see whether the data is written */
+	if (!force && this->DataBusy(0, 6))
+		left++;
+
+	for (int i = 6; i < 8; i++)
+	{
+		if (this->i_addr[i] != 0)
+			left += this->UnpinTable(this->i_addr[i], Inode::SMALL_FILE_BLOCK + (i - 6) * Inode::ADDRESS_PER_INDEX_BLOCK, force);
+	}
+
+	for (int i = 8; i < 10; i++)
+	{
+		if (this->i_addr[i] == 0)
+			continue;
+		Buf* pFirstBuf = bufMgr.Bread(this->i_ssb->s_dev, this->i_addr[i]);
+		// We just hard-code IS_ERR() macro here
+		if ((uintptr_t)(pFirstBuf) >= (uintptr_t)-4095) {
+			secondfs_err("Inode::Unpin(%p,%d) read i_addr[%d] failed!", this->i_ssb, this->i_number, i);
+			left++;
+			continue;
+		}
+		u32* pFirst = (u32 *)pFirstBuf->b_addr;
+		for (int j = 0; j < Inode::ADDRESS_PER_INDEX_BLOCK; j++)
+		{
+			if (pFirst[j] != 0)
+				left += this->UnpinTable(pFirst[j],
+					Inode::LARGE_FILE_BLOCK + ((i - 8) * Inode::ADDRESS_PER_INDEX_BLOCK + j) * Inode::ADDRESS_PER_INDEX_BLOCK, force);
+		}
+		bufMgr.Brelse(pFirstBuf);
+	}
+
+	if (left == 0)
+		this->i_flag &= ~Inode::IPIN;
+	return left;
+}
+
+/* 释放 Bmap() 读入的索引表: 只查不分配时是共享读入的
+ * Release an index table read by Bmap(); it is shared when only looking up */
+static inline void BmapRelease(BufferManager& bufMgr, Buf* bp, bool shared)
+{
+	if (shared)
+		bufMgr.BrelseShared(bp);
+	else
+		bufMgr.Brelse(bp);
+}
+
+extern "C" int Inode_Bmap(Inode *i, int lbn, int alloc) { return i->Bmap(lbn, alloc); }
+extern "C" int Inode_BmapWant(Inode *i, int lbn, int alloc, int want, int *nr) { return i->Bmap(lbn, alloc, want, nr); }
+/* @Feng Shun: alloc 取值见 SECONDFS_BMAP_*. SECONDFS_BMAP_LOOKUP 时只查不分配,
+ * 遇到空洞 (未分配的块) 返回 0; SECONDFS_BMAP_ALLOC_PAGECACHE 时新数据块的
+ * 内容由页缓存负责, 不在缓存池中留下 (全零的) 缓存. want 是从 lbn 起估计
+ * 还要分配的块数 (如回写时到文件尾的块数), 交给 AllocBlock().
+ * See SECONDFS_BMAP_* for alloc. LOOKUP reports holes as 0; ALLOC_PAGECACHE
+ * leaves no (zeroed) Buf of the new data block behind in the pool. want
+ * estimates the blocks still to allocate from lbn on (e.g. up to EOF at
+ * writeback) and is passed to AllocBlock().
+ * 分配失败时返回 0, 读索引表出错时返回负的错误号.
+ * Returns 0 if allocation fails, a negative errno if an index table
+ * cannot be read.
+ * nr 非空时 *nr 为调用者最多要的块数 (ALLOC_RESERVED 时这些块都已预留).
+ * ALLOC_PAGECACHE 或 ALLOC_RESERVED 分配了 lbn 时,
+ * 其后同一张表中的空洞只要能接着分到物理连续的块, 就一并映射;
+ * 返回时 *nr 为从 lbn 起映射好的连续块数, 其余情况为 1.
+ * If nr is given, *nr is the most blocks the caller takes (all of them
+ * reserved with ALLOC_RESERVED). When ALLOC_PAGECACHE or ALLOC_RESERVED
+ * allocates lbn, the holes after it in the same table
+ * are mapped too as long as they get physically contiguous blocks;
+ * *nr returns the length of that run, 1 otherwise. */
+int Inode::Bmap(int lbn, int alloc, int want, int *nr)
 {
 	Buf* pFirstBuf;
 	Buf* pSecondBuf;
 	int phyBlkno;	/* 转换后的物理盘块号 */
 	int* iTable;	/* 用于访问索引盘块中一次间接、两次间接索引表 */
 	int index;
+	/* 只查不分配时不会改动索引表, 可与其他读者共享 Lookups never modify the tables; share them */
+	bool shared = (alloc == SECONDFS_BMAP_LOOKUP);
+	int max = 1;
+	/* 新数据块不留在缓存池中 The new data block leaves no Buf behind */
+	bool pagecache = (alloc == SECONDFS_BMAP_ALLOC_PAGECACHE || alloc == SECONDFS_BMAP_ALLOC_RESERVED);
+	/* 数据块已预留的块数 Data blocks already reserved */
+	int resv = 0;
+
+	if (nr != NULL)
+	{
+		max = *nr;
+		*nr = 1;
+	}
+	if (alloc == SECONDFS_BMAP_ALLOC_RESERVED)
+		resv = max;
 
-	BufferManager& bufMgr = *secondfs_buffermanagerp;
-	FileSystem& fileSys = *secondfs_filesystemp;
+	BufferManager& bufMgr = *this->i_ssb->s_bufmgr;
 
 	secondfs_dbg(FILE_V, "Inode::Bmap(%d)...", lbn);
 	
@@ -348,12 +800,26 @@ int Inode::Bmap(int lbn)
 		return 0;
 	}
 
+	/* @Feng Shun: 大型、巨型文件先查映射缓存, 命中就不必读间接索引表.
+	 * Large/huge files: try the mapping cache before the index blocks. */
+	if(lbn >= Inode::SMALL_FILE_BLOCK && (phyBlkno = this->ExtentLookup(lbn)) != 0)
+	{
+		secondfs_dbg(FILE_V, "Inode::Bmap(%d): extent cache hit: %d", lbn, phyBlkno);
+		this->i_ext_hits++;
+		secondfs_c_helper_atomic_inc(&this->i_ssb->s_bufmgr->b_ext_hits);
+		return phyBlkno;
+	}
+
 	if(lbn < 6)		/* 如果是小型文件，从基本索引表i_addr[0-5]中获得物理盘块号即可 */
 	{
 		phyBlkno = this->i_addr[lbn];
 
 		secondfs_dbg(FILE_V, "Inode::Bmap(%d): i_addr[%d] == %d", lbn, lbn, phyBlkno);
 		
+		if (phyBlkno == 0 && alloc == SECONDFS_BMAP_LOOKUP) {
+			return 0;
+		}
+
 		if (phyBlkno == 0) {
 			secondfs_dbg(FILE_V, "Inode::Bmap(%d): need Alloc()", lbn);
 		}
@@ -366,17 +832,35 @@ int Inode::Bmap(int lbn)
 		 */
 		if( phyBlkno == 0 )
 		{
-			if ((pFirstBuf = fileSys.Alloc(this->i_ssb)) != NULL) {
+			/* 紧接着前一块分配 Right after the previous block */
+			int goal = lbn > 0 && this->i_addr[lbn - 1] != 0 ? this->i_addr[lbn - 1] + 1 : 0;
+
+			/* 数据由页缓存写回, 不申请缓存 The page cache writes the data; no Buf */
+			if (pagecache)
+				phyBlkno = this->AllocBlkno(goal, want, resv);
+			else if ((pFirstBuf = this->AllocBlock(goal, want)) != NULL)
+			{
 				/* 
 				* 因为后面很可能马上还要用到此处新分配的数据块，所以不急于立刻输出到
 				* 磁盘上；而是将缓存标记为延迟写方式，这样可以减少系统的I/O操作。
 				*/
-				secondfs_dbg(FILE, "Inode::Bmap(%d): Alloc() succeed: %d", lbn, pFirstBuf->b_blkno);
-				bufMgr.Bdwrite(pFirstBuf);
 				phyBlkno = pFirstBuf->b_blkno;
+				bufMgr.Bdwrite(pFirstBuf);
+			}
+			if (phyBlkno != 0) {
+				secondfs_dbg(FILE, "Inode::Bmap(%d): Alloc() succeed: %d", lbn, phyBlkno);
 				/* 将逻辑块号lbn映射到物理盘块号phyBlkno */
 				this->i_addr[lbn] = phyBlkno;
 				this->i_flag |= Inode::IUPD;
+				if (pagecache)
+				{
+					if (max > 1)
+						*nr = this->MapRun(this->i_addr, lbn, 6, phyBlkno, max, resv);
+					this->DropStale(phyBlkno, nr != NULL ? *nr : 1);
+					/* 数据写到盘上之前 IUpdate() 不写 i_addr[] (见 Unpin())
+					 * IUpdate() holds i_addr[] back until the data is on disk */
+					this->i_flag |= Inode::IPIN;
+				}
 			} else {
 				secondfs_err("Inode::Bmap(%d): Alloc() failed", lbn);
 				return 0;	/* 分配失败 */
@@ -396,8 +880,10 @@ int Inode::Bmap(int lbn)
 			Inode::rablock = this->i_addr[lbn + 1];
 		}
 
-		// @Feng Shun: 为保险, 我们这里还是刷新一下缓冲吧
-		bufMgr.Bflush(this->i_ssb->s_dev);
+		// @Feng Shun: 这里不再 Bflush 整个设备. 新分配的块由 i_addr[] 指向,
+		// 而 IUpdate() 在写回 DiskInode 之前会先写出 i_addr[] 新指向的延迟写块.
+		// No Bflush here: i_addr[] only reaches disk in IUpdate(),
+		// which first writes the delayed-write blocks it newly points to.
 		return phyBlkno;
 	}
 	else	/* lbn >= 6 大型、巨型文件 */
@@ -416,29 +902,45 @@ int Inode::Bmap(int lbn)
 		secondfs_dbg(FILE_V, "Inode::Bmap(%d): index block %d", lbn, index);
 
 		phyBlkno = this->i_addr[index];
+		if( 0 == phyBlkno && alloc == SECONDFS_BMAP_LOOKUP )
+		{
+			return 0;
+		}
 		/* 若该项为零，则表示不存在相应的间接索引表块 */
 		if( 0 == phyBlkno )
 		{
 			secondfs_dbg(FILE_V, "Inode::Bmap(%d): i_addr[%d] == 0; need Alloc()", lbn, index);
 			this->i_flag |= Inode::IUPD;
 			/* 分配一空闲盘块存放间接索引表 */
-			if( (pFirstBuf = fileSys.Alloc(this->i_ssb)) == NULL )
+			if( (pFirstBuf = this->AllocBlock(0, want + 1)) == NULL )
 			{
 				secondfs_err("Inode::Bmap(%d): Alloc() failed", lbn);
 				return 0;	/* 分配失败 */
 			}
 			/* i_addr[index]中记录间接索引表的物理盘块号 */
 			secondfs_dbg(FILE, "Inode::Bmap(%d): Alloc() succeed: %d", lbn, pFirstBuf->b_blkno);
+			this->ExtentInvalidate();
 			this->i_addr[index] = pFirstBuf->b_blkno;
 		}
 		else
 		{
 			/* 读出存储间接索引表的字符块 */
 			secondfs_dbg(FILE, "Inode::Bmap(%d): Bread i_addr[%d] == %d", lbn, index, phyBlkno);
-			pFirstBuf = bufMgr.Bread(this->i_ssb->s_dev, phyBlkno);
+			if (shared)
+				pFirstBuf = bufMgr.BreadShared(this->i_ssb->s_dev, phyBlkno, Buf::B_HOT);
+			else
+				pFirstBuf = bufMgr.Bread(this->i_ssb->s_dev, phyBlkno);
+			// We just hard-code IS_ERR() macro here
+			if ((uintptr_t)(pFirstBuf) >= (uintptr_t)-4095) {
+				secondfs_err("Inode::Bmap(%d): Bread(%d) failed", lbn, phyBlkno);
+				return (int)(intptr_t)(pFirstBuf);
+			}
 		}
 		/* 获取缓冲区首址 */
 		iTable = (int *)pFirstBuf->b_addr;
+		/* 索引块是元数据, 释放后进入热队列 Index blocks are metadata; keep them hot */
+		if (!shared)
+			pFirstBuf->b_flags |= Buf::B_HOT;
 
 		if(index >= 8)	/* ASSERT: 8 <= index <= 9 */
 		{
@@ -451,33 +953,60 @@ int Inode::Bmap(int lbn)
 
 			/* iTable指向缓存中的二次间接索引表。该项为零，不存在一次间接索引表 */
 			phyBlkno = iTable[index];
+			if( 0 == phyBlkno && alloc == SECONDFS_BMAP_LOOKUP )
+			{
+				bufMgr.BrelseShared(pFirstBuf);
+				return 0;
+			}
 			if( 0 == phyBlkno )
 			{
 				secondfs_dbg(FILE_V, "Inode::Bmap(%d): 2nd level indirect index block iTable[%d] == 0; need Alloc()", lbn, index);
-				if( (pSecondBuf = fileSys.Alloc(this->i_ssb)) == NULL)
+				if( (pSecondBuf = this->AllocBlock(0, want + 1)) == NULL)
 				{
 					/* 分配一次间接索引表磁盘块失败，释放缓存中的二次间接索引表，然后返回 */
 					secondfs_err("Inode::Bmap(%d): Alloc() failed", lbn);
 					bufMgr.Brelse(pFirstBuf);
 					return 0;
 				}
-				/* 将新分配的一次间接索引表磁盘块号，记入二次间接索引表相应项 */
 				secondfs_dbg(FILE, "Inode::Bmap(%d): Alloc() succeed: %d", lbn, pSecondBuf->b_blkno);
-				iTable[index] = pSecondBuf->b_blkno;
+				this->ExtentInvalidate();
+				/* 
+				 * @Feng Shun: 二次间接索引表随时可能被换出写回, 所以清零后的
+				 * 一次间接索引表必须先于指向它的表项同步写到磁盘上.
+				 * The zeroed table must be on disk before the entry
+				 * pointing to it, since the parent may be written any time.
+				 */
+				phyBlkno = pSecondBuf->b_blkno;
+				if ((pSecondBuf = this->WriteNewChild(pSecondBuf)) == NULL) {
+					bufMgr.Brelse(pFirstBuf);
+					return 0;
+				}
+				/* 将新分配的一次间接索引表磁盘块号，记入二次间接索引表相应项 */
+				iTable[index] = phyBlkno;
 				/* 将更改后的二次间接索引表延迟写方式输出到磁盘 */
 				bufMgr.Bdwrite(pFirstBuf);
 			}
 			else
 			{
 				/* 释放二次间接索引表占用的缓存，并读入一次间接索引表 */
-				bufMgr.Brelse(pFirstBuf);
+				BmapRelease(bufMgr, pFirstBuf, shared);
 				secondfs_dbg(FILE_V, "Inode::Bmap(%d): Bread iTable[%d] == %d", lbn, index, phyBlkno);
-				pSecondBuf = bufMgr.Bread(this->i_ssb->s_dev, phyBlkno);
+				if (shared)
+					pSecondBuf = bufMgr.BreadShared(this->i_ssb->s_dev, phyBlkno, Buf::B_HOT);
+				else
+					pSecondBuf = bufMgr.Bread(this->i_ssb->s_dev, phyBlkno);
+				// We just hard-code IS_ERR() macro here
+				if ((uintptr_t)(pSecondBuf) >= (uintptr_t)-4095) {
+					secondfs_err("Inode::Bmap(%d): Bread(%d) failed", lbn, phyBlkno);
+					return (int)(intptr_t)(pSecondBuf);
+				}
 			}
 
 			pFirstBuf = pSecondBuf;
 			/* 令iTable指向一次间接索引表 */
 			iTable = (int *)pSecondBuf->b_addr;
+			if (!shared)
+				pSecondBuf->b_flags |= Buf::B_HOT;
 		}
 
 		/* 计算逻辑块号lbn最终位于一次间接索引表中的表项序号index */
@@ -493,19 +1022,92 @@ int Inode::Bmap(int lbn)
 
 		secondfs_dbg(FILE_V, "Inode::Bmap(%d): offset index in index block: %d; iTable[%d] == %d", lbn, index, index, iTable[index]);
 
+		/* 找到预读块对应的物理盘块号，如果获取预读块号需要额外的一次for间接索引块的IO，不合算，放弃.
+		 * @Feng Shun: 下面各条路径都会释放 (或延迟写) 这张表, 所以趁现在还持有它时读出.
+		 * Every path below releases (or delayed-writes) the table; read it while we still hold it. */
+		Inode::rablock = 0;
+		if( index + 1 < Inode::ADDRESS_PER_INDEX_BLOCK)
+		{
+			Inode::rablock = iTable[index + 1];
+		}
+
+		if (iTable[index] == 0 && alloc == SECONDFS_BMAP_LOOKUP)
+		{
+			bufMgr.BrelseShared(pFirstBuf);
+			return 0;
+		}
+
 		if (iTable[index] == 0)
 			secondfs_dbg(FILE_V, "Inode::Bmap(%d): iTable[index] == 0; need Alloc()", lbn);
 
 		if( (phyBlkno = iTable[index]) == 0)
 		{
-			if ((pSecondBuf = fileSys.Alloc(this->i_ssb)) != NULL) {
-				/* 将分配到的文件数据盘块号登记在一次间接索引表中 */
-				secondfs_dbg(FILE, "Inode::Bmap(%d): Alloc() succeed: %d", lbn, pSecondBuf->b_blkno);
+			/* 紧接着本表中的前一块, 表中第一块接着表本身
+			 * Right after the previous entry, or the table itself */
+			int goal = index > 0 && iTable[index - 1] != 0 ? iTable[index - 1] + 1 : pFirstBuf->b_blkno + 1;
+
+			/* 数据由页缓存写回; 新块未写之前由页缓存负责清零 */
+			if (pagecache)
+				phyBlkno = this->AllocBlkno(goal, want, resv);
+			else if ((pSecondBuf = this->AllocBlock(goal, want)) != NULL)
 				phyBlkno = pSecondBuf->b_blkno;
+			if (phyBlkno != 0) {
+				secondfs_dbg(FILE, "Inode::Bmap(%d): Alloc() succeed: %d", lbn, phyBlkno);
+				this->ExtentInvalidate();
+				/* @Feng Shun: 同上, 清零的数据盘块必须先于一次间接索引表写到
+				 * 磁盘上 (表随时可能被回写), 写成功了才登记进表里.
+				 * As above, the zeroed data block must be on disk before
+				 * the table (which may be written any time); it is only
+				 * entered in the table once the write succeeded. */
+				if (!pagecache && bufMgr.Bwrite(pSecondBuf) != 0)
+				{
+					secondfs_err("Inode::Bmap(%d): Bwrite(%d) failed", lbn, phyBlkno);
+					secondfs_filesystemp->Free(this->i_ssb, phyBlkno);
+					bufMgr.Brelse(pFirstBuf);
+					return 0;
+				}
+				/* 将分配到的文件数据盘块号登记在一次间接索引表中 */
 				iTable[index] = phyBlkno;
-				/* 将数据盘块、更改后的一次间接索引表用延迟写方式输出到磁盘 */
-				bufMgr.Bdwrite(pSecondBuf);
-				bufMgr.Bdwrite(pFirstBuf);
+				if (!pagecache)
+				{
+					/* 将更改后的一次间接索引表用延迟写方式输出到磁盘 */
+					bufMgr.Bdwrite(pFirstBuf);
+					return phyBlkno;
+				}
+
+				int n = 1;
+
+				if (max > 1)
+					n = *nr = this->MapRun(iTable, index, Inode::ADDRESS_PER_INDEX_BLOCK, phyBlkno, max, resv);
+				this->DropStale(phyBlkno, n);
+				/* @Feng Shun: 新块的数据还在页缓存中, 表要等它们写到盘上之后才能
+				 * 写出: 把表钉在缓存池中, 由 Unpin() 放开. 钉住的表已经太多时,
+				 * 改为先把新块清零写到盘上, 表就可以照常延迟写.
+				 * The data of the new blocks is still in the page cache and
+				 * the table may only go out after it: pin the table in the
+				 * pool until Unpin(). With too many tables pinned already,
+				 * zero the new blocks on disk instead and delay-write the
+				 * table as usual. */
+				if (!bufMgr.PinFull())
+				{
+					this->i_flag |= Inode::IPIN;
+					bufMgr.Bpin(pFirstBuf);
+				}
+				else if (secondfs_c_helper_zeroout(this->i_ssb->s_dev->d_bdev, phyBlkno, n) == 0)
+					bufMgr.Bdwrite(pFirstBuf);
+				else
+				{
+					secondfs_err("Inode::Bmap(%d): zeroing [%d, %d) failed", lbn, phyBlkno, phyBlkno + n);
+					for (int i = 0; i < n; i++)
+					{
+						iTable[index + i] = 0;
+						secondfs_filesystemp->Free(this->i_ssb, phyBlkno + i);
+					}
+					bufMgr.Brelse(pFirstBuf);
+					if (nr != NULL)
+						*nr = 1;
+					return 0;
+				}
 			} else {
 				secondfs_err("Inode::Bmap(%d): Alloc() failed", lbn);
 				bufMgr.Brelse(pFirstBuf);
@@ -514,22 +1116,102 @@ int Inode::Bmap(int lbn)
 		}
 		else
 		{
+			/* @Feng Shun: 顺便把本表中从 index 起物理连续的一段记入映射缓存,
+			 * 之后顺序访问这些块都不必再读这张表.
+			 * Cache the physically contiguous run starting here, so
+			 * the following blocks need not read this table again. */
+			int n = 1;
+			while (index + n < Inode::ADDRESS_PER_INDEX_BLOCK && iTable[index + n] == phyBlkno + n)
+				n++;
+			this->ExtentInsert(lbn, phyBlkno, n);
+
 			/* 释放一次间接索引表占用缓存 */
-			bufMgr.Brelse(pFirstBuf);
-		}
-		/* 找到预读块对应的物理盘块号，如果获取预读块号需要额外的一次for间接索引块的IO，不合算，放弃 */
-		Inode::rablock = 0;
-		if( index + 1 < Inode::ADDRESS_PER_INDEX_BLOCK)
-		{
-			Inode::rablock = iTable[index + 1];
+			BmapRelease(bufMgr, pFirstBuf, shared);
 		}
 
-		// @Feng Shun: 为保险, 我们这里还是刷新一下缓冲吧
-		bufMgr.Bflush(this->i_ssb->s_dev);
 		return phyBlkno;
 	}
 }
 
+/* @Feng Shun:
+ * MapRun : table[index] 刚映射到 pbn. 其后的表项 (不超过 limit, 连同
+ *          index 共至多 max 项) 只要是空洞, 就映射到紧接 pbn 的块:
+ *          先一次拿走预分配窗口中接着的部分, 窗口用完后再向
+ *          FileSystem::AllocAt() 要紧接着的空闲盘块. 只用于页缓存的
+ *          分配, 不申请缓存 (由调用者 DropStale()). 段在表尾结束:
+ *          下一张间接索引表本身要占一块, 物理上本来就不连续.
+ *          table[index] was just mapped to pbn. Map the holes after it
+ *          (below limit, at most max entries counting index) to the
+ *          blocks following pbn: first the rest of the preallocation
+ *          window, taken at once, then more from FileSystem::AllocAt()
+ *          while the blocks right after are free. Page cache allocations
+ *          only; no Bufs (the caller calls DropStale()). The run ends with
+ *          the table: the next index table takes a block of its own, so
+ *          the data is not contiguous across it anyway.
+ *      resv : 同 Bmap(), 非 0 时这些块都已预留
+ * 返回从 index 起映射好的块数 (至少为 1).
+ */
+int Inode::MapRun(s32* table, int index, int limit, int pbn, int max, int resv)
+{
+	FileSystem& fileSys = *secondfs_filesystemp;
+	int n, take;
+
+	/* 只映射接着的空洞 Only the holes right after */
+	if (max > limit - index)
+		max = limit - index;
+	for (n = 1; n < max && table[index + n] == 0; n++)
+		;
+	max = n;
+
+	n = 1;
+	if (n < max && this->i_pa_len > 0 && this->i_pa_start == pbn + 1)
+	{
+		take = max - n < this->i_pa_len ? max - n : this->i_pa_len;
+		fileSys.TakePrealloc(this->i_ssb, this->i_pa_start, take);
+		this->i_pa_start += take;
+		this->i_pa_len -= take;
+		n += take;
+	}
+	if (n < max && this->i_pa_len == 0)
+		n += fileSys.AllocAt(this->i_ssb, pbn + n, max - n, resv > 0 ? max - n : 0);
+
+	for (int i = 1; i < n; i++)
+		table[index + i] = pbn + i;
+	this->i_lastpbn = pbn + n - 1;
+	return n;
+}
+
+/* @Feng Shun:
+ * WriteNewChild : 把一个刚 Alloc() 出来 (已清零) 的块同步写到磁盘上,
+ *                 之后才能把指向它的表项写进间接索引表.
+ *                 Write a freshly allocated (zeroed) block synchronously,
+ *                 so that it reaches disk before any block pointing to it.
+ *      bp : Alloc() 返回的缓存, 本函数负责释放它
+ *
+ * 成功时返回重新取得的同一块的缓存 (命中, 不会再读盘);
+ * 失败时归还该盘块, 返回 NULL.
+ */
+Buf* Inode::WriteNewChild(Buf* bp)
+{
+	BufferManager& bufMgr = *this->i_ssb->s_bufmgr;
+	int blkno = bp->b_blkno;
+
+	if (bufMgr.Bwrite(bp) != 0) {
+		secondfs_err("Inode::WriteNewChild(%d): Bwrite() failed", blkno);
+		secondfs_filesystemp->Free(this->i_ssb, blkno);
+		return NULL;
+	}
+
+	bp = bufMgr.Bread(this->i_ssb->s_dev, blkno);
+	// We just hard-code IS_ERR() macro here
+	if ((uintptr_t)(bp) >= (uintptr_t)-4095) {
+		secondfs_err("Inode::WriteNewChild(%d): Bread() failed", blkno);
+		secondfs_filesystemp->Free(this->i_ssb, blkno);
+		return NULL;
+	}
+	return bp;
+}
+
 #if false
 void Inode::OpenI(int mode)
 {
@@ -609,7 +1291,7 @@ int Inode::IUpdate(int time)
 {
 	// Write Inode to disk
 	Buf* pBuf;
-	BufferManager* bufMgr = secondfs_buffermanagerp;
+	BufferManager* bufMgr = this->i_ssb->s_bufmgr;
 	int ret;
 
 	/* 当IUPD和IACC标志之一被设置，才需要更新相应DiskInode
@@ -641,6 +1323,43 @@ int Inode::IUpdate(int time)
 		/* 直接用指针转换, 向缓存内的 DiskInode 结构写内容 */
 		DiskInode* pNode = (DiskInode *)p;
 
+		/* @Feng Shun: i_addr[] 新指向的块 (数据块或索引表) 可能仍为延迟写,
+		 * 它们必须先于 DiskInode 写到磁盘上. 只写出这些块, 不刷整个设备.
+		 * Blocks newly pointed to by i_addr[] may still be delayed-write;
+		 * they must reach disk before the DiskInode does. Write just
+		 * those, not the whole device. */
+		for (int i = 0; i < 10; i++)
+		{
+			int blkno = this->i_addr[i];
+			Buf* bp;
+
+			if (blkno == 0 || (int)le32_to_cpu(pNode->d_addr[i]) == blkno)
+				continue;
+			/* 新指向的页缓存数据还没写到盘上, 这次先不写 (见 Unpin())
+			 * The page cache data newly pointed to is not on disk yet; not this time */
+			if (i < 6 && (this->i_flag & Inode::IPIN) && this->DataBusy(i, 1)) {
+				bufMgr->Brelse(pBuf);
+				return 1;
+			}
+			if (bufMgr->InCore(this->i_ssb->s_dev, blkno) == NULL)
+				continue;
+			bp = bufMgr->GetBlk(this->i_ssb->s_dev, blkno);
+			if ((bp->b_flags & Buf::B_DELWRI) == 0) {
+				bufMgr->Brelse(bp);
+				continue;
+			}
+			if (bp->b_flags & Buf::B_PIN) {
+				bufMgr->Brelse(bp);
+				bufMgr->Brelse(pBuf);
+				return 1;
+			}
+			if ((ret = bufMgr->Bwrite(bp)) != 0) {
+				secondfs_err("Inode::IUpdate(%p,%d): Bwrite(%d) failed!", this->i_ssb, this->i_number, blkno);
+				bufMgr->Brelse(pBuf);
+				return ret;
+			}
+		}
+
 		/* 将内存Inode副本中的信息复制到dInode中，然后将dInode覆盖缓存中旧的外存Inode */
 		/* 注意端序转换!!*/
 		pNode->d_mode = cpu_to_le32(this->i_mode);
@@ -676,7 +1395,6 @@ int Inode::IUpdate(int time)
 			return ret;
 		}
 
-		bufMgr->Bflush(this->i_ssb->s_dev);
 		return 0;
 	}
 	return 0;
@@ -686,7 +1404,7 @@ extern "C" int Inode_ITrunc(Inode *i) { return i->ITrunc(); }
 int Inode::ITrunc()
 {
 	/* 经由磁盘高速缓存读取存放一次间接、两次间接索引表的磁盘块 */
-	BufferManager* bm = secondfs_buffermanagerp;
+	BufferManager* bm = this->i_ssb->s_bufmgr;
 	/* 获取g_FileSystem对象的引用，执行释放磁盘块的操作 */
 	FileSystem* filesys = secondfs_filesystemp;
 	int ret;
@@ -699,6 +1417,12 @@ int Inode::ITrunc()
 
 	secondfs_dbg(INODE, "Inode::Trunc(%p,%d)...", this->i_ssb, this->i_number);
 
+	/* 索引表即将被清空, 映射缓存随之失效 */
+	this->ExtentInvalidate();
+	/* 预分配的块也一并归还 Give the preallocated blocks back too */
+	this->DiscardPrealloc();
+	this->i_lastpbn = 0;
+
 	/* 采用FILO方式释放，以尽量使得SuperBlock中记录的空闲盘块号连续。
 	 * 
 	 * Unix V6++的文件索引结构：(小型、大型和巨型文件)
@@ -772,6 +1496,7 @@ int Inode::ITrunc()
 								}
 							}
 							/* 缓存使用完毕，释放以便被其它进程使用 */
+							bm->Bunpin(pSecondBuf);
 							bm->Brelse(pSecondBuf);
 						}
 						secondfs_dbg(INODE, "Inode::Trunc(%p,%d) free i_addr[%d][%d] == %d", this->i_ssb, this->i_number, i, j, pFirst[j]);
@@ -781,6 +1506,8 @@ int Inode::ITrunc()
 						}
 					}
 				}
+				/* 钉住的表随文件一起释放, 不再写出 A pinned table goes with the file */
+				bm->Bunpin(pFirstBuf);
 				bm->Brelse(pFirstBuf);
 			}
 			/* 释放索引表本身占用的磁盘块 */
@@ -874,6 +1601,16 @@ void Inode::Clean()
 	this->i_gid = -1;
 	this->i_size = 0;
 	this->i_lastr = -1;
+	this->i_ra_window = 0;
+	this->i_ra_next = 0;
+	this->i_ra_hits = 0;
+	this->i_ra_misses = 0;
+	this->i_ext_hits = 0;
+	this->ExtentInvalidate();
+	this->i_pa_start = 0;
+	this->i_pa_len = 0;
+	this->i_lastpbn = 0;
+	secondfs_c_helper_atomic_set(&this->i_nwriting, 0);
 	for(int i = 0; i < 10; i++)
 	{
 		this->i_addr[i] = 0;
@@ -908,6 +1645,7 @@ void Inode::ICopy(Buf *bp, int inumber)
 	{
 		this->i_addr[i] = (signed) le32_to_cpu(pNode->d_addr[i]);
 	}
+	this->ExtentInvalidate();
 }
 
 /*======================class DiskInode======================*/
@@ -947,7 +1685,8 @@ extern "C" {
 		SECONDFS_IACC = Inode::INodeFlag::IACC,		/* 内存inode被访问过，需要修改最近一次访问时间 */
 		SECONDFS_IMOUNT = Inode::INodeFlag::IMOUNT,	/* 内存inode用于挂载子文件系统 */
 		SECONDFS_IWANT = Inode::INodeFlag::IWANT,		/* 有进程正在等待该内存inode被解锁，清ILOCK标志时，要唤醒这种进程 */
-		SECONDFS_ITEXT = Inode::INodeFlag::ITEXT		/* 内存inode对应进程图像的正文段 */
+		SECONDFS_ITEXT = Inode::INodeFlag::ITEXT,		/* 内存inode对应进程图像的正文段 */
+		SECONDFS_IPIN = Inode::INodeFlag::IPIN		/* i_addr[] 或钉住的索引表可能指向还没写到盘上的页缓存数据 */
 	;
 
 	const u32
@@ -90,7 +90,8 @@ public:
 		IACC  = 0x4,		/* 内存inode被访问过，需要修改最近一次访问时间 */
 		IMOUNT = 0x8,		/* 内存inode用于挂载子文件系统 */
 		IWANT = 0x10,		/* 有进程正在等待该内存inode被解锁，清ILOCK标志时，要唤醒这种进程 */
-		ITEXT = 0x20		/* 内存inode对应进程图像的正文段 */
+		ITEXT = 0x20,		/* 内存inode对应进程图像的正文段 */
+		IPIN = 0x40		/* i_addr[] 或钉住的索引表可能指向还没写到盘上的页缓存数据 (见 Unpin()) */
 	};
 	
 	/* static const member */
@@ -119,6 +120,12 @@ public:
 
 	static const s32 PIPSIZ = SMALL_FILE_BLOCK * BLOCK_SIZE;
 
+	static const s32 RA_MIN_WINDOW = 4;		/* 顺序读预读窗口的最小块数 */
+	static const s32 RA_MAX_WINDOW = 64;	/* 顺序读预读窗口的最大块数 (另受 BufferManager::RangeLimit() 限制) */
+
+	static const s32 PREALLOC_BLOCKS = 8;	/* 普通文件每次向 FileSystem::Alloc() 要的连续块数 */
+	static const s32 PREALLOC_MAX_BLOCKS = 256;	/* 回写时知道文件大小, 一次最多要这么多块 */
+
 	/* static member */
 	static s32 rablock;		/* 顺序读时，使用预读技术读入文件的下一字符块，rablock记录了下一逻辑块号
 							经过bmap转换得到的物理盘块号。将rablock作为静态变量的原因：调用一次bmap的开销
@@ -154,7 +161,65 @@ public:
 	/* 
 	 * @comment 将文件的逻辑块号转换成对应的物理盘块号
 	 */
-	int Bmap(int lbn);
+	int Bmap(int lbn, int alloc = SECONDFS_BMAP_ALLOC, int want = 1, int *nr = NULL);
+	/* 
+	 * @comment 把 table[index] 之后的空洞一次映射到紧接 pbn 的块
+	 * (先取预分配窗口, 再向 FileSystem 要)
+	 */
+	int MapRun(s32* table, int index, int limit, int pbn, int max, int resv);
+	/* 
+	 * @comment 将新分配的块同步写回磁盘, 保证其先于指向它的表项落盘
+	 */
+	Buf* WriteNewChild(Buf* bp);
+	/* 
+	 * @comment 从逻辑块 lbn 起物理上连续的块数 (至多 maxn)
+	 */
+	int ContiguousRun(int lbn, int bn, int maxn);
+	/* 
+	 * @comment 顺序读时调整预读窗口, 返回应预读的起始物理块号 (0 表示不预读)
+	 */
+	int ReadAhead(int lbn, int bn, int *nra);
+	/* 
+	 * @comment 在映射缓存中查找 lbn 对应的物理块号, 未命中返回 0
+	 */
+	int ExtentLookup(int lbn);
+	/* 
+	 * @comment 把 [lbn, lbn + len) -> [pbn, pbn + len) 记入映射缓存
+	 */
+	void ExtentInsert(int lbn, int pbn, int len);
+	/* 
+	 * @comment 清空映射缓存
+	 */
+	void ExtentInvalidate();
+	/* 
+	 * @comment 为本文件分配一个清零的盘块, 尽量是 goal, 优先取预分配的块;
+	 * want 为从这块起估计还要的块数, 其中 resv 块已经预留
+	 */
+	Buf* AllocBlock(int goal, int want = 1, int resv = 0);
+	/* 
+	 * @comment 同 AllocBlock(), 只返回盘块号, 不申请缓存 (数据由页缓存负责)
+	 */
+	int AllocBlkno(int goal, int want = 1, int resv = 0);
+	/* 
+	 * @comment 作废缓存池中 [blkno, blkno + n) 的旧内容, 不在缓存中的不管
+	 */
+	void DropStale(int blkno, int n);
+	/* 
+	 * @comment 归还预分配而未用的盘块
+	 */
+	void DiscardPrealloc();
+	/* 
+	 * @comment 放开数据已写到盘上的索引表 (force 时全部放开), 返回仍钉住的个数
+	 */
+	int Unpin(bool force);
+	/* 
+	 * @comment 放开管逻辑块 [lbn, lbn + 128) 的一次间接索引表 blkno, 仍钉住时返回 1
+	 */
+	int UnpinTable(int blkno, int lbn, bool force);
+	/* 
+	 * @comment 逻辑块 [lbn, lbn + n) 的页缓存数据是否可能还不在盘上
+	 */
+	bool DataBusy(int lbn, int n);
 	
 	/* 
 	 * @comment 对特殊字符设备、块设备文件，调用该设备注册在块设备开关表
@@ -170,6 +235,7 @@ public:
 	/* 
 	 * @comment 更新/写回外存Inode的最后的访问时间、修改时间
 	 * 检查 IUPD 或 IACC 是否置位, 置为才更新并且写回
+	 * 新指向的数据或索引表还不能写出 (IPIN) 时不写, 返回 1
 	 */
 	int IUpdate(int time);
 	/* 
@@ -228,12 +294,37 @@ public:
 	s32		i_addr[10];		/* 用于文件逻辑块好和物理块好转换的基本索引表 */
 	
 	s32		i_lastr;		/* 存放最近一次读取文件的逻辑块号，用于判断是否需要预读 */
+	s32		i_ra_window;		/* 当前预读窗口大小 (块数) */
+	s32		i_ra_next;		/* 已发起预读的范围之后的第一个逻辑块号 */
+	u32		i_ra_hits;		/* 预读命中次数 */
+	u32		i_ra_misses;		/* 预读落空次数 (预读过的块被换出) */
+
+	/* 逻辑块号 -> 物理块号映射缓存: 若干段物理连续的映射, 省去查间接索引表 */
+	s32		i_ext_lbn[SECONDFS_EXTENT_CACHE_SIZE];	/* 每段的起始逻辑块号 */
+	s32		i_ext_pbn[SECONDFS_EXTENT_CACHE_SIZE];	/* 每段的起始物理块号 */
+	s32		i_ext_len[SECONDFS_EXTENT_CACHE_SIZE];	/* 每段的块数, 0 表示空槽 */
+	s32		i_ext_next;		/* 下一个被替换的槽 */
+	u32		i_ext_hits;		/* 映射缓存命中次数 */
 
 	s32		i_atime;		/* 最后访问时间 */
 	s32		i_mtime;		/* 最后修改时间 */
 
 	struct {u8 data[SECONDFS_INODE_SIZE];} __attribute__((packed))	vfs_inode;	/* 包含的 VFS Inode 数据结构. */
 	struct {u8 data[SECONDFS_MUTEX_SIZE];} __attribute__((packed))	i_lock;		/* 包含互斥锁 */
+
+	/* @Feng Shun: 预分配: 上次分到而未用的连续盘块 [i_pa_start, i_pa_start + i_pa_len),
+	 * 由 i_lock 保护. 它们在空闲盘块位图中已是占用的, 文件关闭或换出时归还.
+	 * Blocks allocated ahead but unused, guarded by i_lock; already taken
+	 * in the free block bitmap, given back on close or eviction. */
+	s32		i_pa_start;		/* 预分配的第一块 */
+	s32		i_pa_len;		/* 预分配的块数 */
+	s32		i_lastpbn;		/* 最近分给本文件的盘块, 没有目标时从它之后分配 */
+	/* (atomic_t) 正在分配盘块并弄脏页的调用数 (write_begin 到 write_end 等, 见 fileops.c).
+	 * 这期间新块已登记而页还不是脏的, Unpin() 看不出来, 所以不放开.
+	 * Calls between mapping new blocks and dirtying their pages
+	 * (write_begin to write_end and the like, see fileops.c); Unpin()
+	 * cannot see such pages and leaves everything pinned meanwhile. */
+	s32		i_nwriting;
 };
 
 
@@ -46,6 +46,20 @@ SECONDFS_QUICK_WRAP_CONSTRUCTOR_DESTRUCTOR_DECLARATION(DirectoryEntry)
 // Inode 类的 C 包装
 // 注: i_flag 的 ILOCK, i_count 等锁机制和引用计数机制
 // 在本工程中不用, 交由系统管理
+// Inode::Bmap() 的 alloc 参数. How Bmap() treats holes:
+// 只查不分配, 空洞返回 0. Look up only; holes give 0
+#define SECONDFS_BMAP_LOOKUP 0
+// 分配, 新数据块的缓存留在缓存池中延迟写. Allocate; the new block stays in the Buf pool
+#define SECONDFS_BMAP_ALLOC 1
+// 分配, 数据由页缓存读写, 新数据块不留在缓存池中. Allocate for the page cache; drop the Buf
+#define SECONDFS_BMAP_ALLOC_PAGECACHE 2
+// 同 ALLOC_PAGECACHE, 新数据块已经预留 (延迟分配的回写). Like ALLOC_PAGECACHE, for blocks already reserved (delalloc writeback)
+#define SECONDFS_BMAP_ALLOC_RESERVED 3
+
+// 每个 Inode 缓存的逻辑块号 -> 物理块号映射段数
+// Number of lbn -> pbn runs cached per Inode
+#define SECONDFS_EXTENT_CACHE_SIZE 8
+
 #ifndef __cplusplus
 // 此处由于和 SuperBlock 双向依赖, 添加一个类型声明
 struct _SuperBlock;
@@ -67,12 +81,28 @@ typedef struct _Inode
 	s32		i_addr[10];		/* 用于文件逻辑块好和物理块好转换的基本索引表 */
 	
 	s32		i_lastr;		/* 存放最近一次读取文件的逻辑块号，用于判断是否需要预读 */
+	s32		i_ra_window;		/* 当前预读窗口大小 (块数) */
+	s32		i_ra_next;		/* 已发起预读的范围之后的第一个逻辑块号 */
+	u32		i_ra_hits;		/* 预读命中次数 */
+	u32		i_ra_misses;		/* 预读落空次数 (预读过的块被换出) */
+
+	/* 逻辑块号 -> 物理块号映射缓存: 若干段物理连续的映射, 省去查间接索引表 */
+	s32		i_ext_lbn[SECONDFS_EXTENT_CACHE_SIZE];	/* 每段的起始逻辑块号 */
+	s32		i_ext_pbn[SECONDFS_EXTENT_CACHE_SIZE];	/* 每段的起始物理块号 */
+	s32		i_ext_len[SECONDFS_EXTENT_CACHE_SIZE];	/* 每段的块数, 0 表示空槽 */
+	s32		i_ext_next;		/* 下一个被替换的槽 */
+	u32		i_ext_hits;		/* 映射缓存命中次数 */
 
 	s32		i_atime;		/* 最后访问时间 */
 	s32		i_mtime;		/* 最后修改时间 */
 
 	struct inode	vfs_inode;	/* 包含的 VFS Inode 数据结构. */
 	struct mutex	i_lock;		/* 互斥锁 */
+
+	s32		i_pa_start;		/* 预分配的第一块 */
+	s32		i_pa_len;		/* 预分配的块数 */
+	s32		i_lastpbn;		/* 最近分给本文件的盘块 */
+	atomic_t	i_nwriting;		/* 正在分配盘块并弄脏页的调用数 */
 } Inode;
 #else // __cplusplus
 class Inode;
@@ -84,7 +114,8 @@ extern const u32
 	SECONDFS_IACC,		/* 内存inode被访问过，需要修改最近一次访问时间 */
 	SECONDFS_IMOUNT,	/* 内存inode用于挂载子文件系统 */
 	SECONDFS_IWANT,		/* 有进程正在等待该内存inode被解锁，清ILOCK标志时，要唤醒这种进程 */
-	SECONDFS_ITEXT		/* 内存inode对应进程图像的正文段 */
+	SECONDFS_ITEXT,		/* 内存inode对应进程图像的正文段 */
+	SECONDFS_IPIN		/* i_addr[] 或钉住的索引表可能指向还没写到盘上的页缓存数据 */
 ;
 
 /* static const member of INode:: */
@@ -130,8 +161,12 @@ void Inode_ReadI(Inode *i, IOParameter *io_paramp);
 void Inode_WriteI(Inode *i, IOParameter *io_paramp);
 int Inode_IUpdate(Inode *i, int time);
 void Inode_ICopy(Inode *i, Buf *bp, int inumber);
-int Inode_Bmap(Inode *i, int lbn);
+int Inode_Bmap(Inode *i, int lbn, int alloc);
+int Inode_BmapWant(Inode *i, int lbn, int alloc, int want, int *nr);
+int Inode_ContiguousRun(Inode *i, int lbn, int bn, int maxn);
 int Inode_ITrunc(Inode *i);
+void Inode_DiscardPrealloc(Inode *i);
+int Inode_Unpin(Inode *i, int force);
 
 
 // DiskInode 类的 C 包装
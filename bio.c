@@ -1,107 +1,262 @@
 #include <linux/fs.h>
 #include <linux/blkdev.h>
+#include <linux/buffer_head.h>
 #include <linux/mm.h>
 #include <linux/types.h>
 
 #include "secondfs.h"
 
+/*
+ * secondfs_end_bufs : 对 av_forw 串起的每个 Buf 调用 BufferManager::IODone().
+ * 	Call BufferManager::IODone() on each Buf of an av_forw chain.
+ *
+ * 	IODone() 可能释放 Buf 从而改写 av_forw, 所以先取出下一个.
+ * 	IODone() may release the Buf and reuse av_forw, so fetch the next first.
+ */
+static void secondfs_end_bufs(Buf *bp, int err)
+{
+	Buf *next;
+
+	for (; bp != NULL; bp = next) {
+		next = bp->av_forw;
+		if (err) {
+			secondfs_err("end_bio(): Buf[%d/%p/%d] I/O error %d", bp->b_index, bp->b_dev, bp->b_blkno, err);
+			bp->b_error = err;
+			bp->b_flags |= SECONDFS_B_ERROR;
+		}
+		BufferManager_IODone(bp->b_dev->d_bufmgr, bp);
+	}
+}
+
+/*
+ * secondfs_end_bio : 异步 bio 请求的完成回调.
+ * 	Completion callback of an asynchronous bio.
+ *
+ * 	在中断上下文中执行. 记下错误号, 然后把 bio 覆盖的每个 Buf 交给
+ * 	BufferManager::IODone() 善后 (唤醒等待者, 或对异步 I/O 直接释放缓存).
+ * 	Runs in interrupt context. Records the error, then hands every Buf
+ * 	covered by the bio to BufferManager::IODone() (wakes the waiter up,
+ * 	or releases the Buf if the I/O is asynchronous).
+ */
+static void secondfs_end_bio(struct bio *bio)
+{
+	Buf *bp = bio->bi_private;
+	int err;
+
+#ifdef SECONDFS_KERNEL_BEFORE_4_13
+	err = bio->bi_error;
+#else
+	err = blk_status_to_errno(bio->bi_status);
+#endif
+	bio_put(bio);
+
+	secondfs_end_bufs(bp, err);
+}
+
 /*
  * secondfs_submit_bio : 跳过系统为块设备准备的缓存, 直接操作块设备
- * 	Directly access block device (read/write) for 1 block(512 bytes)(Do bio).
+ * 	Directly access block device (read/write) for a run of blocks (Do bio).
  * 
- * 	The main procedure is to submit a bio request to generic
- * 	block layer and wait it to complete.
- * 	其核心为向通用块层直接提交一个 bio request, 并等待其结束.
+ * 	The main procedure is to submit bio requests to generic
+ * 	block layer. It does not wait: secondfs_end_bio() is called
+ * 	when each request completes.
+ * 	其核心为向通用块层直接提交 bio request. 不等待其结束:
+ * 	每个请求完成时会调用 secondfs_end_bio().
  * 
- * 	sb : 当前文件系统的 VFS 超块指针. VFS super_block
- * 	sector : 扇区号. 一个扇区是, 且对齐到 512 字节. sector number
- * 	buf : 结果送出/入的缓冲区. The buffer to read from/write to. <= 512 bytes.
+ * 	first : 用 av_forw 串起, 以 NULL 结尾的一串缓存. 它们必须属于同一设备,
+ * 		且 b_blkno 依次相邻. 尽量只用一个 bio, 每个 Buf 占一个 bvec;
+ * 		一个 bio 装不下时拆成多个.
+ * 		A NULL-terminated av_forw chain of Bufs of one device with
+ * 		consecutive b_blkno. They go into as few bios as possible,
+ * 		one bvec per Buf.
  * 	op : bio 内要执行的操作. the operation(read/write)
  * 	op_flags : 操作所需附加的标志位. the flags(0/sync)
  * 	rw : substitution for op/op_flags before kernel 4.8.
+ *
+ * 	不返回错误: 提交失败的 Buf 也会带着 B_ERROR 交给 IODone().
+ * 	No error is returned: Bufs that could not be submitted are
+ * 	handed to IODone() with B_ERROR set.
  */
 #ifdef SECONDFS_KERNEL_BEFORE_4_8
-static int secondfs_submit_bio(struct block_device *bdev, sector_t sector,
-			void *buf, int rw)
+static void secondfs_submit_bio(Buf *first, int rw)
 
 #else
-static int secondfs_submit_bio(struct block_device *bdev, sector_t sector,
-			void *buf, int op, int op_flags)
+static void secondfs_submit_bio(Buf *first, int op, int op_flags)
 #endif
 {
 	struct bio *bio;
-	u64 io_size;
-	int ret;
+	struct block_device *bdev = first->b_dev->d_bdev;
+	Buf *bp, *prev;
+	int nr;
 
-	// We allow 2 requests at maximum: 2 4096B pages can hold a 512B sector
-	bio = bio_alloc(GFP_NOIO, 2);
-	bio->bi_iter.bi_sector = sector;
+	while (first != NULL) {
+		for (nr = 0, bp = first; bp != NULL && nr < BIO_MAX_PAGES; bp = bp->av_forw)
+			nr++;
+
+		bio = bio_alloc(GFP_NOIO, nr);
+		bio->bi_iter.bi_sector = first->b_blkno;
 #ifdef SECONDFS_KERNEL_BEFORE_4_14
-	bio->bi_bdev = bdev;
+		bio->bi_bdev = bdev;
 #else
-	bio_set_dev(bio, bdev);
+		bio_set_dev(bio, bdev);
 #endif
 
 #ifdef SECONDFS_KERNEL_BEFORE_4_8
-	bio->bi_rw = rw;
+		bio->bi_rw = rw;
 #else
-	bio->bi_opf = op | op_flags;
+		bio->bi_opf = op | op_flags;
 #endif
+		bio->bi_end_io = secondfs_end_bio;
+		bio->bi_private = first;
 
-	// Bytes to read/write.
-	// bio 的目标区域, 必须以块大小为单位.
-	io_size = SECONDFS_BLOCK_SIZE;
-	
-	// buf may cross 2 pages; in one loop, one page is processed
-	// 多次调用 bio_add_page, 分次按页对齐完善 bio 请求
-	while (io_size > 0) {
-		// Get the page frame (physical) of buf and its offset in the frame
-		// 首先计算目标区域 buf 的页框号, 在它所在页框的偏移, 不能超过页尾的本次最大读字节数
-		unsigned int page_offset = offset_in_page(buf);
-		unsigned int len = min_t(unsigned int, PAGE_SIZE - page_offset, io_size);
-
-		secondfs_dbg(BUFFER, "submit_bio(): add <sector=%lu,page=%p,len=%u,pageoffset=%u> to bio_add_page", sector, virt_to_page(buf), len, page_offset);
+		// Buffers come from a kmem_cache aligned to their size, so
+		// each of them lies in one page and takes exactly one bvec.
+		// In group mode the siblings of a group are adjacent in one page,
+		// and bio_add_page() merges them into a single bvec.
+		// 缓冲区从按自身大小对齐的 kmem_cache 中分配, 不会跨页, 各占一个 bvec.
+		// 按组模式下同组的缓存在同一页中相邻, bio_add_page() 会把它们合并成一个 bvec.
+		for (prev = NULL, bp = first; bp != NULL; prev = bp, bp = bp->av_forw) {
+			unsigned int page_offset = offset_in_page(bp->b_addr);
 
-		ret = bio_add_page(bio, virt_to_page(buf), len, page_offset);
+			secondfs_dbg(BUFFER, "submit_bio(): add <sector=%d,page=%p,pageoffset=%u> to bio_add_page", bp->b_blkno, virt_to_page(bp->b_addr), page_offset);
 
-		secondfs_dbg(BUFFER, "submit_bio(): bio_add_page: ret=%d", ret);
+			if (page_offset + SECONDFS_BLOCK_SIZE > PAGE_SIZE
+				|| bio_add_page(bio, virt_to_page(bp->b_addr), SECONDFS_BLOCK_SIZE, page_offset) != SECONDFS_BLOCK_SIZE)
+				break;
+		}
 
-		if (ret != len) {
-			secondfs_err("submit_bio(): ret != len; error! return -EIO");
-			ret = -EIO;
-			goto out_eio;
+		if (prev == NULL) {
+			// Not even the first Buf fits; fail the rest
+			// 连第一个 Buf 都加不进去, 其余的全部以错误结束
+			secondfs_err("submit_bio(): cannot add Buf[%d/%p/%d] to bio; -EIO", first->b_index, first->b_dev, first->b_blkno);
+			bio_put(bio);
+			secondfs_end_bufs(first, -EIO);
+			return;
 		}
-		io_size -= len;
-		buf = (u8 *)buf + len;
+
+		// The bio is full (or hit a queue limit); the rest go to the next one
+		// bio 已满 (或达到设备队列限制), 剩下的放到下一个 bio
+		prev->av_forw = NULL;
+
+		// Submit it; secondfs_end_bio() will be called on completion.
+		// The Bufs in it must not be touched from now on.
+		// 提交这个 bio 请求, 完成时会调用 secondfs_end_bio(). 此后不能再碰其中的 Buf.
+#ifdef SECONDFS_KERNEL_BEFORE_4_8
+		submit_bio(rw, bio);
+#else
+		submit_bio(bio);
+#endif
+		first = bp;
 	}
+}
+
+void secondfs_submit_bio_range_read(Buf *first) {
+#ifdef SECONDFS_KERNEL_BEFORE_4_8
+	secondfs_submit_bio(first, READ);
+#else
+	secondfs_submit_bio(first, REQ_OP_READ, 0);
+#endif
+}
 
-	// Wait it to complete
-	// 提交这个同步 bio 请求, 等待执行完毕
+void secondfs_submit_bio_range_write(Buf *first, int sync) {
 #ifdef SECONDFS_KERNEL_BEFORE_4_8
-	ret = submit_bio_wait(rw, bio);
+	secondfs_submit_bio(first, sync ? WRITE_SYNC : WRITE);
 #else
-	ret = submit_bio_wait(bio);
+	secondfs_submit_bio(first, REQ_OP_WRITE, sync ? REQ_SYNC : 0);
 #endif
+}
 
-out_eio:
-	bio_put(bio);
-	return ret < 0 ? ret : 0;
+/*
+ * secondfs_end_bh : buffer_head 后端下 submit_bh() 的完成回调.
+ * 	Completion callback of submit_bh() with the buffer_head backend.
+ *
+ * 	与 secondfs_end_bio() 相同, 在中断上下文中执行. 读成功时 buffer_head
+ * 	才算有效内容; 然后放开 I/O 期间持有的 buffer_head 锁, 交给 IODone().
+ * 	Runs in interrupt context like secondfs_end_bio(). A successful read
+ * 	makes the buffer_head up to date; then the lock held during the I/O
+ * 	is dropped and the Buf goes to IODone().
+ */
+static void secondfs_end_bh(struct buffer_head *bh, int uptodate)
+{
+	Buf *bp = bh->b_private;
+
+	if (uptodate)
+		set_buffer_uptodate(bh);
+	else if (bp->b_flags & SECONDFS_B_READ)
+		clear_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	put_bh(bh);
+
+	bp->av_forw = NULL;
+	secondfs_end_bufs(bp, uptodate ? 0 : -EIO);
+}
+
+/*
+ * secondfs_submit_bh : 经块设备页缓存中的 buffer_head 读写一串缓存.
+ * 	Read or write a run of Bufs through their buffer_heads in the block
+ * 	device's page cache (the buffer_head backend).
+ *
+ * 	每个 Buf 的 b_bh 已由 BufferManager::AttachBh() 取得. 每块一个
+ * 	submit_bh(), 在一个 plug 内提交, 由块设备层把相邻的合并. I/O 期间
+ * 	持有 buffer_head 的锁, 与内核对同一页的读写互斥. 不等待, 完成时
+ * 	secondfs_end_bh() 调用 IODone().
+ * 	b_bh was set up by BufferManager::AttachBh(). One submit_bh() per
+ * 	block, inside a plug so the block layer merges neighbours. The
+ * 	buffer_head is locked during the I/O, which keeps the kernel's own
+ * 	reads and writes of the page out. Does not wait; secondfs_end_bh()
+ * 	calls IODone() on completion.
+ */
+#ifdef SECONDFS_KERNEL_BEFORE_4_8
+static void secondfs_submit_bh(Buf *first, int rw)
+#else
+static void secondfs_submit_bh(Buf *first, int op, int op_flags)
+#endif
+{
+	struct blk_plug plug;
+	struct buffer_head *bh;
+	Buf *bp, *next;
+
+	blk_start_plug(&plug);
+	for (bp = first; bp != NULL; bp = next) {
+		// 提交后 bp 可能已完成并被释放, 先取出下一个
+		// bp may be completed and released once submitted; fetch the next first
+		next = bp->av_forw;
+		bh = bp->b_bh;
+
+		lock_buffer(bh);
+		if (!(bp->b_flags & SECONDFS_B_READ)) {
+			// 写出去的就是有效内容. 脏标志从不由我们置上, 以防万一仍清掉
+			// What is written is valid content. We never set the dirty bit,
+			// but clear it anyway
+			set_buffer_uptodate(bh);
+			clear_buffer_dirty(bh);
+		}
+		get_bh(bh);
+		bh->b_private = bp;
+		bh->b_end_io = secondfs_end_bh;
+
+		secondfs_dbg(BUFFER, "submit_bh(): <sector=%d,bh=%p>", bp->b_blkno, bh);
+#ifdef SECONDFS_KERNEL_BEFORE_4_8
+		submit_bh(rw, bh);
+#else
+		submit_bh(op, op_flags, bh);
+#endif
+	}
+	blk_finish_plug(&plug);
 }
 
-int secondfs_submit_bio_sync_read(void * /* struct block_device * */ bdev, u32 sector,
-			void *buf) {
+void secondfs_submit_bh_range_read(Buf *first) {
 #ifdef SECONDFS_KERNEL_BEFORE_4_8
-	return secondfs_submit_bio(bdev, sector, buf, READ);
+	secondfs_submit_bh(first, READ);
 #else
-	return secondfs_submit_bio(bdev, sector, buf, REQ_OP_READ, 0);
+	secondfs_submit_bh(first, REQ_OP_READ, 0);
 #endif
 }
 
-int secondfs_submit_bio_sync_write(void * /* struct block_device * */ bdev, u32 sector,
-			void *buf) {
+void secondfs_submit_bh_range_write(Buf *first, int sync) {
 #ifdef SECONDFS_KERNEL_BEFORE_4_8
-	return secondfs_submit_bio(bdev, sector, buf, WRITE_SYNC);
+	secondfs_submit_bh(first, sync ? WRITE_SYNC : WRITE);
 #else
-	return secondfs_submit_bio(bdev, sector, buf, REQ_OP_WRITE, REQ_SYNC);
+	secondfs_submit_bh(first, REQ_OP_WRITE, sync ? REQ_SYNC : 0);
 #endif
-}
\ No newline at end of file
+}
@@ -13,6 +13,12 @@
 #include <linux/timex.h>
 #include <linux/cpufreq.h>
 #include <linux/slub_def.h>
+#include <linux/vmalloc.h>
+#include <linux/sort.h>
+#include <linux/jiffies.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/rcupdate.h>
 
 #include <stdarg.h>
 
@@ -68,6 +74,26 @@ void secondfs_c_helper_free(void *pointer)
 	kfree(pointer);
 }
 
+void *secondfs_c_helper_vzalloc(size_t size)
+{
+	// For big arrays (such as Bufs of BufferManager) that
+	// kmalloc may fail to allocate
+	// 用于 kmalloc 可能分配不了的大数组 (如 BufferManager 的 Buf 数组)
+	void *p;
+
+	p = vzalloc(size);
+	secondfs_dbg(MEMORY, "start vzallocing, size=%lu pointer=%p", size, p);
+	if (p == NULL)
+		secondfs_err("unable to allocate memory");
+	return p;
+}
+
+void secondfs_c_helper_vfree(void *pointer)
+{
+	secondfs_dbg(MEMORY, "start vfreeing, pointer=%p", pointer);
+	vfree(pointer);
+}
+
 void secondfs_c_helper_mdebug(void)
 {
 #ifdef SECONDFS_DEBUG_ON_MEMORY
@@ -139,6 +165,106 @@ void secondfs_c_helper_kmem_cache_mdebug(void)
 
 SECONDFS_GEN_C_HELPER_KMEM_CACHE_ALLOC_N_FREE(DiskInode, secondfs_diskinode_cachep)
 SECONDFS_GEN_C_HELPER_KMEM_CACHE_ALLOC_N_FREE(Inode, secondfs_icachep)
+SECONDFS_GEN_C_HELPER_KMEM_CACHE_ALLOC_N_FREE(Buffer, secondfs_buffer_cachep)
+SECONDFS_GEN_C_HELPER_KMEM_CACHE_ALLOC_N_FREE(Group, secondfs_group_cachep)
+
+// GetBlk() 按需补充缓存池时使用: 不能递归进入文件系统, 分配失败也不要告警,
+// 调用者会退回到置换已有的缓存.
+// Used by GetBlk() to grow the pool on demand: must not recurse into the
+// filesystem, and failure is quiet since the caller falls back to
+// replacing a cached buffer.
+void *secondfs_c_helper_alloc_buffer_nofs(void)
+{
+#ifdef SECONDFS_DEBUG_ON_MEMORY
+	kmem_cache_malloc_num++;
+#endif // SECONDFS_DEBUG_ON_MEMORY
+	return kmem_cache_alloc(secondfs_buffer_cachep, GFP_NOFS | __GFP_NOWARN);
+}
+
+// 同上, 成组模式下一组的缓冲区 Same, for a group's buffer in group mode
+void *secondfs_c_helper_alloc_group_nofs(void)
+{
+#ifdef SECONDFS_DEBUG_ON_MEMORY
+	kmem_cache_malloc_num++;
+#endif // SECONDFS_DEBUG_ON_MEMORY
+	return kmem_cache_alloc(secondfs_group_cachep, GFP_NOFS | __GFP_NOWARN);
+}
+
+// buffer_head 后端: 块设备页缓存中 blkno 的 buffer_head, 带一个引用.
+// 块大小已由 sb_set_blocksize() 设为 SECONDFS_BUFFER_SIZE, 不会返回 NULL;
+// 页缓存的分配不进入文件系统 (块设备的 mapping 不带 __GFP_FS), 可能睡眠.
+// The buffer_head backend: blkno's buffer_head in the block device's page
+// cache, referenced. Never NULL once sb_set_blocksize() has succeeded;
+// may sleep, but the block device's mapping never allocates with __GFP_FS.
+void *secondfs_c_helper_getblk(void *bdev, int blkno)
+{
+	return __getblk((struct block_device *)bdev, blkno, SECONDFS_BUFFER_SIZE);
+}
+
+u8 *secondfs_c_helper_bh_data(void *bh)
+{
+	return (u8 *)((struct buffer_head *)bh)->b_data;
+}
+
+int secondfs_c_helper_buffer_uptodate(void *bh)
+{
+	return buffer_uptodate((struct buffer_head *)bh);
+}
+
+void secondfs_c_helper_clear_buffer_uptodate(void *bh)
+{
+	clear_buffer_uptodate((struct buffer_head *)bh);
+}
+
+// 只减引用计数, 不睡眠, 可在自旋锁内调用
+// Only drops the reference; never sleeps, fine under a spinlock
+void secondfs_c_helper_brelse(void *bh)
+{
+	brelse((struct buffer_head *)bh);
+}
+
+// 同步把盘块 [blkno, blkno + nr) 写成零 (盘块就是扇区)
+// Zero [blkno, blkno + nr) on disk and wait (a block is a sector)
+int secondfs_c_helper_zeroout(void *bdev, int blkno, int nr)
+{
+	return blkdev_issue_zeroout((struct block_device *)bdev, blkno, nr, GFP_NOFS, 0);
+}
+
+// 文件逻辑块 [lbn, lbn + nr) 所在的页中有脏的或正在回写的就返回 1
+// 1 if a page holding file blocks [lbn, lbn + nr) is dirty or under writeback
+int secondfs_c_helper_range_busy(void *inode, int lbn, int nr)
+{
+	struct inode *vi = (struct inode *)inode;
+	struct address_space *mapping = vi->i_mapping;
+	pgoff_t first = ((loff_t)lbn << vi->i_blkbits) >> PAGE_SHIFT;
+	pgoff_t end = ((((loff_t)lbn + nr) << vi->i_blkbits) - 1) >> PAGE_SHIFT;
+	int tags[2] = { PAGECACHE_TAG_DIRTY, PAGECACHE_TAG_WRITEBACK };
+	struct pagevec pvec;
+	pgoff_t index;
+	unsigned nr_pages;
+	int busy = 0;
+	int k;
+
+	for (k = 0; k < 2 && !busy; k++) {
+		if (!mapping_tagged(mapping, tags[k]))
+			continue;
+		index = first;
+#ifdef SECONDFS_KERNEL_BEFORE_4_15
+		pagevec_init(&pvec, 0);
+#else
+		pagevec_init(&pvec);
+#endif
+#ifdef SECONDFS_KERNEL_BEFORE_4_14
+		nr_pages = pagevec_lookup_tag(&pvec, mapping, &index, tags[k], 1);
+		busy = nr_pages > 0 && pvec.pages[0]->index <= end;
+#else
+		nr_pages = pagevec_lookup_range_tag(&pvec, mapping, &index, end, tags[k]);
+		busy = nr_pages > 0;
+#endif
+		pagevec_release(&pvec);
+	}
+	return busy;
+}
 
 // 以下为 C 为 C++ 提供的 Linux 内核服务
 
@@ -147,6 +273,11 @@ unsigned long secondfs_c_helper_ktime_get_real_seconds()
 	return ktime_get_real_seconds();
 }
 
+u64 secondfs_c_helper_ktime_get_ns()
+{
+	return ktime_get_ns();
+}
+
 void secondfs_c_helper_spin_lock_init(void *lockp)
 {
 	spin_lock_init((spinlock_t *)lockp);
@@ -169,6 +300,32 @@ int secondfs_c_helper_spin_is_locked(void *lockp)
 	return spin_is_locked((spinlock_t *)lockp);
 }
 
+// 下面两组用于可能在 bio 完成回调 (中断上下文) 中获取的锁.
+// For locks that are also taken in bio completion (interrupt context).
+void secondfs_c_helper_spin_lock_irq(void *lockp)
+{
+	secondfs_dbg(LOCK, "spin lock irq: %p", lockp);
+	spin_lock_irq((spinlock_t *)lockp);
+}
+
+void secondfs_c_helper_spin_unlock_irq(void *lockp)
+{
+	secondfs_dbg(LOCK, "spin unlock irq: %p", lockp);
+	spin_unlock_irq((spinlock_t *)lockp);
+}
+
+unsigned long secondfs_c_helper_spin_lock_irqsave(void *lockp)
+{
+	unsigned long flags;
+	spin_lock_irqsave((spinlock_t *)lockp, flags);
+	return flags;
+}
+
+void secondfs_c_helper_spin_unlock_irqrestore(void *lockp, unsigned long flags)
+{
+	spin_unlock_irqrestore((spinlock_t *)lockp, flags);
+}
+
 void secondfs_c_helper_sema_init(void *semap, int val)
 {
 	sema_init((struct semaphore *)semap, val);
@@ -220,6 +377,173 @@ int secondfs_c_helper_mutex_trylock(void *mutexp)
 	return mutex_trylock((struct mutex *)mutexp);
 }
 
+void secondfs_c_helper_init_waitqueue_head(void *wqp)
+{
+	init_waitqueue_head((wait_queue_head_t *)wqp);
+}
+
+void secondfs_c_helper_wake_up(void *wqp)
+{
+	wake_up((wait_queue_head_t *)wqp);
+}
+
+// 睡眠直到 *wordp 中 mask 的某一位被置上 (如等待 Buf 的 B_DONE)
+// Sleep until any bit of mask is set in *wordp (e.g. B_DONE of a Buf)
+void secondfs_c_helper_wait_event_mask(void *wqp, volatile u32 *wordp, u32 mask)
+{
+	wait_event(*(wait_queue_head_t *)wqp, (READ_ONCE(*wordp) & mask) != 0);
+}
+
+// 睡眠直到计数器 *atomicp 归零
+// Sleep until the counter *atomicp drops to zero
+void secondfs_c_helper_wait_event_zero(void *wqp, void *atomicp)
+{
+	wait_event(*(wait_queue_head_t *)wqp, atomic_read((atomic_t *)atomicp) == 0);
+}
+
+// 在等待队列的锁内把计数器减 1, 归零时唤醒等待者. 等待者见到 0 并拿到
+// 这把锁之后 (见下), 减计数的一方不会再碰等待队列, 后者可以随即释放.
+// Decrement the counter under the queue lock and wake the waiters when it
+// hits zero. Once a waiter has seen zero and taken that lock (see below),
+// the decrementer no longer touches the queue, which may then be freed.
+void secondfs_c_helper_atomic_dec_and_wake(void *atomicp, void *wqp)
+{
+	wait_queue_head_t *wq = wqp;
+	unsigned long flags;
+
+	spin_lock_irqsave(&wq->lock, flags);
+	if (atomic_dec_and_test((atomic_t *)atomicp))
+		wake_up_locked(wq);
+	spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+// 睡眠直到计数器归零, 且最后一个 atomic_dec_and_wake() 已经退出
+// Sleep until the counter is zero and the last atomic_dec_and_wake() is done
+void secondfs_c_helper_wait_event_zero_final(void *wqp, void *atomicp)
+{
+	wait_queue_head_t *wq = wqp;
+
+	wait_event(*wq, atomic_read((atomic_t *)atomicp) == 0);
+	spin_lock_irq(&wq->lock);
+	spin_unlock_irq(&wq->lock);
+}
+
+void secondfs_c_helper_atomic_set(void *atomicp, int val)
+{
+	atomic_set((atomic_t *)atomicp, val);
+}
+
+int secondfs_c_helper_atomic_read(void *atomicp)
+{
+	return atomic_read((atomic_t *)atomicp);
+}
+
+void secondfs_c_helper_atomic_inc(void *atomicp)
+{
+	atomic_inc((atomic_t *)atomicp);
+}
+
+int secondfs_c_helper_atomic_dec_and_test(void *atomicp)
+{
+	return atomic_dec_and_test((atomic_t *)atomicp);
+}
+
+void secondfs_c_helper_atomic_dec(void *atomicp)
+{
+	atomic_dec((atomic_t *)atomicp);
+}
+
+void secondfs_c_helper_atomic_add(void *atomicp, int val)
+{
+	atomic_add(val, (atomic_t *)atomicp);
+}
+
+// 计数器非 0 时加 1 并返回真; 成功时是一个完整的内存屏障
+// Increment unless zero; a full barrier when it succeeds
+int secondfs_c_helper_atomic_inc_not_zero(void *atomicp)
+{
+	return atomic_inc_not_zero((atomic_t *)atomicp);
+}
+
+// 之前的写操作都先于这次赋值对其他 CPU 可见
+// All earlier stores are visible before the new value is
+void secondfs_c_helper_atomic_set_release(void *atomicp, int val)
+{
+	atomic_set_release((atomic_t *)atomicp, val);
+}
+
+// 只在有人等待时才唤醒, 没人等时不碰等待队列的锁
+// Wake up only if someone sleeps; the queue lock is left alone otherwise
+void secondfs_c_helper_wake_up_sleepers(void *wqp)
+{
+	if (wq_has_sleeper((wait_queue_head_t *)wqp))
+		wake_up((wait_queue_head_t *)wqp);
+}
+
+// 等待加入一个共享组 (*countp 非 0 且没有人等待独占) 或是独占 semap.
+// 加入共享组返回 1, 拿到 semap 返回 0
+// Sleep until we either join the shared holders (*countp non-zero and
+// nobody waiting in *wantp) or take semap. Returns 1 if joined, 0 if
+// semap was taken
+int secondfs_c_helper_wait_event_join(void *wqp, void *countp, void *wantp, void *semap)
+{
+	int joined = 0;
+
+	wait_event(*(wait_queue_head_t *)wqp,
+		(atomic_read((atomic_t *)wantp) == 0 && (joined = atomic_inc_not_zero((atomic_t *)countp)))
+		|| down_trylock((struct semaphore *)semap) == 0);
+	return joined;
+}
+
+void secondfs_c_helper_rcu_read_lock(void)
+{
+	rcu_read_lock();
+}
+
+void secondfs_c_helper_rcu_read_unlock(void)
+{
+	rcu_read_unlock();
+}
+
+// 读取 RCU 保护的指针 *pp
+// Load the RCU-protected pointer *pp
+void *secondfs_c_helper_rcu_dereference(void *pp)
+{
+	return rcu_dereference(*(void __rcu **)pp);
+}
+
+// 发布指针: 指向的对象在此之前的初始化对 RCU 读者都可见
+// Publish v in *pp; whatever v points to is initialized for RCU readers
+void secondfs_c_helper_rcu_assign_pointer(void *pp, void *v)
+{
+	rcu_assign_pointer(*(void __rcu **)pp, v);
+}
+
+unsigned long secondfs_c_helper_jiffies()
+{
+	return jiffies;
+}
+
+// 内核的堆排序 (lib/sort.c), 不分配内存, 可在持有自旋锁时调用
+// The kernel heapsort; allocates nothing
+void secondfs_c_helper_sort(void *base, size_t num, size_t size, int (*cmp)(const void *, const void *))
+{
+	sort(base, num, size, cmp, NULL);
+}
+
+// 在一个 plug 内提交的 bio 先攒在本进程中, finish 时一起交给块设备层排序合并
+// Bios submitted between start and finish are held back and handed to
+// the block layer together, so it can sort and merge them
+void secondfs_c_helper_blk_start_plug(void *plugp)
+{
+	blk_start_plug((struct blk_plug *)plugp);
+}
+
+void secondfs_c_helper_blk_finish_plug(void *plugp)
+{
+	blk_finish_plug((struct blk_plug *)plugp);
+}
+
 unsigned long secondfs_c_helper_copy_to_user(void __user *to, const void *from, unsigned long n)
 {
 	secondfs_dbg(GENERAL, "copy_to_user(%p,%p,%lu)", to, from, n);
@@ -33,6 +33,9 @@ typedef uint64_t u64;
 #define SECONDFS_SPINLOCK_T_SIZE 4
 #define SECONDFS_MUTEX_SIZE 32
 #define SECONDFS_INODE_SIZE 600
+#define SECONDFS_WAIT_QUEUE_HEAD_SIZE 24
+#define SECONDFS_DELAYED_WORK_SIZE 88
+#define SECONDFS_BLK_PLUG_SIZE 48
 #endif // __IN_VSCODE__
 
 // Some shorthand macros
@@ -80,16 +83,34 @@ extern "C" {
 
 SECONDFS_GEN_C_HELPER_KMEM_CACHE_ALLOC_N_FREE_DECLARATION(DiskInode)
 SECONDFS_GEN_C_HELPER_KMEM_CACHE_ALLOC_N_FREE_DECLARATION(Inode)
+SECONDFS_GEN_C_HELPER_KMEM_CACHE_ALLOC_N_FREE_DECLARATION(Buffer)
+SECONDFS_GEN_C_HELPER_KMEM_CACHE_ALLOC_N_FREE_DECLARATION(Group)
+void *secondfs_c_helper_alloc_buffer_nofs(void);
+void *secondfs_c_helper_alloc_group_nofs(void);
+void *secondfs_c_helper_getblk(void *bdev, int blkno);
+u8 *secondfs_c_helper_bh_data(void *bh);
+int secondfs_c_helper_buffer_uptodate(void *bh);
+void secondfs_c_helper_clear_buffer_uptodate(void *bh);
+void secondfs_c_helper_brelse(void *bh);
+int secondfs_c_helper_zeroout(void *bdev, int blkno, int nr);
+int secondfs_c_helper_range_busy(void *inode, int lbn, int nr);
 
 void *secondfs_c_helper_malloc(size_t size);
 void secondfs_c_helper_free(void *pointer);
 void secondfs_c_helper_mdebug(void);
+void *secondfs_c_helper_vzalloc(size_t size);
+void secondfs_c_helper_vfree(void *pointer);
 
 unsigned long secondfs_c_helper_ktime_get_real_seconds(void);
+u64 secondfs_c_helper_ktime_get_ns(void);
 void secondfs_c_helper_spin_lock_init(void *lockp);
 void secondfs_c_helper_spin_lock(void *lockp);
 void secondfs_c_helper_spin_unlock(void *lockp);
 int secondfs_c_helper_spin_is_locked(void *lockp);
+void secondfs_c_helper_spin_lock_irq(void *lockp);
+void secondfs_c_helper_spin_unlock_irq(void *lockp);
+unsigned long secondfs_c_helper_spin_lock_irqsave(void *lockp);
+void secondfs_c_helper_spin_unlock_irqrestore(void *lockp, unsigned long flags);
 void secondfs_c_helper_sema_init(void *semap, int val);
 void secondfs_c_helper_up(void *semap);
 void secondfs_c_helper_down(void *semap);
@@ -99,6 +120,30 @@ void secondfs_c_helper_mutex_lock(void *mutexp);
 void secondfs_c_helper_mutex_unlock(void *mutexp);
 int secondfs_c_helper_mutex_is_locked(void *mutexp);
 int secondfs_c_helper_mutex_trylock(void *mutexp);
+void secondfs_c_helper_init_waitqueue_head(void *wqp);
+void secondfs_c_helper_wake_up(void *wqp);
+void secondfs_c_helper_wait_event_mask(void *wqp, volatile u32 *wordp, u32 mask);
+void secondfs_c_helper_wait_event_zero(void *wqp, void *atomicp);
+void secondfs_c_helper_atomic_dec_and_wake(void *atomicp, void *wqp);
+void secondfs_c_helper_wait_event_zero_final(void *wqp, void *atomicp);
+void secondfs_c_helper_atomic_set(void *atomicp, int val);
+int secondfs_c_helper_atomic_read(void *atomicp);
+void secondfs_c_helper_atomic_inc(void *atomicp);
+int secondfs_c_helper_atomic_dec_and_test(void *atomicp);
+void secondfs_c_helper_atomic_dec(void *atomicp);
+void secondfs_c_helper_atomic_add(void *atomicp, int val);
+int secondfs_c_helper_atomic_inc_not_zero(void *atomicp);
+void secondfs_c_helper_atomic_set_release(void *atomicp, int val);
+void secondfs_c_helper_wake_up_sleepers(void *wqp);
+int secondfs_c_helper_wait_event_join(void *wqp, void *countp, void *wantp, void *semap);
+void secondfs_c_helper_rcu_read_lock(void);
+void secondfs_c_helper_rcu_read_unlock(void);
+void *secondfs_c_helper_rcu_dereference(void *pp);
+void secondfs_c_helper_rcu_assign_pointer(void *pp, void *v);
+unsigned long secondfs_c_helper_jiffies(void);
+void secondfs_c_helper_sort(void *base, size_t num, size_t size, int (*cmp)(const void *, const void *));
+void secondfs_c_helper_blk_start_plug(void *plugp);
+void secondfs_c_helper_blk_finish_plug(void *plugp);
 unsigned long secondfs_c_helper_copy_to_user(void 
 #ifndef __cplusplus
 __user
@@ -147,6 +192,8 @@ void *secondfs_c_helper_memcpy(void *to, void *from, size_t len);
 #define SFDBG_DELOCATE_V 0x00000400
 #define SFDBG_LOCK 0x00000800
 #define SFDBG_FILE_V 0x00001000
+#define SFDBG_READAHEAD 0x00002000
+#define SFDBG_FLUSH 0x00004000
 
 #define SFDBGTAG_SIZECONSISTENCY "SC"
 #define SFDBGTAG_SB_FILL "SB"
@@ -161,6 +208,8 @@ void *secondfs_c_helper_memcpy(void *to, void *from, size_t len);
 #define SFDBGTAG_DELOCATE_V "DV"
 #define SFDBGTAG_LOCK "LK"
 #define SFDBGTAG_FILE_V "FV"
+#define SFDBGTAG_READAHEAD "RA"
+#define SFDBGTAG_FLUSH "FL"
 
 //#define SFDBG_MASK (0xFFFFFFFF)
 #define SFDBG_MASK (0xFFFFFFFF&~SFDBG_DELOCATE_V&~SFDBG_LOCK&~SFDBG_BUFFERQ&~SFDBG_BUFFER&~SFDBG_MEMORY)
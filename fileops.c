@@ -1,86 +1,566 @@
 #include "secondfs.h"
 #include <linux/fs.h>
 
-ssize_t secondfs_file_read(struct file *filp, char __user *buf, size_t len,
-				loff_t *ppos)
+/* secondfs_file_read_iter : 读普通文件. Read a regular file.
+ *      iocb : 文件及读写位置
+ *      to : 目标, 可以是多段用户缓冲区 (readv/preadv2/io_uring)
+ *
+ * 数据来自页缓存 (见 secondfs_aops), 一次调用处理全部段.
+ * Served from the page cache; all segments in one call.
+ */
+ssize_t secondfs_file_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
-	// We use filp->f_path.dentry->d_inode to get the inode
-	// rather than the cached filp->f_inode
-	// filp->f_inode 是缓存数据, 实时数据在 path 结构里面
-	struct inode *inode = filp->f_path.dentry->d_inode;
-	Inode *si = SECONDFS_INODE(inode);
-	ssize_t ret;
-	u32 pos_u32 = *ppos;
+	secondfs_dbg(FILE, "file_read_iter(%p,%lld,%lu)", iocb->ki_filp, iocb->ki_pos, (unsigned long)iov_iter_count(to));
 
-	secondfs_dbg(FILE, "file_read(%p,%p,%lu): inode_lock()", filp, buf, len);
+	// generic_file_read_iter() updates atime (file_accessed()) itself
+	// 访问时间由 generic_file_read_iter() 内部更新
+	return generic_file_read_iter(iocb, to);
+}
 
-	inode_lock(inode);
-	
-	ret = FileManager_Read(secondfs_filemanagerp, buf, len, &pos_u32, si);
-	*ppos = pos_u32;
+/* secondfs_file_write_iter : 写普通文件. Write a regular file.
+ *      iocb : 文件及读写位置
+ *      from : 数据来源, 可以是多段用户缓冲区 (writev/pwritev2/io_uring)
+ *
+ * 写入页缓存后, 使 Unix V6++ Inode 与 VFS Inode 一致 (大小, 时间).
+ * After writing into the page cache, bring the Inode in step with the
+ * VFS inode (size, times).
+ */
+ssize_t secondfs_file_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	ssize_t ret;
 
-	secondfs_inode_conform_s2v(inode, si);
+	secondfs_dbg(FILE, "file_write_iter(%.32s,%lld,%lu)", iocb->ki_filp->f_path.dentry->d_name.name, iocb->ki_pos, (unsigned long)iov_iter_count(from));
 
-	file_accessed(filp);
-	secondfs_inode_conform_v2s(si, inode);
-	mark_inode_dirty_sync(inode);
+	// Takes inode_lock, updates mtime and handles O_SYNC/O_APPEND
+	// 内部会持有 inode_lock, 更新修改时间, 并处理 O_SYNC/O_APPEND
+	ret = generic_file_write_iter(iocb, from);
 
-	inode_unlock(inode);
+	if (ret > 0) {
+		inode_lock(inode);
+		secondfs_inode_conform_v2s(SECONDFS_INODE(inode), inode);
+		inode_unlock(inode);
+	}
 	return ret;
 }
 
-ssize_t secondfs_file_write(struct file *filp, const char __user *buf, size_t len,
-				loff_t *ppos)
+int secondfs_fsync(struct file *file, loff_t start, loff_t end, int datasync)
 {
-	// We use filp->f_path.dentry->d_inode to get the inode
-	// rather than the cached filp->f_inode
-	// filp->f_inode 是缓存数据, 实时数据在 path 结构里面
-	struct inode *inode = filp->f_path.dentry->d_inode;
+	struct inode *inode = file->f_path.dentry->d_inode;
 	Inode *si = SECONDFS_INODE(inode);
-	ssize_t ret;
-	int reti;
-	u32 pos_u32 = *ppos;
+	int ret;
 
-	secondfs_dbg(FILE, "file_write(%.32s,%p,%lu)", filp->f_path.dentry->d_name.name, buf, len);
+	// This function is to sync current file to disk
+	// However for convenience we sync the whole device(Bflush)
+	// 要求将文件同步到磁盘上
+	// 我们就简单地整设备同步即可
+	secondfs_dbg(FILE, "fsync(%p)", file);
 
-	secondfs_dbg(FILE, "file_write(%.32s,%p,%lu): inode_lock()", filp->f_path.dentry->d_name.name, buf, len);
+	// File data lives in the page cache: write it out first,
+	// then the Inode (IUpdate() flushes the index blocks before it)
+	// 文件数据在页缓存中: 先把它写出去, 再写 Inode
+	// (IUpdate() 会先刷出间接索引块)
+	ret = filemap_write_and_wait_range(inode->i_mapping, start, end);
+	if (ret)
+		return ret;
+	ret = sync_inode_metadata(inode, 1);
+	if (ret)
+		return ret;
 
-	inode_lock(inode);
+	BufferManager_Bflush(si->i_ssb->s_bufmgr, si->i_ssb->s_dev);
+	return 0;
+}
 
-	secondfs_dbg(FILE, "file_write(%.32s,%p,%lu): update_time()", filp->f_path.dentry->d_name.name, buf, len);
-	
-	ret = FileManager_Write(secondfs_filemanagerp, buf, len, &pos_u32, si);
-	*ppos = pos_u32;
-	secondfs_inode_conform_s2v(inode, si);
-
-	reti = file_update_time(filp);
-	if (reti) {
-		secondfs_err("file_write(%.32s,%p,%lu): update_time() failed!", filp->f_path.dentry->d_name.name, buf, len);
-		ret = reti;
-		goto out;
+/* secondfs_release_file : 关闭文件时归还预分配而未用的盘块.
+ * On the last close of a writer, give back the blocks preallocated
+ * for it. Writeback after this may preallocate again; the rest goes
+ * back in evict_inode.
+ */
+static int secondfs_release_file(struct inode *inode, struct file *filp)
+{
+	Inode *si = SECONDFS_INODE(inode);
+
+	if (filp->f_mode & FMODE_WRITE) {
+		mutex_lock(&si->i_lock);
+		Inode_DiscardPrealloc(si);
+		mutex_unlock(&si->i_lock);
 	}
+	return 0;
+}
 
-	secondfs_inode_conform_v2s(si, inode);
-	
-	mark_inode_dirty_sync(inode);
+/* secondfs_clean_bdev_aliases : 新分配的 [block, block + nr) 可能还有旧内容
+ * 留在块设备页缓存中 (buffer_head 后端下的旧元数据), 丢掉它们, 免得之后
+ * 被写回而盖掉文件数据.
+ * Newly allocated blocks may still have old contents in the block
+ * device's page cache (old metadata with the buffer_head backend);
+ * drop them, or they could be written back over the file data.
+ */
+static void secondfs_clean_bdev_aliases(struct block_device *bdev, sector_t block, int nr)
+{
+#ifdef SECONDFS_KERNEL_BEFORE_4_10
+	for (; nr > 0; nr--)
+		unmap_underlying_metadata(bdev, block++);
+#else
+	clean_bdev_aliases(bdev, block, nr);
+#endif
+}
 
-out:
-	inode_unlock(inode);
-	return ret;
+/* secondfs_get_block : 页缓存的块映射. Map a file block for the page cache.
+ *      inode : VFS Inode
+ *      iblock : 文件逻辑块号 (块大小 512 字节)
+ *      bh_result : 输出, 映射到的设备块
+ *      create : 为空洞分配新块
+ *
+ * 基于 Inode::Bmap(). 空洞且 create == 0 时不映射, 页缓存读出全零.
+ * 回写延迟分配的缓冲区 (buffer_delay) 时在这里真正分配, 并按到文件尾
+ * 的块数一次多要一些, 让整个文件尽量连续. 调用者 (mpage, 直接 I/O)
+ * 给的 b_size 超过一块时, 已分配的报告整段连续的块, 新分配的也一次
+ * 映射一段 (见 Inode::Bmap() 的 nr).
+ * Built on Inode::Bmap(). Unmapped holes read as zeros. Delayed
+ * buffers (see secondfs_da_get_block) get their blocks here at
+ * writeback, asking for enough to reach EOF in one run. When the
+ * caller (mpage, direct I/O) passes a b_size of several blocks, a
+ * whole contiguous run is reported, and allocated, at once. A delayed
+ * bh_result may stand for a run of delayed buffers (see
+ * secondfs_da_map_page), all of them reserved.
+ */
+int secondfs_get_block(struct inode *inode, sector_t iblock,
+			struct buffer_head *bh_result, int create)
+{
+	Inode *si = SECONDFS_INODE(inode);
+	int bn;
+	int nr = 1;
+	int is_new = 0;
+	int delayed = create && buffer_delay(bh_result);
+	sector_t maxn = bh_result->b_size >> inode->i_blkbits;
+	sector_t left;
+
+	if (((loff_t)iblock << inode->i_blkbits) >= inode->i_sb->s_maxbytes)
+		return create ? -EFBIG : 0;
+
+	left = (inode->i_sb->s_maxbytes >> inode->i_blkbits) - iblock;
+	if (maxn < 1)
+		maxn = 1;
+	else if (maxn > left)
+		maxn = left;
+
+	// Readers of the page cache do not hold inode_lock;
+	// Bmap() (index tables, mapping cache) is serialized by the Inode lock
+	// 页缓存的读者不持有 inode_lock, 这里用 Inode 自己的锁保护 Bmap()
+	mutex_lock(&si->i_lock);
+	bn = Inode_Bmap(si, iblock, SECONDFS_BMAP_LOOKUP);
+	if (bn < 0) {
+		// An index table could not be read; don't take it for a hole
+		// 读索引表出错, 不能当成空洞
+		mutex_unlock(&si->i_lock);
+		return bn;
+	}
+	if (bn == 0 && create) {
+		int want = 1;
+
+		if (delayed) {
+			loff_t end = (i_size_read(inode) + SECONDFS_BLOCK_SIZE - 1) >> inode->i_blkbits;
+
+			if (end > (loff_t)iblock)
+				want = end - iblock < INT_MAX ? (int)(end - iblock) : INT_MAX;
+		}
+		// The page data is written after Bmap() enters the new blocks.
+		// So that no index reaches disk first (and shows the blocks'
+		// old contents after a crash), Bmap() pins the index table
+		// and sets IPIN; write_inode unpins once the pages are written
+		// (see Inode::Unpin()). Our callers count themselves in
+		// i_nwriting until the pages are dirty or under writeback.
+		// 页数据在 Bmap() 登记新块之后才写出. 为了不让索引先写到盘上 (崩溃
+		// 后文件中是这些块原来的内容), Bmap() 钉住索引表并置 IPIN, 页写完后
+		// 由 write_inode 放开 (见 Inode::Unpin()). 调用者在页变脏或开始回写
+		// 之前把自己计入 i_nwriting.
+		nr = (int)maxn;
+		if (want < nr)
+			want = nr;
+		// Delayed blocks were reserved at write time; others must
+		// leave the reservations alone (see FileSystem::Alloc())
+		// 延迟分配的块写入时已经预留; 其他分配不能动预留的块
+		bn = Inode_BmapWant(si, iblock, delayed ? SECONDFS_BMAP_ALLOC_RESERVED :
+				SECONDFS_BMAP_ALLOC_PAGECACHE, want, &nr);
+		is_new = 1;
+	} else if (bn != 0 && maxn > 1 && !delayed) {
+		// The caller (mpage, direct I/O) may take a longer mapping:
+		// report the whole physically contiguous run at once
+		// 调用者 (mpage, 直接 I/O) 可以接受更长的映射时,
+		// 一次报告物理上连续的整段
+		nr = Inode_ContiguousRun(si, iblock, bn, maxn);
+	}
+	mutex_unlock(&si->i_lock);
+
+	// The blocks reserved at write time are now allocated (or were, by
+	// someone else); a failed allocation keeps its reservations
+	// 写入时预留的块已经分配, 归还预留; 分配失败则继续保留
+	if (delayed && bn > 0)
+		FileSystem_Unreserve(secondfs_filesystemp, si->i_ssb, nr);
+
+	if (bn <= 0) {
+		if (create) {
+			secondfs_err("get_block(%d, %lu): Bmap() failed (%d)", si->i_number, (unsigned long)iblock, bn);
+			return bn < 0 ? bn : -ENOSPC;
+		}
+		return 0;
+	}
+
+	map_bh(bh_result, inode->i_sb, bn);
+	bh_result->b_size = (size_t)nr << inode->i_blkbits;
+	// No longer reserved: invalidatepage must not give it back again
+	// 已不再是预留的块, invalidatepage 不能再归还一次
+	if (delayed)
+		clear_buffer_delay(bh_result);
+	if (is_new) {
+		// The new blocks are not on disk yet: the page cache zeroes them.
+		// The caller drops block device aliases of the first one only
+		// 新块尚未写过, 由页缓存负责清零未写到的部分. 调用者只清掉
+		// 第一块在块设备页缓存中的别名, 其余的在这里清
+		if (nr > 1)
+			secondfs_clean_bdev_aliases(inode->i_sb->s_bdev, bn + 1, nr - 1);
+		set_buffer_new(bh_result);
+		// i_addr[] changed
+		mark_inode_dirty(inode);
+	}
+	return 0;
 }
 
-int secondfs_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+/* secondfs_da_get_block : 延迟分配时 write_begin 用的块映射.
+ *                        Block mapping of write_begin under delalloc.
+ *
+ * 已分配的块照常映射; 空洞只预留一块 (FileSystem::Reserve()), 把缓冲区
+ * 标记为 delay, 到回写时再由 secondfs_get_block() 真正分配. 这样写完
+ * 即删的临时文件不碰空闲盘块位图, 连续写入的文件回写时一次分到整段.
+ * 延迟的缓冲区不映射 (mpage 遇到未映射的脏缓冲区会退回 writepage),
+ * 之后每次写入都会再来这里, 已经是 delay 的不再预留.
+ * Mapped blocks are reported as usual; a hole only reserves a block
+ * and marks the buffer delay, so secondfs_get_block() allocates it at
+ * writeback. Files removed before writeback never touch the free map,
+ * and files written sequentially get one run at writeback. Delayed
+ * buffers stay unmapped (mpage falls back to writepage on unmapped
+ * dirty buffers), so every later write comes here again; a buffer
+ * that is already delayed is not reserved twice.
+ */
+static int secondfs_da_get_block(struct inode *inode, sector_t iblock,
+			struct buffer_head *bh_result, int create)
 {
-	// This function is to sync current file to disk
-	// However for convenience we sync the whole device(Bflush)
-	// 要求将文件同步到磁盘上
-	// 我们就简单地整设备同步即可
-	secondfs_dbg(FILE, "fsync(%p)", file);
+	Inode *si = SECONDFS_INODE(inode);
+	int bn;
+
+	if (((loff_t)iblock << inode->i_blkbits) >= inode->i_sb->s_maxbytes)
+		return -EFBIG;
+
+	// Reserved by an earlier write. Not new any more: its data stays
+	// 之前的写入已经预留. 不再是新块, 不能被清零
+	if (buffer_delay(bh_result))
+		return 0;
+
+	mutex_lock(&si->i_lock);
+	bn = Inode_Bmap(si, iblock, SECONDFS_BMAP_LOOKUP);
+	mutex_unlock(&si->i_lock);
 
-	BufferManager_Bflush(secondfs_buffermanagerp, SECONDFS_INODE(file->f_path.dentry->d_inode)->i_ssb->s_dev);
+	if (bn < 0)
+		return bn;
+	if (bn != 0) {
+		map_bh(bh_result, inode->i_sb, bn);
+		return 0;
+	}
+
+	if (FileSystem_Reserve(secondfs_filesystemp, si->i_ssb, 1) < 0)
+		return -ENOSPC;
+	// Unmapped; the caller still looks at b_bdev for a new buffer
+	// 不映射; 对新缓冲区调用者仍会用到 b_bdev
+	bh_result->b_bdev = inode->i_sb->s_bdev;
+	bh_result->b_blocknr = ~(sector_t)0;
+	set_buffer_new(bh_result);
+	set_buffer_delay(bh_result);
 	return 0;
 }
 
+static int secondfs_readpage(struct file *file, struct page *page)
+{
+	return mpage_readpage(page, secondfs_get_block);
+}
+
+static int secondfs_readpages(struct file *file, struct address_space *mapping,
+			struct list_head *pages, unsigned nr_pages)
+{
+	return mpage_readpages(mapping, pages, nr_pages, secondfs_get_block);
+}
+
+static int secondfs_writepage(struct page *page, struct writeback_control *wbc)
+{
+	Inode *si = SECONDFS_INODE(page->mapping->host);
+	int ret;
+
+	// The page is clean but not yet under writeback while blocks are mapped
+	// 分配盘块时页已不是脏的, 又还没开始回写
+	atomic_inc(&si->i_nwriting);
+	ret = block_write_full_page(page, secondfs_get_block, wbc);
+	atomic_dec(&si->i_nwriting);
+	return ret;
+}
+
+/* secondfs_da_map_page : 为一页中延迟分配的缓冲区分配盘块.
+ *                        Allocate the delayed buffers of a locked page.
+ *
+ * 连续的几个 delay 缓冲区一次交给 secondfs_get_block(), 映射到物理连续的
+ * 一段. 失败时留下未映射的, 由 writepage 报错.
+ * Each run of delayed buffers goes to secondfs_get_block() at once and
+ * maps to one physical run. On failure the rest stay unmapped and
+ * writepage reports the error.
+ */
+static void secondfs_da_map_page(struct inode *inode, struct page *page)
+{
+	struct buffer_head *bhs[MAX_BUF_PER_PAGE];
+	struct buffer_head *head, *bh;
+	struct buffer_head map;
+	sector_t iblock = (sector_t)page->index << (PAGE_SHIFT - inode->i_blkbits);
+	int nbh = 0;
+	int i, k, n;
+
+	head = bh = page_buffers(page);
+	do {
+		bhs[nbh++] = bh;
+		bh = bh->b_this_page;
+	} while (bh != head);
+
+	for (i = 0; i < nbh; i += n) {
+		n = 1;
+		if (!buffer_delay(bhs[i]))
+			continue;
+		while (i + n < nbh && buffer_delay(bhs[i + n]))
+			n++;
+
+		map.b_state = 0;
+		map.b_size = (size_t)n << inode->i_blkbits;
+		set_buffer_delay(&map);
+		if (secondfs_get_block(inode, iblock + i, &map, 1) < 0)
+			return;
+		n = map.b_size >> inode->i_blkbits;
+		// secondfs_get_block() cleaned the aliases of all but the first
+		// 除第一块外的别名已由 secondfs_get_block() 清掉
+		secondfs_clean_bdev_aliases(map.b_bdev, map.b_blocknr, 1);
+		for (k = 0; k < n; k++) {
+			bh = bhs[i + k];
+			bh->b_bdev = map.b_bdev;
+			bh->b_blocknr = map.b_blocknr + k;
+			set_buffer_mapped(bh);
+			clear_buffer_delay(bh);
+			clear_buffer_new(bh);
+		}
+	}
+}
+
+/* secondfs_da_map_pages : 回写前为范围内脏页中延迟分配的缓冲区分配盘块.
+ *                         Allocate the delayed buffers of the dirty pages
+ *                         to be written, before mpage looks at them.
+ */
+static void secondfs_da_map_pages(struct address_space *mapping, struct writeback_control *wbc)
+{
+	struct pagevec pvec;
+	pgoff_t index, end;
+	unsigned i, nr;
+
+	if (wbc->range_cyclic) {
+		index = 0;
+		end = -1;
+	} else {
+		index = wbc->range_start >> PAGE_SHIFT;
+		end = wbc->range_end >> PAGE_SHIFT;
+	}
+
+#ifdef SECONDFS_KERNEL_BEFORE_4_15
+	pagevec_init(&pvec, 0);
+#else
+	pagevec_init(&pvec);
+#endif
+	while (index <= end) {
+#ifdef SECONDFS_KERNEL_BEFORE_4_14
+		nr = pagevec_lookup_tag(&pvec, mapping, &index, PAGECACHE_TAG_DIRTY, PAGEVEC_SIZE);
+#else
+		nr = pagevec_lookup_range_tag(&pvec, mapping, &index, end, PAGECACHE_TAG_DIRTY);
+#endif
+		if (nr == 0)
+			break;
+		for (i = 0; i < nr; i++) {
+			struct page *page = pvec.pages[i];
+
+			if (page->index > end)
+				break;
+			lock_page(page);
+			if (page->mapping == mapping && PageDirty(page) && page_has_buffers(page))
+				secondfs_da_map_page(mapping->host, page);
+			unlock_page(page);
+		}
+		pagevec_release(&pvec);
+		cond_resched();
+	}
+}
+
+static int secondfs_writepages(struct address_space *mapping, struct writeback_control *wbc)
+{
+	// mpage 不认识 delay 缓冲区: 延迟分配时先为它们分配好盘块, 使 mpage
+	// 能把相邻的页合并写出. 之后才弄脏的页中未映射的缓冲区让 mpage 退回
+	// writepage (block_write_full_page()), 由它分配.
+	// mpage does not know delayed buffers: with delalloc, allocate them
+	// first so that mpage can merge neighbouring pages into large bios.
+	// Pages dirtied after that have unmapped buffers, on which mpage
+	// falls back to writepage (block_write_full_page()), which allocates.
+	Inode *si = SECONDFS_INODE(mapping->host);
+	int ret;
+
+	atomic_inc(&si->i_nwriting);
+	if (si->i_ssb->s_delalloc)
+		secondfs_da_map_pages(mapping, wbc);
+	ret = mpage_writepages(mapping, wbc, secondfs_get_block);
+	atomic_dec(&si->i_nwriting);
+	return ret;
+}
+
+/* secondfs_invalidatepage : 丢弃页 (截断, 删除) 时归还未分配的延迟块的预留.
+ * Give back the reservations of delayed buffers dropped with the page.
+ */
+static void secondfs_invalidatepage(struct page *page, unsigned int offset,
+			unsigned int length)
+{
+	struct inode *inode = page->mapping->host;
+	struct buffer_head *head, *bh;
+	unsigned int start = 0;
+	unsigned int stop = offset + length;
+	int ndelay = 0;
+
+	if (page_has_buffers(page)) {
+		head = bh = page_buffers(page);
+		do {
+			if (start >= offset && start + bh->b_size <= stop &&
+			    buffer_delay(bh)) {
+				clear_buffer_delay(bh);
+				ndelay++;
+			}
+			start += bh->b_size;
+			bh = bh->b_this_page;
+		} while (bh != head);
+	}
+	if (ndelay)
+		FileSystem_Unreserve(secondfs_filesystemp, SECONDFS_INODE(inode)->i_ssb, ndelay);
+
+	block_invalidatepage(page, offset, length);
+}
+
+static void secondfs_write_failed(struct address_space *mapping, loff_t to)
+{
+	struct inode *inode = mapping->host;
+
+	// Drop the pages beyond EOF. Unix V6++ only truncates a whole file,
+	// so the blocks allocated for them stay with the file until then.
+	// 丢弃文件尾之后的页. Unix V6++ 只能整体截断文件, 为它们分配的块
+	// 留在文件中, 直到文件被截断/删除.
+	if (to > inode->i_size)
+		truncate_pagecache(inode, inode->i_size);
+}
+
+static int secondfs_write_begin(struct file *file, struct address_space *mapping,
+			loff_t pos, unsigned len, unsigned flags,
+			struct page **pagep, void **fsdata)
+{
+	Inode *si = SECONDFS_INODE(mapping->host);
+	int ret;
+
+	// New blocks are entered here, the page gets dirty in write_end
+	// 新块在这里登记, 页到 write_end 才变脏
+	atomic_inc(&si->i_nwriting);
+	ret = block_write_begin(mapping, pos, len, flags, pagep,
+			si->i_ssb->s_delalloc ?
+			secondfs_da_get_block : secondfs_get_block);
+	if (ret < 0) {
+		atomic_dec(&si->i_nwriting);
+		secondfs_write_failed(mapping, pos + len);
+	}
+	return ret;
+}
+
+static int secondfs_write_end(struct file *file, struct address_space *mapping,
+			loff_t pos, unsigned len, unsigned copied,
+			struct page *page, void *fsdata)
+{
+	int ret;
+
+	ret = generic_write_end(file, mapping, pos, len, copied, page, fsdata);
+	atomic_dec(&SECONDFS_INODE(mapping->host)->i_nwriting);
+	if (ret < len)
+		secondfs_write_failed(mapping, pos + len);
+	return ret;
+}
+
+/* secondfs_direct_IO : O_DIRECT 读写. Direct I/O for O_DIRECT.
+ *
+ * 对齐的用户缓冲区直接映射为 bio, 既不经过页缓存, 也不经过缓存池.
+ * 与页缓存的一致性由 VFS 保证: 直接读之前先写回重叠范围的脏页,
+ * 直接写之后作废重叠范围的页. 文件数据块从不留在缓存池中
+ * (见 SECONDFS_BMAP_ALLOC_PAGECACHE), 所以缓存池无需处理.
+ * Aligned user buffers map straight to bios. The VFS writes back
+ * overlapping dirty pages before and invalidates them after; file data
+ * never lives in the Buf pool, so the pool needs nothing.
+ */
+#ifdef SECONDFS_KERNEL_BEFORE_4_7
+static ssize_t secondfs_direct_IO(struct kiocb *iocb, struct iov_iter *iter, loff_t offset)
+#else
+static ssize_t secondfs_direct_IO(struct kiocb *iocb, struct iov_iter *iter)
+#endif
+{
+	struct address_space *mapping = iocb->ki_filp->f_mapping;
+	struct inode *inode = mapping->host;
+	size_t count = iov_iter_count(iter);
+	ssize_t ret;
+
+	// Writes allocating blocks complete before blockdev_direct_IO()
+	// returns (holes inside the file fall back to buffered I/O)
+	// 分配盘块的直接写在 blockdev_direct_IO() 返回前完成 (文件中的洞退回缓冲写)
+	atomic_inc(&SECONDFS_INODE(inode)->i_nwriting);
+#ifdef SECONDFS_KERNEL_BEFORE_4_7
+	secondfs_dbg(FILE, "direct_IO(%d,%lld,%lu)", SECONDFS_INODE(inode)->i_number, offset, (unsigned long)count);
+	ret = blockdev_direct_IO(iocb, inode, iter, offset, secondfs_get_block);
+#else
+	loff_t offset = iocb->ki_pos;
+
+	secondfs_dbg(FILE, "direct_IO(%d,%lld,%lu)", SECONDFS_INODE(inode)->i_number, offset, (unsigned long)count);
+	ret = blockdev_direct_IO(iocb, inode, iter, secondfs_get_block);
+#endif
+	atomic_dec(&SECONDFS_INODE(inode)->i_nwriting);
+	if (ret < 0 && iov_iter_rw(iter) == WRITE)
+		secondfs_write_failed(mapping, offset + count);
+	return ret;
+}
+
+static sector_t secondfs_bmap(struct address_space *mapping, sector_t block)
+{
+	// 延迟分配的块回写后才有块号. Delayed blocks get a number at writeback.
+	if (mapping_tagged(mapping, PAGECACHE_TAG_DIRTY))
+		filemap_write_and_wait(mapping);
+	return generic_block_bmap(mapping, block, secondfs_get_block);
+}
+
+// Regular file data goes through the Linux page cache; directories and
+// other metadata still go through the Unix V6++ Buf pool.
+// 普通文件的数据走 Linux 页缓存; 目录和其他元数据仍走 Unix V6++ 缓存池.
+const struct address_space_operations secondfs_aops = {
+	.readpage = secondfs_readpage,
+	.readpages = secondfs_readpages,
+	.writepage = secondfs_writepage,
+	.writepages = secondfs_writepages,
+	.write_begin = secondfs_write_begin,
+	.write_end = secondfs_write_end,
+	.bmap = secondfs_bmap,
+	.direct_IO = secondfs_direct_IO,
+	.set_page_dirty = __set_page_dirty_buffers,
+	.invalidatepage = secondfs_invalidatepage,
+	.migratepage = buffer_migrate_page,
+	.is_partially_uptodate = block_is_partially_uptodate,
+	.error_remove_page = generic_error_remove_page,
+};
+
 int secondfs_add_link(struct dentry *dentry, struct inode *inode)
 {
 	// This function is to add dentry to its parent's directory file
@@ -214,6 +694,7 @@ static int secondfs_create(struct inode *dir, struct dentry *dentry, umode_t mod
 	// Add operation function table to it
 	inode->i_op = &secondfs_file_inode_operations;
 	inode->i_fop = &secondfs_file_operations;
+	inode->i_mapping->a_ops = &secondfs_aops;
 	mark_inode_dirty(inode);
 
 	// 具体在 dentry 里建立与 inode 的链接, 并把
@@ -814,22 +1295,74 @@ out:
 	return err;
 }
 
+/* secondfs_page_mkwrite : 共享可写映射的页第一次被写时调用.
+ *                         Called when a page of a shared writable mapping
+ *                         is first written.
+ *
+ * 和 write_begin 一样为页中的洞分配 (或在延迟分配时预留) 盘块, 这样
+ * 空间不足在缺页时就以 SIGBUS 报出, 而不是在回写时丢掉数据.
+ * Like write_begin, allocate (or, with delalloc, reserve) the holes of
+ * the page, so that running out of space shows up as SIGBUS at fault
+ * time instead of lost data at writeback.
+ */
+#ifdef SECONDFS_KERNEL_BEFORE_4_11
+static int secondfs_page_mkwrite(struct vm_area_struct *vma, struct vm_fault *vmf)
+#else
+#ifdef SECONDFS_KERNEL_BEFORE_4_17
+static int secondfs_page_mkwrite(struct vm_fault *vmf)
+#else
+static vm_fault_t secondfs_page_mkwrite(struct vm_fault *vmf)
+#endif
+#endif
+{
+#ifndef SECONDFS_KERNEL_BEFORE_4_11
+	struct vm_area_struct *vma = vmf->vma;
+#endif
+	struct inode *inode = file_inode(vma->vm_file);
+	int ret;
+
+	sb_start_pagefault(inode->i_sb);
+	file_update_time(vma->vm_file);
+	// The page is dirtied by block_page_mkwrite() before it returns
+	// 页在 block_page_mkwrite() 返回前变脏
+	atomic_inc(&SECONDFS_INODE(inode)->i_nwriting);
+	ret = block_page_mkwrite(vma, vmf, SECONDFS_INODE(inode)->i_ssb->s_delalloc ?
+			secondfs_da_get_block : secondfs_get_block);
+	atomic_dec(&SECONDFS_INODE(inode)->i_nwriting);
+	sb_end_pagefault(inode->i_sb);
+	return block_page_mkwrite_return(ret);
+}
+
+static const struct vm_operations_struct secondfs_file_vm_ops = {
+	.fault = filemap_fault,
+	.map_pages = filemap_map_pages,
+	.page_mkwrite = secondfs_page_mkwrite,
+};
+
+static int secondfs_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	file_accessed(file);
+	vma->vm_ops = &secondfs_file_vm_ops;
+	return 0;
+}
+
 struct file_operations secondfs_file_operations = {
 	.llseek = generic_file_llseek,
 
-	// 我们跳过 Linux 读写基于页缓存-块设备的文件系统常用的
-	// kiocb,iovec - address_map - page cache - readpage()/direct_IO()
-	// 调用路径. 所以, 我们不指定
-	// read_iter 和 write_iter 方法.
-	//.read_iter = secondfs_file_read_iter,
-	//.write_iter = secondfs_file_write_iter,
-
-	// 相反, 我们指定 read() 方法和 write() 方法, 以
-	// Unix V6++ 的方式读写文件.
-	.read = secondfs_file_read,
-	.write = secondfs_file_write,
+	// 普通文件走 Linux 页缓存: kiocb,iov_iter - address_space -
+	// page cache - readpage()/writepage() - secondfs_get_block() - Bmap().
+	// 重复读直接由页缓存命中, 写回由内核的 flusher 批量进行.
+	// readv/writev 等多段读写一次调用完成.
+	// Regular files go through the page cache (see secondfs_aops);
+	// vectored I/O is handled in one call.
+	.read_iter = secondfs_file_read_iter,
+	.write_iter = secondfs_file_write_iter,
+	.mmap = secondfs_file_mmap,
+	.splice_read = generic_file_splice_read,
+	.splice_write = iter_file_splice_write,
 
 	.open = generic_file_open,
+	.release = secondfs_release_file,
 	.fsync = secondfs_fsync
 };
 
@@ -233,13 +233,37 @@ int secondfs_write_inode(struct inode *inode, struct writeback_control *wbc)
 	// 与 UnixV6++  不同, 这里的IUpdate 不会更新时间
 	secondfs_dbg(INODE, "write_inode(%p, %d), IUpdate...", si->i_ssb, si->i_number);
 
-	// Bflush() will be called at the end of IUpdate
+	// Bflush() will be called in IUpdate, before the DiskInode is written
 #ifdef SECONDFS_KERNEL_BEFORE_4_14
 	if ((inode->i_sb->s_flags & MS_RDONLY) == 0)
 #else
 	if ((inode->i_sb->s_flags & SB_RDONLY) == 0)
 #endif
+	{
+		// i_addr[] may be changed by secondfs_get_block() meanwhile
+		// 页缓存回写时 secondfs_get_block() 可能同时修改 i_addr[]
+		mutex_lock(&si->i_lock);
+		// Tables mapping new page cache data stay pinned until that
+		// data is on disk; sync waits for it, background writeback
+		// comes back later.
+		// 指向新页缓存数据的索引表在数据写到盘上之前保持钉住.
+		// 同步写回时等数据写完, 后台回写则以后再来.
+		if ((si->i_flag & SECONDFS_IPIN) && Inode_Unpin(si, 0) != 0 &&
+				wbc->sync_mode == WB_SYNC_ALL) {
+			mutex_unlock(&si->i_lock);
+			filemap_write_and_wait(inode->i_mapping);
+			mutex_lock(&si->i_lock);
+			Inode_Unpin(si, 0);
+		}
 		ret = Inode_IUpdate(si, ktime_get_real_seconds());
+		mutex_unlock(&si->i_lock);
+		if (ret > 0) {
+			// DiskInode deferred, see Inode::IUpdate()
+			// DiskInode 这次没写, 见 Inode::IUpdate()
+			mark_inode_dirty_sync(inode);
+			ret = 0;
+		}
+	}
 	else
 		ret = -EPERM;
 
@@ -262,18 +286,26 @@ void secondfs_evict_inode(struct inode *inode)
 	int ret;
 
 	secondfs_dbg(INODE, "evict_inode(%p, %d)...", pNode->i_ssb, pNode->i_number);
+	if (pNode->i_ra_hits + pNode->i_ra_misses + pNode->i_ext_hits != 0)
+		secondfs_dbg(READAHEAD, "evict_inode(%p, %d): read-ahead hits %u, misses %u; block map cache hits %u",
+			pNode->i_ssb, pNode->i_number, pNode->i_ra_hits, pNode->i_ra_misses, pNode->i_ext_hits);
 	// inode->pNode synchronization
 	// 先让 Inode 与 VFS Inode 同步
 	secondfs_inode_conform_v2s(pNode, inode);
 
 
-	// We do not use linux page cache, so 
-	// truncate_inode_pages_final will do nothing
-	// good here.
-	// 把与这个 VFS Inode 关联的文件页全部释放 ?
-	// 由于我们不使用 address_space 和页缓存机制,
-	// 这里没有必要
-	// truncate_inode_pages_final(&inode->i_data);
+	// Regular file data lives in the page cache; drop it
+	// before ITrunc() may free (and hand out) its blocks.
+	// 把与这个 VFS Inode 关联的文件页全部释放. 普通文件的数据
+	// 在页缓存中, 必须在 ITrunc() 释放 (并可能重新分配出) 其
+	// 盘块之前丢弃.
+	truncate_inode_pages_final(&inode->i_data);
+
+	// No more writeback: give back the blocks preallocated for it,
+	// and nothing is left to hold the index tables back for
+	// 不会再有回写了, 归还为它预分配的盘块, 索引表也不必再钉住
+	Inode_DiscardPrealloc(pNode);
+	Inode_Unpin(pNode, 1);
 
 	/* When linkcount falls to 0, delete(unlink) it */
 	/* 该文件已经没有目录路径指向它, 删除它 */
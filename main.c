@@ -41,15 +41,53 @@ static char *username = "user";
 module_param(username, charp, S_IRUGO);
 MODULE_PARM_DESC(username, "The user's name to display a hello world message in /var/log/kern.log");
 
+int secondfs_bufs = SECONDFS_NBUF;
+module_param_named(bufs, secondfs_bufs, int, S_IRUGO);
+MODULE_PARM_DESC(bufs, "Most 512-byte buffers in the buffer pool of a volume, allocated on demand");
+
+int secondfs_bufs_min = SECONDFS_NBUF_FLOOR;
+module_param_named(bufs_min, secondfs_bufs_min, int, S_IRUGO);
+MODULE_PARM_DESC(bufs_min, "Buffers a volume keeps under memory pressure (at least " __stringify(SECONDFS_NBUF_MIN) " per shard)");
+
+int secondfs_bufgroup = 0;
+module_param_named(bufgroup, secondfs_bufgroup, int, S_IRUGO);
+MODULE_PARM_DESC(bufgroup, "Group buffers by " __stringify(SECONDFS_GROUP_SIZE) " bytes, read and replaced together (0/1; mount options bufgroup/nobufgroup)");
+
+int secondfs_bh = 0;
+module_param_named(bh, secondfs_bh, int, S_IRUGO);
+MODULE_PARM_DESC(bh, "Use buffer_heads of the block device's page cache as buffers (0/1; mount options bh/nobh)");
+
+int secondfs_delalloc = 1;
+module_param_named(delalloc, secondfs_delalloc, int, S_IRUGO);
+MODULE_PARM_DESC(delalloc, "Allocate blocks of buffered writes at writeback instead of at write (0/1; mount options delalloc/nodelalloc)");
+
+// 后台回写参数, 可在运行时通过 /sys/module/secondfs/parameters/ 修改
+// Background writeback tunables; writable at runtime under /sys/module/secondfs/parameters/
+int secondfs_wb_interval = SECONDFS_WB_INTERVAL_MS;
+module_param_named(wb_interval, secondfs_wb_interval, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(wb_interval, "Interval of background writeback of dirty buffers, in ms");
+
+int secondfs_dirty_expire = SECONDFS_DIRTY_EXPIRE_MS;
+module_param_named(dirty_expire, secondfs_dirty_expire, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(dirty_expire, "Age in ms after which a dirty buffer is written back");
+
+int secondfs_dirty_ratio = SECONDFS_DIRTY_RATIO;
+module_param_named(dirty_ratio, secondfs_dirty_ratio, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(dirty_ratio, "Percentage of dirty buffers in the pool that starts writeback regardless of age");
+
 // 内核高速缓存 kmem_cache, 用来暂时存放 SecondFS 的各数据结构
 // Kernel cache (slab) descriptor for frequently allocated
 // & disposed structs for secondfs
 struct kmem_cache *secondfs_diskinode_cachep;
 struct kmem_cache *secondfs_icachep;
+struct kmem_cache *secondfs_buffer_cachep;
+struct kmem_cache *secondfs_group_cachep;
+
+// /sys/fs/secondfs
+struct kobject *secondfs_kobj;
 
 // 一次性的对象定义
 // Some one-time objects
-BufferManager *secondfs_buffermanagerp;
 FileSystem *secondfs_filesystemp;
 FileManager *secondfs_filemanagerp;
 
@@ -76,7 +114,7 @@ struct super_operations secondfs_sb_ops = {
 	.dirty_inode	= secondfs_dirty_inode,
 	//.statfs		= secondfs_statfs,
 	//.remount_fs	= secondfs_remount,
-	//.show_options	= secondfs_show_options,
+	.show_options	= secondfs_show_options,
 };
 
 static void secondfs_inode_init_once(void *si) {
@@ -110,6 +148,36 @@ static int __init init_secondfs(void) {
 		return -ENOMEM;
 	}
 
+	// Buffers are aligned to their size, so that none of them
+	// crosses a page boundary (bio needs a page + offset).
+	// 缓冲区按其大小对齐, 保证不跨页 (bio 需要 页 + 页内偏移)
+	secondfs_buffer_cachep = kmem_cache_create("secondfs_buffer_cache",
+		SECONDFS_BUFFER_SIZE,
+		SECONDFS_BUFFER_SIZE,
+		(SLAB_RECLAIM_ACCOUNT| SLAB_MEM_SPREAD),
+		NULL);
+
+	if (!secondfs_buffer_cachep) {
+		kmem_cache_destroy(secondfs_diskinode_cachep);
+		kmem_cache_destroy(secondfs_icachep);
+		return -ENOMEM;
+	}
+
+	// Shared buffers of Buf groups (group mode), aligned the same way
+	// 成组模式下一组 Buf 共用的缓冲区, 同样按其大小对齐
+	secondfs_group_cachep = kmem_cache_create("secondfs_group_cache",
+		SECONDFS_GROUP_SIZE,
+		SECONDFS_GROUP_SIZE,
+		(SLAB_RECLAIM_ACCOUNT| SLAB_MEM_SPREAD),
+		NULL);
+
+	if (!secondfs_group_cachep) {
+		kmem_cache_destroy(secondfs_diskinode_cachep);
+		kmem_cache_destroy(secondfs_icachep);
+		kmem_cache_destroy(secondfs_buffer_cachep);
+		return -ENOMEM;
+	}
+
 	// Check consistency of sizeof() various datastructs from C part and C++ part.
 	secondfs_dbg(SIZECONSISTENCY, "Buf size : %u %lu\n", SECONDFS_SIZEOF_Buf, sizeof(Buf));
 	secondfs_dbg(SIZECONSISTENCY, "BufferManager size : %u %lu\n", SECONDFS_SIZEOF_BufferManager, sizeof(BufferManager));
@@ -133,28 +201,46 @@ static int __init init_secondfs(void) {
 	) {
 		// Sizes match error
 		secondfs_err("sizeof() does not match! secondfs refuses to load.");
+		kmem_cache_destroy(secondfs_diskinode_cachep);
+		kmem_cache_destroy(secondfs_icachep);
+		kmem_cache_destroy(secondfs_buffer_cachep);
+		kmem_cache_destroy(secondfs_group_cachep);
 		return -EPERM;
 	}
 
 	// Initialize one-time objects
 	// 初始化一次性的对象
-	secondfs_buffermanagerp = newBufferManager();
+	// (Each mounted volume has its own BufferManager, created in fill_super)
+	// (每个挂载的卷都有自己的 BufferManager, 在 fill_super 中创建)
 	secondfs_filesystemp = newFileSystem();
 	secondfs_filemanagerp = newFileManager();
 
-	if (!secondfs_buffermanagerp || !secondfs_filesystemp || !secondfs_filemanagerp) {
-		if (secondfs_buffermanagerp)
-			deleteBufferManager(secondfs_buffermanagerp);
+	if (!secondfs_filesystemp || !secondfs_filemanagerp) {
 		if (secondfs_filesystemp)
 			deleteFileSystem(secondfs_filesystemp);
 		if (secondfs_filemanagerp)
 			deleteFileManager(secondfs_filemanagerp);
+		kmem_cache_destroy(secondfs_diskinode_cachep);
+		kmem_cache_destroy(secondfs_icachep);
+		kmem_cache_destroy(secondfs_buffer_cachep);
+		kmem_cache_destroy(secondfs_group_cachep);
 		return -ENOMEM;
 	}
 
-	BufferManager_Initialize(secondfs_buffermanagerp);
 	FileSystem_Initialize(secondfs_filesystemp);
-	secondfs_filesystemp->m_BufferManager = secondfs_buffermanagerp;
+
+	// 各卷的缓存池统计放在 /sys/fs/secondfs/<设备名>/ 下
+	// Per-volume buffer pool counters go under /sys/fs/secondfs/<dev>/
+	secondfs_kobj = kobject_create_and_add("secondfs", fs_kobj);
+	if (!secondfs_kobj) {
+		deleteFileSystem(secondfs_filesystemp);
+		deleteFileManager(secondfs_filemanagerp);
+		kmem_cache_destroy(secondfs_diskinode_cachep);
+		kmem_cache_destroy(secondfs_icachep);
+		kmem_cache_destroy(secondfs_buffer_cachep);
+		kmem_cache_destroy(secondfs_group_cachep);
+		return -ENOMEM;
+	}
 
 	// 注册文件系统
 	ret = register_filesystem(&secondfs_fs_type);
@@ -175,14 +261,17 @@ static void __exit exit_secondfs(void) {
 	// 反注册文件系统
 	ret = unregister_filesystem(&secondfs_fs_type);
 
+	kobject_put(secondfs_kobj);
+
 	// 析构一次性的对象
-	deleteBufferManager(secondfs_buffermanagerp);
 	deleteFileSystem(secondfs_filesystemp);
 	deleteFileManager(secondfs_filemanagerp);
 
 	// 将所有数据结构的 kmem_cache 析构
 	kmem_cache_destroy(secondfs_diskinode_cachep);
 	kmem_cache_destroy(secondfs_icachep);
+	kmem_cache_destroy(secondfs_buffer_cachep);
+	kmem_cache_destroy(secondfs_group_cachep);
 
 	if (likely(ret == 0)) {
 		secondfs_info("Goodbye %s!", username);
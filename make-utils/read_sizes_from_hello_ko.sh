@@ -7,4 +7,7 @@ function get_size_from_const () {
 echo -n "-D SECONDFS_SEMAPHORE_SIZE=" ; get_size_from_const semaphore_size
 echo -n " -D SECONDFS_SPINLOCK_T_SIZE=" ; get_size_from_const spinlock_t_size
 echo -n " -D SECONDFS_MUTEX_SIZE=" ; get_size_from_const mutex_size
-echo -n " -D SECONDFS_INODE_SIZE=" ; get_size_from_const inode_size
\ No newline at end of file
+echo -n " -D SECONDFS_INODE_SIZE=" ; get_size_from_const inode_size
+echo -n " -D SECONDFS_WAIT_QUEUE_HEAD_SIZE=" ; get_size_from_const wait_queue_head_size
+echo -n " -D SECONDFS_DELAYED_WORK_SIZE=" ; get_size_from_const delayed_work_size
+echo -n " -D SECONDFS_BLK_PLUG_SIZE=" ; get_size_from_const blk_plug_size
\ No newline at end of file
@@ -3,10 +3,30 @@
 
 #include <linux/version.h>
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,17,0)
+#define SECONDFS_KERNEL_BEFORE_4_17
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,15,0)
+#define SECONDFS_KERNEL_BEFORE_4_15
+#endif
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4,14,0)
 #define SECONDFS_KERNEL_BEFORE_4_14
 #endif
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,13,0)
+#define SECONDFS_KERNEL_BEFORE_4_13
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,11,0)
+#define SECONDFS_KERNEL_BEFORE_4_11
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,10,0)
+#define SECONDFS_KERNEL_BEFORE_4_10
+#endif
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4,9,0)
 #define SECONDFS_KERNEL_BEFORE_4_9
 #endif
@@ -15,6 +35,10 @@
 #define SECONDFS_KERNEL_BEFORE_4_8
 #endif
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,7,0)
+#define SECONDFS_KERNEL_BEFORE_4_7
+#endif
+
 /* Declare or define self-owned functions, variables and macros of SecondFS. */
 /* 声明 SecondFS 文件系统使用的函数原型, 变量, 宏等 */
 
@@ -31,10 +55,13 @@
 #include <linux/buffer_head.h>
 #include <linux/fs.h>
 #include <linux/init.h>
+#include <linux/mpage.h>
 #include <linux/namei.h>
 #include <linux/module.h>
+#include <linux/pagevec.h>
 #include <linux/parser.h>
 #include <linux/random.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
 #include <linux/time.h>
 #include <linux/version.h>
@@ -42,6 +69,9 @@
 #include <linux/types.h>
 #include <linux/kernel.h>
 #include <linux/statfs.h>
+#include <linux/shrinker.h>
+#include <linux/kobject.h>
+#include <linux/sysfs.h>
 
 #define SECONDFS_BITS_PER_BYTE CHAR_BIT
 
@@ -53,6 +83,44 @@ extern struct kmem_cache *secondfs_icachep;
 // 内核高速缓存 kmem_cache, 用来暂时存放 SecondFS 的 DiskInode
 extern struct kmem_cache *secondfs_diskinode_cachep;
 
+// Kernel cache descriptor for buffers (data part of Buf)
+// 内核高速缓存 kmem_cache, 用来分配 Buf 所管理的缓冲区
+extern struct kmem_cache *secondfs_buffer_cachep;
+
+// Kernel cache descriptor for the shared buffer of a Buf group (group mode)
+// 内核高速缓存 kmem_cache, 用来分配成组模式下一组 Buf 共用的缓冲区
+extern struct kmem_cache *secondfs_group_cachep;
+
+// Number of Bufs in the buffer pool (module parameter "bufs")
+// 缓存池中缓冲块的数量 (模块参数 bufs)
+extern int secondfs_bufs;
+
+// Buffers kept under memory pressure (module parameter "bufs_min")
+// 内存紧张时也保留的缓冲块数量 (模块参数 bufs_min)
+extern int secondfs_bufs_min;
+
+// Whether volumes group Bufs by page by default (module parameter "bufgroup")
+// 各卷默认是否按页把 Buf 成组 (模块参数 bufgroup)
+extern int secondfs_bufgroup;
+
+// Whether volumes use the buffer_head backend by default (module parameter "bh")
+// 各卷默认是否用 buffer_head 后端 (模块参数 bh)
+extern int secondfs_bh;
+
+// Whether volumes delay block allocation to writeback by default (module parameter "delalloc")
+// 各卷默认是否把盘块分配推迟到回写时 (模块参数 delalloc)
+extern int secondfs_delalloc;
+
+// /sys/fs/secondfs, parent of the per-volume directories
+// /sys/fs/secondfs, 各卷的 sysfs 目录在其下
+extern struct kobject *secondfs_kobj;
+
+// Background writeback tunables (module parameters, see main.c)
+// 后台回写参数 (模块参数, 见 main.c)
+extern int secondfs_wb_interval;
+extern int secondfs_dirty_expire;
+extern int secondfs_dirty_ratio;
+
 /*** Functions(mostly internel & private) ***/
 /*** 函数 ***/
 
@@ -94,6 +162,7 @@ extern void secondfs_evict_inode(struct inode *inode);
 extern int secondfs_sync_fs(struct super_block *sb, int wait);
 extern int secondfs_fill_super(struct super_block *sb, void *data, int silent);
 extern void secondfs_put_super(struct super_block *sb);
+extern int secondfs_show_options(struct seq_file *seq, struct dentry *root);
 extern struct dentry *secondfs_mount(struct file_system_type *fs_type,
 				int flags, const char *devname,
 				void *data);
@@ -104,6 +173,9 @@ extern struct super_operations secondfs_sb_ops;
 
 extern struct inode_operations secondfs_file_inode_operations;
 extern struct file_operations secondfs_file_operations;
+extern const struct address_space_operations secondfs_aops;
+extern int secondfs_get_block(struct inode *inode, sector_t iblock,
+			struct buffer_head *bh_result, int create);
 extern struct inode_operations secondfs_dir_inode_operations;
 extern struct file_operations secondfs_dir_operations;
 
@@ -138,16 +210,16 @@ extern "C" {
 /*** Functions(mostly internel & private) ***/
 /*** 函数 ***/
 
-extern int secondfs_submit_bio_sync_read(void * /* actually struct block_device * */ bdev, u32 sector,
-				void *buf);
-extern int secondfs_submit_bio_sync_write(void * /* actually struct block_device * */ bdev, u32 sector,
-				void *buf);
+extern void secondfs_submit_bio_range_read(Buf *first);
+extern void secondfs_submit_bio_range_write(Buf *first, int sync);
+extern void secondfs_submit_bh_range_read(Buf *first);
+extern void secondfs_submit_bh_range_write(Buf *first, int sync);
 extern Inode *secondfs_iget_forcc(SuperBlock *secsb, unsigned long ino);
 extern Inode *secondfs_c_helper_new_inode(SuperBlock *ssb);
+extern void secondfs_balance_dirty(BufferManager *bm);
 
 /*** One time C++ objects ***/
 /*** 一次性 C++ 对象 ***/
-extern BufferManager *secondfs_buffermanagerp;
 extern FileSystem *secondfs_filesystemp;
 extern FileManager *secondfs_filemanagerp;
 
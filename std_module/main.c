@@ -23,6 +23,9 @@
 #include <linux/spinlock.h>
 #include <linux/semaphore.h>
 #include <linux/fs.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/blkdev.h>
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Mark Veltzer");
@@ -33,6 +36,9 @@ const u32 std_module_mutex_size __attribute__((section("mutex_size"))) = sizeof(
 const u32 std_module_spinlock_t_size __attribute__((section("spinlock_t_size"))) = sizeof(spinlock_t);
 const u32 std_module_semaphore_size __attribute__((section("semaphore_size"))) = sizeof(struct semaphore);
 const u32 std_module_inode_size __attribute__((section("inode_size"))) = sizeof(struct inode);
+const u32 std_module_wait_queue_head_size __attribute__((section("wait_queue_head_size"))) = sizeof(wait_queue_head_t);
+const u32 std_module_delayed_work_size __attribute__((section("delayed_work_size"))) = sizeof(struct delayed_work);
+const u32 std_module_blk_plug_size __attribute__((section("blk_plug_size"))) = sizeof(struct blk_plug);
 
 static int __init hello_init(void)
 {
@@ -30,7 +30,7 @@ struct inode *secondfs_iget(struct super_block *sb, unsigned long ino)
 {
 	struct inode *inode;
 	Inode *si;
-	BufferManager *bm = secondfs_buffermanagerp;
+	BufferManager *bm = SECONDFS_SB(sb)->s_bufmgr;
 	Buf* pBuf;
 
 	// Effects of iget_locked:
@@ -72,11 +72,18 @@ struct inode *secondfs_iget(struct super_block *sb, unsigned long ino)
 	// si->i_flag = SECONDFS_ILOCK;
 	// si->i_count++;
 	si->i_lastr = -1;
+	si->i_ra_window = 0;
+	si->i_ra_next = 0;
+	si->i_ra_hits = 0;
+	si->i_ra_misses = 0;
+	si->i_ext_hits = 0;
 
 	
 	/* 将该外存Inode读入缓冲区 */
 	secondfs_dbg(INODE, "iget(%p/%lu): read from disk", sb, ino);
-	pBuf = BufferManager_Bread(bm, SECONDFS_SB(sb)->s_dev, SECONDFS_INODE_ZONE_START_SECTOR + ino / SECONDFS_INODE_NUMBER_PER_SECTOR );
+	// 只读取, 与同时读取同一块中其他 Inode 的进程共享
+	// Read-only; share it with others reading inodes of the same block
+	pBuf = BufferManager_BreadShared(bm, SECONDFS_SB(sb)->s_dev, SECONDFS_INODE_ZONE_START_SECTOR + ino / SECONDFS_INODE_NUMBER_PER_SECTOR, 0);
 
 	if (IS_ERR(pBuf)) {
 		secondfs_err("iget(%p/%lu): read from disk error! %ld", sb, ino, PTR_ERR(pBuf));
@@ -88,7 +95,7 @@ struct inode *secondfs_iget(struct super_block *sb, unsigned long ino)
 	if(pBuf->b_flags & SECONDFS_B_ERROR)
 	{
 		/* 释放缓存 */
-		BufferManager_Brelse(bm, pBuf);
+		BufferManager_BrelseShared(bm, pBuf);
 		/* 释放占据的内存Inode */
 		iget_failed(inode);
 		return ERR_PTR(-EIO);
@@ -110,6 +117,7 @@ struct inode *secondfs_iget(struct super_block *sb, unsigned long ino)
 	if (S_ISREG(inode->i_mode)) {
 		inode->i_op = &secondfs_file_inode_operations;
 		inode->i_fop = &secondfs_file_operations;
+		inode->i_mapping->a_ops = &secondfs_aops;
 	} else if (S_ISDIR(inode->i_mode)) {
 		inode->i_op = &secondfs_dir_inode_operations;
 		inode->i_fop = &secondfs_dir_operations;
@@ -118,7 +126,7 @@ struct inode *secondfs_iget(struct super_block *sb, unsigned long ino)
 	}
 
 	/* 释放缓存 */
-	BufferManager_Brelse(bm, pBuf);
+	BufferManager_BrelseShared(bm, pBuf);
 	unlock_new_inode(inode);
 	return inode;	
 }
@@ -275,6 +283,303 @@ static void secondfs_write_super(struct super_block *sb)
 #endif
 }
 
+/* 挂载选项. Mount options. */
+enum {
+	Opt_bufs, Opt_bufs_min, Opt_bufgroup, Opt_nobufgroup, Opt_bh, Opt_nobh,
+	Opt_delalloc, Opt_nodelalloc, Opt_err
+};
+
+static const match_table_t secondfs_tokens = {
+	{Opt_bufs, "bufs=%u"},
+	{Opt_bufs_min, "bufs_min=%u"},
+	{Opt_bufgroup, "bufgroup"},
+	{Opt_nobufgroup, "nobufgroup"},
+	{Opt_bh, "bh"},
+	{Opt_nobh, "nobh"},
+	{Opt_delalloc, "delalloc"},
+	{Opt_nodelalloc, "nodelalloc"},
+	{Opt_err, NULL}
+};
+
+/* secondfs_parse_options : 解析挂载选项.
+ *                         Parse mount options.
+ *      data : mount 传入的选项字符串, 可为 NULL
+ *      nbuf : 输出, 本卷缓存块数的上限 (默认为模块参数 bufs)
+ *      nmin : 输出, 内存紧张时也保留的缓存块数 (默认为模块参数 bufs_min)
+ *      group : 输出, 是否把缓存块按页成组 (默认为模块参数 bufgroup)
+ *      bh : 输出, 是否用块设备页缓存的 buffer_head 作缓冲区 (默认为模块参数 bh)
+ *      delalloc : 输出, 是否把缓冲写的盘块分配推迟到回写时 (默认为模块参数 delalloc)
+ *
+ * 返回 0 或负的错误号.
+ */
+static int secondfs_parse_options(char *data, int *nbuf, int *nmin, int *group, int *bh,
+				  int *delalloc)
+{
+	substring_t args[MAX_OPT_ARGS];
+	char *p;
+	int option;
+
+	*nbuf = secondfs_bufs;
+	*nmin = secondfs_bufs_min;
+	*group = !!secondfs_bufgroup;
+	*bh = !!secondfs_bh;
+	*delalloc = !!secondfs_delalloc;
+
+	if (!data)
+		return 0;
+
+	while ((p = strsep(&data, ",")) != NULL) {
+		int token;
+		if (!*p)
+			continue;
+
+		token = match_token(p, secondfs_tokens, args);
+		switch (token) {
+		case Opt_bufs:
+			if (match_int(&args[0], &option) || option <= 0)
+				return -EINVAL;
+			*nbuf = option;
+			break;
+		case Opt_bufs_min:
+			if (match_int(&args[0], &option) || option < 0)
+				return -EINVAL;
+			*nmin = option;
+			break;
+		case Opt_bufgroup:
+			*group = 1;
+			break;
+		case Opt_nobufgroup:
+			*group = 0;
+			break;
+		case Opt_bh:
+			*bh = 1;
+			break;
+		case Opt_nobh:
+			*bh = 0;
+			break;
+		case Opt_delalloc:
+			*delalloc = 1;
+			break;
+		case Opt_nodelalloc:
+			*delalloc = 0;
+			break;
+		default:
+			secondfs_err("unrecognized mount option \"%s\"", p);
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+/* secondfs_show_options : 在 /proc/mounts 中显示挂载选项.
+ *                        Show mount options in /proc/mounts.
+ */
+int secondfs_show_options(struct seq_file *seq, struct dentry *root)
+{
+	SuperBlock *secsb = SECONDFS_SB(root->d_sb);
+
+	seq_printf(seq, ",bufs=%d", secsb->s_bufmgr->m_nbuf);
+	seq_printf(seq, ",bufs_min=%d", secsb->s_bufmgr->m_nmin);
+	if (secsb->s_bufmgr->m_gshift)
+		seq_puts(seq, ",bufgroup");
+	if (secsb->s_bufmgr->m_bh)
+		seq_puts(seq, ",bh");
+	if (!secsb->s_delalloc)
+		seq_puts(seq, ",nodelalloc");
+	return 0;
+}
+
+/* secondfs_writeback_workfn : 后台回写任务, 每个卷一个.
+ *                            Background writeback, one per volume.
+ *
+ * 每 wb_interval 毫秒把超过 dirty_expire 毫秒的脏缓存块按盘块号顺序
+ * 异步写出, 脏块超过 dirty_ratio% 时不论年龄多写一些. 这样 GetBlk()
+ * 回收缓存块时几乎总能拿到干净的, 不必在分配路径上写盘.
+ * Every wb_interval ms, writes the Bufs dirty for longer than
+ * dirty_expire ms in blkno order (more when over dirty_ratio%), so that
+ * GetBlk() almost never has to write back a Buf it wants to reuse.
+ */
+static void secondfs_writeback_workfn(struct work_struct *work)
+{
+	BufferManager *bm = container_of(to_delayed_work(work), BufferManager, b_wb_work);
+	int ratio = clamp(secondfs_dirty_ratio, 0, 100);
+
+	BufferManager_Bwriteback(bm, msecs_to_jiffies(max(secondfs_dirty_expire, 0)), ratio);
+	queue_delayed_work(system_long_wq, &bm->b_wb_work,
+		msecs_to_jiffies(max(secondfs_wb_interval, 1)));
+}
+
+/* secondfs_balance_dirty : 脏缓存块超过 dirty_ratio% 时立即启动后台回写.
+ *                         Kick the writeback at once when over dirty_ratio%.
+ * 由 BufferManager::Bdwrite() 调用. Called from BufferManager::Bdwrite().
+ */
+void secondfs_balance_dirty(BufferManager *bm)
+{
+	// 钉住的脏块回写也写不了, 不算 Pinned dirty Bufs cannot be written; don't count them
+	if ((atomic_read(&bm->b_ndirty) - atomic_read(&bm->b_npin)) * 100 > secondfs_dirty_ratio * atomic_read(&bm->b_nalloc))
+		mod_delayed_work(system_long_wq, &bm->b_wb_work, 0);
+}
+
+/* 每个卷的缓存池: 内存紧张时回收缓冲区的 shrinker,
+ * 以及 /sys/fs/secondfs/<设备名>/ 下的统计.
+ * Per-volume buffer pool: the shrinker that gives buffers back under
+ * memory pressure, and the counters under /sys/fs/secondfs/<dev>/.
+ */
+struct secondfs_bufpool {
+	BufferManager *bm;
+	struct shrinker shrinker;
+	struct kobject kobj;
+};
+
+#define SECONDFS_SHRINKER_POOL(s) container_of(s, struct secondfs_bufpool, shrinker)
+
+static unsigned long secondfs_bufpool_count(struct shrinker *s, struct shrink_control *sc)
+{
+	return BufferManager_Reclaimable(SECONDFS_SHRINKER_POOL(s)->bm);
+}
+
+static unsigned long secondfs_bufpool_scan(struct shrinker *s, struct shrink_control *sc)
+{
+	int freed = BufferManager_Shrink(SECONDFS_SHRINKER_POOL(s)->bm, sc->nr_to_scan);
+
+	return freed ? freed : SHRINK_STOP;
+}
+
+static ssize_t secondfs_bufs_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct secondfs_bufpool *pool = container_of(kobj, struct secondfs_bufpool, kobj);
+
+	return sprintf(buf, "%d\n", atomic_read(&pool->bm->b_nalloc));
+}
+
+static ssize_t secondfs_bufs_max_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct secondfs_bufpool *pool = container_of(kobj, struct secondfs_bufpool, kobj);
+
+	return sprintf(buf, "%d\n", pool->bm->m_nbuf);
+}
+
+static ssize_t secondfs_bufs_min_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct secondfs_bufpool *pool = container_of(kobj, struct secondfs_bufpool, kobj);
+
+	return sprintf(buf, "%d\n", pool->bm->m_nmin);
+}
+
+// 预读只服务于目录 (文件数据靠页缓存的通用预读), 映射缓存服务于所有大文件
+// Read-ahead only serves directories (file data uses the page cache's
+// generic read-ahead); the mapping cache serves every large file
+static ssize_t secondfs_ra_hits_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct secondfs_bufpool *pool = container_of(kobj, struct secondfs_bufpool, kobj);
+
+	return sprintf(buf, "%u\n", (unsigned)atomic_read(&pool->bm->b_ra_hits));
+}
+
+static ssize_t secondfs_ra_misses_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct secondfs_bufpool *pool = container_of(kobj, struct secondfs_bufpool, kobj);
+
+	return sprintf(buf, "%u\n", (unsigned)atomic_read(&pool->bm->b_ra_misses));
+}
+
+static ssize_t secondfs_ext_hits_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct secondfs_bufpool *pool = container_of(kobj, struct secondfs_bufpool, kobj);
+
+	return sprintf(buf, "%u\n", (unsigned)atomic_read(&pool->bm->b_ext_hits));
+}
+
+static struct kobj_attribute secondfs_attr_bufs = __ATTR(bufs, S_IRUGO, secondfs_bufs_show, NULL);
+static struct kobj_attribute secondfs_attr_bufs_max = __ATTR(bufs_max, S_IRUGO, secondfs_bufs_max_show, NULL);
+static struct kobj_attribute secondfs_attr_bufs_min = __ATTR(bufs_min, S_IRUGO, secondfs_bufs_min_show, NULL);
+static struct kobj_attribute secondfs_attr_ra_hits = __ATTR(ra_hits, S_IRUGO, secondfs_ra_hits_show, NULL);
+static struct kobj_attribute secondfs_attr_ra_misses = __ATTR(ra_misses, S_IRUGO, secondfs_ra_misses_show, NULL);
+static struct kobj_attribute secondfs_attr_ext_hits = __ATTR(ext_hits, S_IRUGO, secondfs_ext_hits_show, NULL);
+
+static struct attribute *secondfs_bufpool_attrs[] = {
+	&secondfs_attr_bufs.attr,
+	&secondfs_attr_bufs_max.attr,
+	&secondfs_attr_bufs_min.attr,
+	&secondfs_attr_ra_hits.attr,
+	&secondfs_attr_ra_misses.attr,
+	&secondfs_attr_ext_hits.attr,
+	NULL,
+};
+
+static const struct attribute_group secondfs_bufpool_group = {
+	.attrs = secondfs_bufpool_attrs,
+};
+
+static void secondfs_bufpool_release(struct kobject *kobj)
+{
+	kfree(container_of(kobj, struct secondfs_bufpool, kobj));
+}
+
+static struct kobj_type secondfs_bufpool_ktype = {
+	.sysfs_ops = &kobj_sysfs_ops,
+	.release = secondfs_bufpool_release,
+};
+
+/* secondfs_bufpool_register : 为挂载的卷注册 shrinker 和 sysfs 目录.
+ *                            Register the shrinker and sysfs directory
+ *                            of a mounted volume.
+ * 返回 0 或负的错误号. Returns 0 or a negative errno.
+ */
+static int secondfs_bufpool_register(BufferManager *bm, struct super_block *sb)
+{
+	struct secondfs_bufpool *pool;
+	int ret;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return -ENOMEM;
+	pool->bm = bm;
+
+	// 从这里起 pool 由 kobject 的引用计数释放
+	// From here on pool is freed through the kobject's refcount
+	ret = kobject_init_and_add(&pool->kobj, &secondfs_bufpool_ktype,
+		secondfs_kobj, "%s", sb->s_id);
+	if (ret)
+		goto out_put;
+	ret = sysfs_create_group(&pool->kobj, &secondfs_bufpool_group);
+	if (ret)
+		goto out_del;
+
+	pool->shrinker.count_objects = secondfs_bufpool_count;
+	pool->shrinker.scan_objects = secondfs_bufpool_scan;
+	pool->shrinker.seeks = DEFAULT_SEEKS;
+	ret = register_shrinker(&pool->shrinker);
+	if (ret)
+		goto out_del;
+
+	bm->b_pool = pool;
+	return 0;
+
+out_del:
+	kobject_del(&pool->kobj);
+out_put:
+	kobject_put(&pool->kobj);
+	return ret;
+}
+
+/* secondfs_bufpool_unregister : 在释放 BufferManager 之前调用.
+ *                              Call before the BufferManager is freed.
+ */
+static void secondfs_bufpool_unregister(BufferManager *bm)
+{
+	struct secondfs_bufpool *pool = bm->b_pool;
+
+	if (!pool)
+		return;
+
+	unregister_shrinker(&pool->shrinker);
+	kobject_del(&pool->kobj);
+	kobject_put(&pool->kobj);
+	bm->b_pool = NULL;
+}
+
 /* 
  * secondfs_fill_super : 初始化超块. Initialize the vfs super_block.
  * 其指针会传给内核供其初始化超块. Pointer to it is passed to system.
@@ -283,8 +588,17 @@ static void secondfs_write_super(struct super_block *sb)
  *           函数的作用就是合理初始化它.
  * 		VFS super_block from the system.
  * 		We must properly fill/initialize it.
- *      data(自定义数据) 和 silent 我们这里不用
- * 		data/silent is not used here.
+ *      data : 挂载选项字符串, 目前只识别 bufs=N (本卷缓存块数上限),
+ *             bufs_min=N (内存紧张时也保留的缓存块数), bufgroup/nobufgroup
+ *             , bh/nobh (缓冲区用块设备页缓存的 buffer_head) 和
+ *             delalloc/nodelalloc (缓冲写的盘块在回写时才分配)
+ * 		mount options; bufs=N (most buffers for this volume),
+ * 		bufs_min=N (buffers kept under memory pressure),
+ * 		bufgroup/nobufgroup (group buffers by page), bh/nobh
+ * 		(buffers are buffer_heads of the block device's page cache)
+ * 		and delalloc/nodelalloc (blocks of buffered writes are
+ * 		allocated at writeback) are known.
+ *      silent 我们这里不用. silent is not used here.
  * 
  * Procedure: read SuperBlock blocks(1024 Bytes) and fill the 
  * super_block properly using information from it.
@@ -300,16 +614,59 @@ int secondfs_fill_super(struct super_block *sb, void *data, int silent)
 {
 	SuperBlock *secsb;
 	Devtab *devtab;
+	BufferManager *bm;
 	struct inode *root_inode;
+	int nbuf, nmin, group, bh, delalloc;
 	int ret = 0;
 
-	secondfs_dbg(SB_FILL, "SB %p: newing SuperBlock & Devtab...", SECONDFS_SB(sb));
+	ret = secondfs_parse_options(data, &nbuf, &nmin, &group, &bh, &delalloc);
+	if (ret)
+		return ret;
+
+	// 页缓存以 512 字节的块映射文件 (secondfs_get_block);
+	// buffer_head 后端的 __getblk() 也要求块设备的块大小与之一致
+	// The page cache maps files in 512-byte blocks (secondfs_get_block);
+	// __getblk() of the buffer_head backend relies on it as well
+	if (!sb_set_blocksize(sb, SECONDFS_BLOCK_SIZE)) {
+		secondfs_err("fill_super: unable to set blocksize %d.", SECONDFS_BLOCK_SIZE);
+		return -EINVAL;
+	}
+
+	secondfs_dbg(SB_FILL, "SB %p: newing SuperBlock, Devtab & BufferManager...", SECONDFS_SB(sb));
 	secsb = newSuperBlock();
 	devtab = newDevtab();
+	bm = newBufferManager();
+
+	// 从这里起 Bdwrite() 就可能启动回写任务; 挂载成功后才开始定期运行
+	// Bdwrite() may kick it from now on; it turns periodic once mounted
+	if (bm)
+		INIT_DELAYED_WORK(&bm->b_wb_work, secondfs_writeback_workfn);
+
+	if (!secsb || !devtab || !bm) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+
+	// 每个卷有自己的缓存池. Each volume owns its own buffer pool.
+	// 先只分配 bufs_min 个缓冲区, 其余的在 GetBlk() 中按需分配
+	// Only bufs_min buffers up front; GetBlk() allocates the rest on demand
+	ret = BufferManager_Initialize(bm, nbuf, nmin, group ? SECONDFS_GROUP_SHIFT : 0, bh);
+	if (ret < 0) {
+		secondfs_err("fill_super: failed allocating %d buffers.", nmin);
+		goto out_free;
+	}
+
+	ret = secondfs_bufpool_register(bm, sb);
+	if (ret < 0) {
+		secondfs_err("fill_super: failed registering the buffer pool shrinker.");
+		goto out_free;
+	}
 
 	secsb->s_dev = devtab;
 	secsb->s_dev->d_bdev = sb->s_bdev;
+	secsb->s_dev->d_bufmgr = bm;
 	secsb->s_vsb = sb;
+	secsb->s_bufmgr = bm;
 	
 	// Read SuperBlock(little-endian) from the disk.
 	// 从硬盘读入 Superblock 块. 注意, 未作任何大小字序转换!
@@ -319,6 +676,27 @@ int secondfs_fill_super(struct super_block *sb, void *data, int silent)
 		goto out_free;
 	}
 
+	// 超块和外存 Inode 区是元数据, 在缓存池中优先保留 (索引块由 Bmap 标记)
+	// The superblock and the inode zone are metadata and stay hot in
+	// the buffer pool (Bmap marks the index blocks)
+	devtab->d_metaend = SECONDFS_INODE_ZONE_START_SECTOR + le32_to_cpu(secsb->s_isize);
+	// 成组读入不越过卷尾 Group reads stop at the end of the volume
+	devtab->d_nblocks = le32_to_cpu(secsb->s_fsize);
+
+	// 沿空闲盘块链建立空闲盘块位图 Build the free block bitmap from the free chain
+	ret = FileSystem_LoadFreeMap(secondfs_filesystemp, secsb);
+	if (ret < 0) {
+		secondfs_err("fill_super: bad free block chain.");
+		goto out_free;
+	}
+	// 扫描外存 Inode 区建立空闲 Inode 位图 Build the free inode bitmap from the inode zone
+	ret = FileSystem_LoadInodeMap(secondfs_filesystemp, secsb);
+	if (ret < 0) {
+		secondfs_err("fill_super: failed building the free inode bitmap.");
+		goto out_free;
+	}
+	secsb->s_delalloc = delalloc;
+
 	// Fill VFS sb according to SuperBlock
 	// 根据读入的超块, 更新 VFS 超块的内容.
 	sb->s_fs_info = secsb;
@@ -370,11 +748,25 @@ int secondfs_fill_super(struct super_block *sb, void *data, int silent)
 
 	inode_init_owner(root_inode, NULL, root_inode->i_mode);
 	secondfs_write_super(sb);
+	queue_delayed_work(system_long_wq, &bm->b_wb_work,
+		msecs_to_jiffies(max(secondfs_wb_interval, 1)));
 	goto out;
 
 out_free:
-	deleteSuperBlock(secsb);
-	deleteDevtab(devtab);
+	sb->s_fs_info = NULL;
+	// 与 put_super 相同, 先停掉后台回写并等 I/O 结束, 它们还会用到 Devtab
+	// As in put_super: stop writeback and wait for I/O first, they still use the Devtab
+	if (bm) {
+		cancel_delayed_work_sync(&bm->b_wb_work);
+		secondfs_bufpool_unregister(bm);
+		BufferManager_Bdrain(bm);
+	}
+	if (secsb)
+		deleteSuperBlock(secsb);
+	if (devtab)
+		deleteDevtab(devtab);
+	if (bm)
+		deleteBufferManager(bm);
 
 out:
 	return ret;
@@ -405,8 +797,16 @@ void secondfs_put_super(struct super_block *sb)
 		secondfs_sync_fs(sb, 1);
 #endif
 
-	BufferManager_Bflush(secondfs_buffermanagerp, secsb->s_dev);
+	// 停掉后台回写, 剩下的脏块由 Bflush() 写完
+	// Stop background writeback; Bflush() writes whatever is left
+	cancel_delayed_work_sync(&secsb->s_bufmgr->b_wb_work);
+	BufferManager_Bflush(secsb->s_bufmgr, secsb->s_dev);
 
+	secondfs_bufpool_unregister(secsb->s_bufmgr);
+	// 等预读等异步 I/O 也结束, 之后才能释放缓存池
+	// Wait for asynchronous I/O such as read-ahead before freeing the pool
+	BufferManager_Bdrain(secsb->s_bufmgr);
+	deleteBufferManager(secsb->s_bufmgr);
 	deleteDevtab(secsb->s_dev);
 	deleteSuperBlock(secsb);
 }
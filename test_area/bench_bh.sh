@@ -0,0 +1,68 @@
+#!/bin/bash -x
+
+# Compares the two buffer backends on the same metadata workload.
+# For each backend (nobh: the pool's own buffers read with bios;
+# bh: buffer_heads of the block device's page cache), a fresh volume
+# is filled with small files in many directories, then timed:
+#  - walking it with `ls -lR` after dropping dentries and inodes, with
+#    a pool much smaller than the metadata, so most lookups miss the
+#    pool (with bh they may still hit the page cache);
+#  - creating and removing files, i.e. metadata writes.
+# 在同一个元数据负载上比较两种缓冲区后端 (nobh: 缓存池自己的缓冲区,
+# 经 bio 读写; bh: 块设备页缓存中的 buffer_head). 对每种后端新建一个卷,
+# 在许多目录中建小文件, 然后计时:
+#  - 清掉 dentry 和 inode 缓存后 `ls -lR` 遍历. 缓存池远小于元数据,
+#    查找多半不命中缓存池 (bh 下还可能命中页缓存);
+#  - 建立和删除文件, 即元数据写.
+# Usage: ./bench_bh.sh [NBUF] [ROUNDS]
+#
+# Not done: the request also asked for the nobh and bh times of this
+# workload side by side. That part is not done and no numbers are
+# recorded here: the module has not been built or loaded against a
+# kernel yet.
+# 未完成: 请求还要求对比这一负载下 nobh 与 bh 的耗时. 这部分没有做,
+# 这里没有数据: 本模块还没有在内核上编译和加载过.
+
+. ./bench_common.sh
+
+NBUF=${1:-256}
+ROUNDS=${2:-5}
+NDIRS=20
+NFILES=200
+
+bench_load
+
+set -e
+
+for backend in nobh bh; do
+	bench_mount 1M 64 bufs=$NBUF,$backend
+
+	for i in $(seq $NDIRS); do
+		sudo mkdir dir2/d$i
+		sudo sh -c "for j in \$(seq $NFILES); do echo \$j > dir2/d$i/f\$j; done"
+	done
+	sync
+
+	echo "$backend, bufs=$NBUF: $ROUNDS rounds of ls -lR over $((NDIRS * NFILES)) files"
+	time (
+		for r in $(seq $ROUNDS); do
+			echo 2 | sudo tee /proc/sys/vm/drop_caches > /dev/null
+			ls -lR dir2 > /dev/null
+		done
+	)
+
+	echo "$backend, bufs=$NBUF: creating and removing $((NDIRS * NFILES)) files"
+	time (
+		for i in $(seq $NDIRS); do
+			sudo sh -c "for j in \$(seq $NFILES); do echo \$j > dir2/d$i/g\$j; done"
+		done
+		for i in $(seq $NDIRS); do
+			sudo sh -c "rm -f dir2/d$i/g*"
+		done
+		sync
+	)
+
+	bench_umount
+done
+
+bench_unload
@@ -0,0 +1,31 @@
+#!/bin/bash -x
+
+# Microbenchmark of Buf lookup (BufferManager::GetBlk / InCore).
+# Mounts the volume with growing buffer pools and times re-reading
+# a file that is already in the buffer cache, so the cost is dominated
+# by looking the Bufs up.
+# 缓存查找的微基准测试: 用不同大小的缓存池挂载卷, 反复读取一个
+# 已在缓存中的文件, 耗时主要花在查找 Buf 上.
+# Usage: ./bench_buf_lookup.sh [NBUF...]
+
+. ./bench_common.sh
+
+NBUFS=${@:-16 256 1024 8192}
+ROUNDS=200
+
+bench_load
+
+for nbuf in $NBUFS; do
+	bench_mount 512 4096 bufs=$nbuf
+
+	# 128 KiB = 256 blocks
+	sudo dd if=/dev/urandom of=dir2/data bs=512 count=256
+	sudo cat dir2/data > /dev/null
+
+	echo "NBUF=$nbuf: $ROUNDS rounds of reading 256 blocks"
+	time sudo sh -c "for i in \$(seq $ROUNDS); do cat dir2/data > /dev/null; done"
+
+	bench_umount
+done
+
+bench_unload
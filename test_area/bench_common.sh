@@ -0,0 +1,36 @@
+# Setup and teardown shared by the bench_*.sh scripts.
+# Source it from test_area: . ./bench_common.sh
+# bench_*.sh 共用的准备和清理步骤, 在 test_area 中 source 它.
+
+# bench_load [PARAM=VALUE...] : 编译并重新加载模块. Build and reload the module.
+bench_load() {
+	cd ..
+	make || exit 1
+	cd test_area
+
+	mkdir -p dir dir2 dir3
+	sudo umount dir2
+	sudo rmmod secondfs
+	sudo insmod ../secondfs.ko "$@" || exit 1
+}
+
+# bench_mount BS COUNT [OPTIONS] : 新建 BS * COUNT 字节的卷 bench.img 并挂载到 dir2.
+# Make a fresh BS * COUNT byte volume bench.img and mount it on dir2.
+bench_mount() {
+	dd if=/dev/zero of=bench.img bs=$1 count=$2 || exit 1
+	../mkfs.secondfs bench.img || exit 1
+	sudo mount -t secondfs -o loop${3:+,$3} bench.img ./dir2 || exit 1
+}
+
+# bench_umount [fsck] : 卸载 dir2, 给出 fsck 时再检查卷. Unmount, then check the volume if asked.
+bench_umount() {
+	sudo umount dir2 || exit 1
+	if [ "$1" = fsck ]; then
+		../fsck.secondfs bench.img || exit 1
+	fi
+}
+
+# bench_unload : 卸载模块. Unload the module.
+bench_unload() {
+	sudo rmmod secondfs
+}
@@ -0,0 +1,57 @@
+#!/bin/bash -x
+
+# Flush time of many dirty buffers.
+# Background writeback is held off, then sparse files are written so
+# that every 64 KiB of file needs a new indirect block (a metadata Buf
+# marked dirty in the pool). `sync` then flushes them all in one
+# Bflush(); the kernel log line "secondfs-FL" shows how many dirty Bufs
+# were written, in how many requests, and how long it took.
+# 大量脏缓存块的刷写耗时: 先关掉后台回写, 再写稀疏文件, 使文件每 64 KiB
+# 就要分配一个新的索引块 (缓存池中的一个脏 Buf). 随后 sync 在一次
+# Bflush() 中把它们全部写出; 内核日志中的 "secondfs-FL" 一行给出
+# 写出的脏块数, 请求数和耗时.
+# Usage: ./bench_flush.sh [NDIRTY...]
+#
+# Not done: the request also asked for the flush times of 1000 and
+# 10000 dirty buffers before and after the sorted Bflush(). That part
+# is not done and no numbers are recorded here: the module has not
+# been built or loaded against a kernel yet.
+# 未完成: 请求还要求给出 1000 和 10000 个脏块时排序合并前后的刷写耗时.
+# 这部分没有做, 这里没有数据: 本模块还没有在内核上编译和加载过.
+
+. ./bench_common.sh
+
+NDIRTYS=${@:-1000 10000}
+
+bench_load wb_interval=3600000 dirty_expire=3600000 dirty_ratio=100
+
+set -e
+
+for ndirty in $NDIRTYS; do
+	bench_mount 1M 64 bufs=$((ndirty * 2))
+
+	# A 16 MiB file has about 258 indirect blocks
+	# 16 MiB 的文件约有 258 个索引块
+	sudo python3 - dir2 $ndirty <<'EOF'
+import os, sys
+d, n = sys.argv[1], int(sys.argv[2])
+i = 0
+while n > 0:
+    fd = os.open(os.path.join(d, "f%d" % i), os.O_WRONLY | os.O_CREAT, 0o644)
+    off = 0
+    while off < 16 * 1024 * 1024 - 512 and n > 0:
+        os.pwrite(fd, b"x", off)
+        off += 64 * 1024
+        n -= 1
+    os.close(fd)
+    i += 1
+EOF
+
+	echo "about $ndirty dirty buffers"
+	time sudo sync
+	dmesg | grep "secondfs-FL" | tail -n 3
+
+	bench_umount fsck
+done
+
+bench_unload
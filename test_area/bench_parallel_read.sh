@@ -0,0 +1,51 @@
+#!/bin/bash -x
+
+# Multi-threaded metadata read scalability.
+# Fills a volume with many small files spread over one directory per
+# CPU, then for T = 1, 2, 4, ... walks T of those directories in
+# parallel with `ls -lR` after dropping the kernel caches. File data
+# sits in the page cache, so the walk mostly looks up inode and
+# directory blocks in the Buf pool; with one pool lock the time per
+# round stops going down as T grows.
+# 多线程元数据读的可扩展性: 在每个 CPU 一个目录中建大量小文件, 然后对
+# T = 1, 2, 4, ... 在清掉内核缓存后并行 `ls -lR` 其中 T 个目录.
+# 文件数据在页缓存中, 遍历主要是在缓存池中查找 inode 块和目录块;
+# 整个缓存池只有一把锁时, T 增大后每轮耗时不再下降.
+# Usage: ./bench_parallel_read.sh [ROUNDS]
+
+. ./bench_common.sh
+
+ROUNDS=${1:-5}
+NCPU=$(nproc)
+NFILES=$((6000 / NCPU))
+
+bench_load
+
+set -e
+
+bench_mount 1M 64 bufs=4096
+
+for i in $(seq $NCPU); do
+	sudo mkdir dir2/d$i
+	sudo sh -c "for j in \$(seq $NFILES); do echo \$j > dir2/d$i/f\$j; done"
+done
+sync
+
+T=1
+while [ $T -le $NCPU ]; do
+	echo "$T readers, $ROUNDS rounds"
+	time (
+		for r in $(seq $ROUNDS); do
+			echo 2 | sudo tee /proc/sys/vm/drop_caches > /dev/null
+			for i in $(seq $T); do
+				ls -lR dir2/d$i > /dev/null &
+			done
+			wait
+		done
+	)
+	T=$((T * 2))
+done
+
+bench_umount fsck
+
+bench_unload
@@ -0,0 +1,39 @@
+#!/bin/bash -x
+
+# Small-file write throughput.
+# Creates many small files (1 KiB, i.e. direct blocks only) and some
+# files a bit larger than 6 blocks (which need an indirect table),
+# then checks the volume with fsck. Run it on builds before and after
+# a change to compare the timings.
+# 小文件写吞吐量测试: 创建大量 1 KiB 的小文件 (只用直接索引) 和
+# 一些超过 6 块的文件 (需要一次间接索引表), 最后用 fsck 检查卷.
+# 在修改前后的版本上分别运行, 比较耗时.
+# Usage: ./bench_smallwrite.sh [NFILES]
+
+. ./bench_common.sh
+
+NFILES=${1:-500}
+
+bench_load
+
+set -e
+
+bench_mount 512 16384
+
+head -c 1024 /dev/urandom > small.dat
+head -c 4096 /dev/urandom > large.dat
+
+echo "$NFILES files of 1 KiB"
+time sudo sh -c "for i in \$(seq $NFILES); do cat small.dat > dir2/s\$i; done; sync"
+
+echo "$((NFILES / 10)) files of 4 KiB"
+time sudo sh -c "for i in \$(seq $((NFILES / 10))); do cat large.dat > dir2/l\$i; done; sync"
+
+bench_umount fsck
+
+sudo mount -t secondfs -o loop bench.img ./dir2
+cmp small.dat dir2/s1
+cmp large.dat dir2/l1
+bench_umount
+
+bench_unload
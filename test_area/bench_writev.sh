@@ -0,0 +1,51 @@
+#!/bin/bash -x
+
+# Vectored write throughput.
+# Writes the same file once with 16-segment writev() calls and once
+# with 16 separate write() calls of the same segments, and compares
+# the timings. Segments are 512 bytes (one block each).
+# 多段写吞吐量测试: 分别用 16 段的 writev() 和 16 次单独的 write()
+# 写同样的数据 (每段 512 字节, 即一块), 比较耗时.
+# Usage: ./bench_writev.sh [MIB]
+
+. ./bench_common.sh
+
+MIB=${1:-16}
+SEGS=16
+SEGSIZE=512
+
+bench_load
+
+set -e
+
+bench_mount 1M $((MIB * 2 + 4))
+
+# $1 = writev | write, $2 = output file
+run() {
+	sudo python3 - "$1" "$2" $MIB $SEGS $SEGSIZE <<'PYEOF'
+import os, sys, time
+mode, path, mib, segs, segsize = sys.argv[1], sys.argv[2], int(sys.argv[3]), int(sys.argv[4]), int(sys.argv[5])
+bufs = [bytes([65 + s]) * segsize for s in range(segs)]
+calls = mib * 1024 * 1024 // (segs * segsize)
+fd = os.open(path, os.O_WRONLY | os.O_CREAT | os.O_TRUNC, 0o644)
+t = time.time()
+for _ in range(calls):
+	if mode == "writev":
+		os.writev(fd, bufs)
+	else:
+		for b in bufs:
+			os.write(fd, b)
+os.fsync(fd)
+t = time.time() - t
+os.close(fd)
+print("%-6s: %d MiB in %.3f s, %.1f MiB/s, %d syscalls" % (mode, mib, t, mib / t, calls if mode == "writev" else calls * segs))
+PYEOF
+}
+
+run writev dir2/v.dat
+run write dir2/w.dat
+cmp dir2/v.dat dir2/w.dat
+
+bench_umount fsck
+
+bench_unload